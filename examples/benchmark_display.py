@@ -0,0 +1,54 @@
+# This script runs the full display loop against the simulated
+# backend, so it works on any Linux machine without a Pi, screen or
+# wiringPi. It builds a full field grating and a gabor in each file
+# format, plays each one, and reports the interframe time and how long
+# filling the back buffer and flipping took each frame.
+#
+# Frames that take longer to fill than one refresh period would miss
+# vsync on a real screen, so a max_copy creeping towards the period
+# (16667 us at 60 Hz) is the number to watch. Each frame's vsync is
+# also counted from its trace, and any refresh a frame overstayed is
+# reported as a missed vsync.
+
+import rpg
+import os
+import tempfile
+
+resolution = (1280, 720)
+refresh_rate = 60
+
+options = {"duration": 2,
+           "angle": 30,
+           "spac_freq": 0.2,
+           "temp_freq": 1,
+           "resolution": resolution,
+           "fps": refresh_rate,
+           "kernel": rpg.KERNEL_LUT,
+          }
+
+stimuli = [
+  #name, build function, extra options
+  ("grating", rpg.build_grating, {}),
+  ("grating rowshift", rpg.build_grating, {"format": rpg.FORMAT_ROWSHIFT}),
+  ("gabor", rpg.build_gabor, {"percent_sigma": 10}),
+  ("gabor rowshift", rpg.build_gabor, {"percent_sigma": 10, "format": rpg.FORMAT_ROWSHIFT}),
+]
+
+directory = tempfile.mkdtemp()
+screen = rpg.Screen(resolution, backend="sim", refresh_rate=refresh_rate)
+print("Copying frames with %s, %d us per frame" %(screen.blit_method, screen.blit_time))
+
+for name, build, extra in stimuli:
+  filename = os.path.join(directory, name.replace(" ", "_"))
+  build(filename, dict(options, **extra))
+  grating = screen.load_grating(filename)
+  perf = screen.display_grating(grating, trace=True)
+  print("  %-18s interframe %8.1f +- %6.1f us   copy mean %7.1f max %7.1f us   flip mean %5.1f max %5.1f us   missed %d of %d"
+        %(name, perf.mean_interframe, perf.stddev_interframe, perf.mean_copy,
+          perf.max_copy, perf.mean_flip, perf.max_flip, perf.missed_vsyncs,
+          len(perf.trace)//40))
+  del grating
+  os.remove(filename)
+
+screen.close()
+os.rmdir(directory)
@@ -0,0 +1,77 @@
+# This script compares the speed of the two rendering kernels,
+# rpg.KERNEL_EXACT and rpg.KERNEL_LUT, by rendering frames into
+# memory at 1280x720 and 1920x1080. Nothing is written to disk and
+# the screen is not touched, so it can be run from anywhere.
+#
+# As well as the time per frame, it reports how many pixels the
+# lookup table kernel renders differently to the exact kernel.
+#
+# It then times the lookup table kernel with each set of vector
+# instructions the CPU supports (see rpg.set_simd()), checking each
+# renders exactly the same pixels as the plain C version.
+
+import rpg
+from rpg import rpigratings
+import time
+
+frames = 20       #frames rendered per measurement
+fps = 60          #refresh rate the gratings are built for
+threads = 1       #set to 0 to use every core
+
+stimuli = [
+  #name, angle, waveform, percent_sigma, percent_diameter
+  ("sine 0deg", 0, rpg.SINE, 0, 0),
+  ("sine 30deg", 30, rpg.SINE, 0, 0),
+  ("square 30deg", 30, rpg.SQUARE, 0, 0),
+  ("masked 30deg", 30, rpg.SINE, 0, 40),
+  ("gabor 30deg", 30, rpg.SINE, 10, 0),
+]
+
+
+def render(resolution, angle, waveform, sigma, diameter, kernel):
+  start = time.perf_counter()
+  for t in range(frames):
+    frame = rpigratings.render_frame(t, fps, angle, 0.2, 1, 1, 127,
+                                     resolution[0], resolution[1], waveform,
+                                     sigma, diameter, 50, 50, 10,
+                                     threads, kernel)
+  return (time.perf_counter() - start) / frames, frame
+
+
+def count_differences(frame1, frame2):
+  pixels1 = memoryview(frame1).cast("H")
+  pixels2 = memoryview(frame2).cast("H")
+  return sum(1 for a, b in zip(pixels1, pixels2) if a != b)
+
+
+for resolution in [(1280, 720), (1920, 1080)]:
+  print("%dx%d" %resolution)
+  for name, angle, waveform, sigma, diameter in stimuli:
+    exact, exact_frame = render(resolution, angle, waveform, sigma, diameter, rpg.KERNEL_EXACT)
+    lut, lut_frame = render(resolution, angle, waveform, sigma, diameter, rpg.KERNEL_LUT)
+    print("  %-14s exact %7.2f ms   lut %7.2f ms   speedup %5.1fx   differing pixels %d"
+          %(name, exact*1000, lut*1000, exact/lut, count_differences(exact_frame, lut_frame)))
+
+
+simd_sets = []
+for name in ["scalar", "sse2", "avx2", "neon"]:
+  try:
+    rpg.set_simd(name)
+    simd_sets.append(name)
+  except ValueError:
+    pass
+
+for resolution in [(1280, 720), (1920, 1080)]:
+  print("%dx%d lookup table kernel" %resolution)
+  for name, angle, waveform, sigma, diameter in stimuli:
+    rpg.set_simd("scalar")
+    scalar, scalar_frame = render(resolution, angle, waveform, sigma, diameter, rpg.KERNEL_LUT)
+    results = []
+    for simd in simd_sets[1:]:
+      rpg.set_simd(simd)
+      vector, vector_frame = render(resolution, angle, waveform, sigma, diameter, rpg.KERNEL_LUT)
+      results.append("%s %6.2f ms (%4.1fx, %s)" %(simd, vector*1000, scalar/vector,
+                     "identical" if vector_frame == scalar_frame else "DIFFERENT"))
+    print("  %-14s scalar %6.2f ms   %s" %(name, scalar*1000, "   ".join(results)))
+
+rpg.set_simd("auto")
@@ -1,7 +1,6 @@
 # This script loads an example image from the scipy library
-# and then converts it to a format suitable for conversion
-# with rpg.convert_raw(). Use this as a basis for converting
-# your own raw data
+# and converts it with rpg.convert_raw(). Use this as a basis for
+# converting your own raw data
 
 import rpg
 from scipy import misc
@@ -11,27 +10,21 @@ import numpy as np
 face = misc.face()
 
 #face is a 3D numpy array of uint8
-#face.shape is (768,1024,3)
-
-#Preallocate a single dimension numpy array to hold the reordered data
-flatim = np.zeros(np.size(face), dtype=np.uint8)
-
-#Place all of the red data at index 0, and every 3rd index from then
-flatim[0::3] = face[:,:,0].flatten()
-#Place all of the blue data at index 1, and every 3rd index from then
-flatim[1::3] = face[:,:,1].flatten()
-#Place all of the green data at index 2 and every 3rd index from then
-flatim[2::3] = face[:,:,2].flatten()
-
-#save the data to drive in this format, making doubly sure to save it as uint8
-with open("/home/pi/test/simpleraw.raw", mode="wb") as fh:
-    flatim.astype(np.uint8).tofile(fh)
+#face.shape is (768,1024,3), i.e. rows of pixels, each red, green then blue,
+#which is the order convert_raw() expects. It reads the array directly,
+#taking the width and height from its shape. A movie would be shaped
+#(n_frames, height, width, 3).
+face = np.ascontiguousarray(face, dtype=np.uint8)
 
 #use RPG to convert it
-rpg.convert_raw("~/test/simpleraw.raw", "~/test/convertedsimpleraw.raw", 1, 1024, 768, 100)
+rpg.convert_raw(face, "~/test/convertedsimpleraw.raw", refreshes_per_frame=100)
+
+#Data saved to a file in the same order, e.g. with face.tofile(), can be
+#converted the same way by passing the file name, the number of frames and
+#the size of the image:
+#rpg.convert_raw("~/test/simpleraw.raw", "~/test/convertedsimpleraw.raw", 1, 1024, 768, 100)
 
 #Display it when done, just to be sure.
 myscreen = rpg.Screen(resolution=(1024,768))
 raw = myscreen.load_raw("~/test/convertedsimpleraw.raw")
 myscreen.display_raw(raw)
-
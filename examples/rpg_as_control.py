@@ -1,7 +1,5 @@
 import rpg
-import gpiozero #new default GPIO control library
 import os
-import time
 
 # This code is an example of the Pi acting as the controller
 # for your experiemtn, where some other device (for instance a
@@ -25,9 +23,9 @@ import time
 #
 # 3.3V  __|___________________
 #
-# Move the pin_out.off() on line 108 to line 103 (before 
-# time.sleep(delay) ). You may need to add time.sleep(0.001) 
-# between the on() and off() calls, if your pulse is too fast.
+# Move the rpg.PinEvent(pin_out, 0) in the steps below to just
+# after the first rpg.PinEvent(pin_out, 1), with an rpg.Grey(1)
+# between them if your pulse is too fast.
 
 
 
@@ -56,13 +54,11 @@ rpg.build_list_of_gratings("grating", "~/gratings/variable_ori/", options)
 
 
 ## GPIO Stuff.
-# Initilize a GPIO pin as a digital out.
-# If argument is provided as an integer
-# then using BCM numbering scheme, where
-# 22 is GPIO3, or physical pin 15. Run
-# gpio readall from the command line for
-# a guide
-pin_out = gpiozero.DigitalOutputDevice(22)
+# The output pin is driven by the sequence itself, so it changes on
+# the same vsync as the screen. It is numbered as by wiringPi: pin 3
+# is GPIO22, or physical pin 15. Run gpio readall from the command
+# line for a guide
+pin_out = 3
 
 myscreen = rpg.Screen()
 
@@ -94,16 +90,26 @@ for file in randomized_path_to_gratings:
 
 print("Displaying in order of: " + str([x.split("/")[-1] for x in randomized_path_to_gratings ] ))
 myscreen.display_greyscale(myscreen.background)
-# You might want to add another time.delay()
+# You might want to start the steps with an rpg.Grey()
 # So that the subject aclimatizes to the background
 
+## Build the whole experiment as one sequence
+# Delays are counted in screen refreshes, and the sequence runs
+# every trial back to back without returning to Python, so the
+# timing doesn't drift from the screen's however long it runs
+def refreshes(seconds):
+  return int(round(seconds * myscreen.refresh_rate))
+
+steps = []
 for _ in range(repeats):
   for grating in gratings:
-    pin_out.on()
-    time.sleep(delay)
-    performance_record = myscreen.display_grating(grating)
-    myscreen.display_greyscale(myscreen.background)
-    myscreen._print_log("log.txt", "grating", grating.filename, performance_record)
-    time.sleep(post_delay)
-    pin_out.off()
-    time.sleep(intertrial)
+    steps += [rpg.PinEvent(pin_out, 1), rpg.Grey(refreshes(delay)),
+              grating,
+              rpg.Grey(refreshes(post_delay)), rpg.PinEvent(pin_out, 0),
+              rpg.Grey(refreshes(intertrial))]
+
+performance_records = myscreen.display_sequence(steps)
+# None if a key was pressed or the sequence was cancelled
+if performance_records is not None:
+  for performance_record in performance_records:
+    myscreen._print_log("log.txt", "grating", performance_record.stimulus, performance_record)
@@ -17,21 +17,80 @@ import time as t
 import os
 import sys
 import hashlib
+import struct
+import threading
+import weakref
+import itertools
+import fcntl
+import json
+import concurrent.futures
+from collections import OrderedDict
 from collections import namedtuple
 
-GratPerfRec = namedtuple("GratingPerformanceRecord",["mean_interframe","stddev_interframe","start_time"])
+GratPerfRec = namedtuple("GratingPerformanceRecord",["mean_interframe","stddev_interframe","start_time",
+                                                     "mean_copy","max_copy","mean_flip","max_flip",
+                                                     "missed_vsyncs","trigger_time","trigger_latency",
+                                                     "trace"])
+
+StreamPerfRec = namedtuple("StreamPerformanceRecord", GratPerfRec._fields +
+                           ("underruns","min_buffered"))
+
+TrialPerfRec = namedtuple("TrialPerformanceRecord", GratPerfRec._fields +
+                          ("onset_time","onset_vsync","late_vsyncs","stimulus"))
+
+ProceduralPerfRec = namedtuple("ProceduralPerformanceRecord", GratPerfRec._fields +
+                               ("late_frames",))
+
+#Steps of a sequence besides loaded stimuli, see Screen.display_sequence()
+Grey = namedtuple("Grey", ["refreshes"])
+PinEvent = namedtuple("PinEvent", ["pin", "value"])
+
+BuildReport = namedtuple("BuildReport",["files","frames","bytes","seconds",
+                                         "frames_per_second","mb_per_second"])
+
+RealtimeReport = namedtuple("RealtimeReport",["before_mean","before_stddev","before_missed",
+                                               "after_mean","after_stddev","after_missed",
+                                               "fifo","pinned","locked"])
+
+#Layout of one frame of a trace; numpy.frombuffer(perf.trace, dtype=TRACE_DTYPE)
+#gives a structured array without copying it.
+TRACE_DTYPE = [("start_ns","<i8"),("flip_ns","<i8"),("vsync_ns","<i8"),("vsync_count","<i8"),
+               ("copy_us","<i4"),("flip_us","<i4")]
+_TRACE_RECORD = struct.Struct("<qqqqii")
+
+#Binary log files start with _LOG_MAGIC, then hold one _LOG_RECORD per
+#display, followed by the displayed file's name and then the trace.
+_LOG_MAGIC = b"RPGLOG\x00\x02"
+_LOG_RECORD = struct.Struct("<4siffffffiqfHI")
 
 GRAY = 127
 BLACK = 0
 WHITE = 255
 SINE = 1
 SQUARE = 0
+KERNEL_EXACT = 0
+KERNEL_LUT = 1
+FORMAT_FRAMES = 0
+FORMAT_ROWSHIFT = 1
+FLIP_MAILBOX = 0
+FLIP_PAN = 1
+_LOAD_MMAP = 1
+_LOAD_POPULATE = 2
+_LOAD_LOCK = 4
+_ROWSHIFT_MAGIC = 0x52535052
+_CONTAINER_MAGIC = 0x32475052
+_STEP_STIMULUS = 0
+_STEP_GREY = 1
+_STEP_PIN = 2
+_REALTIME_FIFO = 1
+_REALTIME_PINNED = 2
+_REALTIME_LOCKED = 4
 
 import _rpigratings as rpigratings
 
 
 
-def build_grating(filename, options):
+def build_grating(filename, options, threads=None):
 
     """
     Create a raw animation file of a drifting grating. Saves file to hard disc.
@@ -56,6 +115,13 @@ def build_grating(filename, options):
           "background": 127,   #
           "resolution": (1280, 720)   #resolution of gratings. Must match Screen()
           "waveform": rpg.SINE #rpg.SQUARE (square wave) or rpg.SINE (sine wave)
+          "kernel": rpg.KERNEL_EXACT #or rpg.KERNEL_LUT, see below
+          "format": rpg.FORMAT_FRAMES #or rpg.FORMAT_ROWSHIFT, see below
+          "fps": 60          #refresh rate to build for; measured from the
+                             #screen if not set
+      threads: Number of threads used to render each frame. Defaults to
+        None, which uses one thread per CPU core. The file produced is
+        identical whatever the number of threads.
 
     For smooth propogation of the grating, the pixels-per-frame speed
     is truncated to the nearest interger; low resolutions combined with
@@ -63,25 +129,54 @@ def build_grating(filename, options):
     speeds of propogation or even static, unmoving gratings. This also means
     that the temp_freq is approximate only.
 
+    Setting "kernel" to rpg.KERNEL_LUT renders from a table holding one
+    period of the waveform rather than calling sin() for every pixel,
+    which is several times faster. Gratings at 0, 90, 180 or 270 degrees
+    are identical to rpg.KERNEL_EXACT. At other angles the phase of each
+    pixel is rounded to 1/64th of a pixel, so the odd pixel may differ by
+    one shade, and the edges of squarewave bars may shift by one pixel.
+
+    Setting "format" to rpg.FORMAT_ROWSHIFT saves the lookup table
+    instead of every frame, along with where in the table each row and
+    frame starts and, for masks and gabors, which weight of the table
+    each pixel uses. Frames are then drawn from the table as they are
+    displayed. Files are typically a thousand times smaller and take
+    no time to build, but cost CPU time while displaying. The pixels
+    are those of rpg.KERNEL_LUT, except that gabor envelopes are
+    rounded to 255 steps.
+
+    rpg.FORMAT_FRAMES files are versioned containers, with 64 bit
+    frame counts, the resolution and pixel format in the header, and
+    a table of where each frame is. Every frame starts on a page
+    boundary. Files in the earlier format still load.
+
+    If use_build_cache() has been called, the grating is taken from the
+    build cache when it has been built before.
+
     Returns:
       Nothing
+
+    Raises:
+      OSError or ValueError: if "fps" is not set and the refresh rate of
+        /dev/fb0 can't be measured, either by timing vsyncs or from the
+        display timings it reports.
     """
 
     options = _parse_options(options)
 
-    filename = os.path.expanduser(filename)
-    rpigratings.build_grating(filename, options["duration"], options["angle"],
-                              options["spac_freq"], options["temp_freq"],
-                              options["contrast"], options["background"],
-                              options["resolution"][0], options["resolution"][1],
-                              options["waveform"], 0, 0, 0, 0, 0)
+    _render(filename, options, threads)
 
-def build_masked_grating(filename, options):
+def build_masked_grating(filename, options, threads=None):
     """
     Create a raw animation file of a drifting grating with a circular mask.
     Saves file to hard disc. This file is then loaded with Screen.load_grating,
     and displayed with one    of the Screen methods.
 
+    Only the rectangle around the mask and its padding is stored, so a small
+      mask makes a file, and a loaded grating, that is smaller in proportion.
+      Displaying it paints the rest of the screen the background colour once
+      and then copies just that rectangle each frame.
+
     Args:
       filename: The filename and path to file. ~/dir/filename will
         generate a file called filename in a directory dir in the users
@@ -105,6 +200,7 @@ def build_masked_grating(filename, options):
           "background": 127,   #
           "resolution": (1280, 720)   #resolution of gratings. Must match Screen()
           "waveform": rpg.SINE #rpg.SQUARE (square wave) or rpg.SINE (sine wave)
+      threads: Number of threads used to render each frame, see build_grating().
 
     Returns:
       Nothing.
@@ -112,21 +208,24 @@ def build_masked_grating(filename, options):
 
     options = _parse_options(options)
 
-    filename = os.path.expanduser(filename)
-    rpigratings.build_grating(filename, options["duration"], options["angle"],
-                              options["spac_freq"], options["temp_freq"],
-                              options["contrast"], options["background"],
-                              options["resolution"][0], options["resolution"][1],
-                              options["waveform"], 0, options["percent_diameter"],
-                              options["percent_center_left"], options["percent_center_top"],
-                              options["percent_padding"])
+    _render(filename, options, threads, percent_diameter=options["percent_diameter"],
+            percent_center_left=options["percent_center_left"],
+            percent_center_top=options["percent_center_top"],
+            percent_padding=options["percent_padding"])
 
-def build_gabor(filename, options):
+def build_gabor(filename, options, threads=None):
     """
     Create a raw animation file of a drifting gabor patch. Saves file to hard disc.
     This file is then loaded with Screen.load_grating, and displayed with one
     of the Screen methods.
 
+    Beyond the radius at which the envelope moves a pixel less than one
+      shade, pixels are drawn as the background or one shade below it.
+      Where those are the same on the screen, which is most backgrounds,
+      only the rectangle around that radius is stored and copied to the
+      screen each frame, as for build_masked_grating(); otherwise the
+      whole screen is.
+
     Args:
       filename: The filename and path to file. ~/dir/filename will
         generate a file called filename in a directory dir in the users
@@ -150,24 +249,20 @@ def build_gabor(filename, options):
           "background": 127,   #
           "resolution": (1280, 720)   #resolution of gratings. Must match Screen()
           "waveform": rpg.SINE #rpg.SQUARE (square wave) or rpg.SINE (sine wave)
+      threads: Number of threads used to render each frame, see build_grating().
 
     Returns:
       Nothing.
     """
     options = _parse_options(options)
 
-    filename = os.path.expanduser(filename)
-    rpigratings.build_grating(filename, options["duration"], options["angle"],
-                              options["spac_freq"], options["temp_freq"],
-                              options["contrast"], options["background"],
-                              options["resolution"][0], options["resolution"][1],
-                              options["waveform"], options["percent_sigma"], 0,
-                              options["percent_center_left"], options["percent_center_top"],
-                              0)
+    _render(filename, options, threads, percent_sigma=options["percent_sigma"],
+            percent_center_left=options["percent_center_left"],
+            percent_center_top=options["percent_center_top"])
 
 
 
-def build_list_of_gratings(func_string, directory_path, options):
+def build_list_of_gratings(func_string, directory_path, options, threads=None, workers=None):
 
     """
     Builds a range of gratings varying over one property. One of the options
@@ -184,6 +279,8 @@ def build_list_of_gratings(func_string, directory_path, options):
       options: A dictionary containing options, see build_grating(),
         build_masked_grating() or build_gabor() for appropriate options, but note
         one of the options must be in the form of a list.
+      threads: Number of threads used to render each frame, see build_batch().
+      workers: Number of gratings built at once, see build_batch().
 
     Files will be saved with names matching the element of the list they are generated
     from. e.g. if generated with options["angle"] = [0 45 90], then there will be three
@@ -191,22 +288,10 @@ def build_list_of_gratings(func_string, directory_path, options):
     directory path.
 
     Returns:
-      Nothing
+      BuildReport namedtuple, see build_batch()
     """
 
-    if func_string == "grating":
-        func = build_grating
-    elif func_string == "mask":
-        func = build_masked_grating
-    elif func_string == "gabor":
-        func = build_gabor
-    else:
-        raise ValueError("func_string must be either 'grating', 'mask' or 'gabor', not %s" %func_string)
-
-    path_to_directory = os.path.expanduser(directory_path)
-    cwd = os.getcwd()
-    os.makedirs(path_to_directory)
-    os.chdir(path_to_directory)
+    func = _build_function(func_string)
 
     iterable = [];
     for key, value in options.items():
@@ -219,44 +304,502 @@ def build_list_of_gratings(func_string, directory_path, options):
     if len(iterable) == 0:
         raise ValueError("Supply one option as a list")
 
+    path_to_directory = os.path.abspath(os.path.expanduser(directory_path))
+    os.makedirs(path_to_directory)
+
+    jobs = []
     for val in options[iterable[0]]:
         options_copy = options.copy()
         options_copy[iterable[0]] = val
-        func(str(val), options_copy)
+        jobs.append((os.path.join(path_to_directory, str(val)), options_copy))
+    return _build_batch(func, jobs, workers, threads, True)
+
+def build_batch(func_string, directory_path, options, workers=None, threads=None, progress=True):
+    """
+    Builds a grating for every combination of options. Any number of the
+    options can be lists, and a grating is built for each element of their
+    cartesian product, so {"angle": [0, 90], "spac_freq": [0.05, 0.1, 0.2]}
+    builds six. Gratings are built several at a time, in separate processes.
+
+    If options has no "fps", the refresh rate is measured from the screen
+    once, rather than by every build.
 
-    os.chdir(cwd)
+    A mask or gabor's envelope is worked out once for each geometry and kept
+    by the process that built it, which holds on to the last four. Builds
+    sharing the resolution, centre, diameter and padding or sigma (and, for
+    gabors, contrast and background) reuse it, so a sweep over angle,
+    spatial or temporal frequency only renders the carrier of each frame.
+
+    Args:
+      func_string: "grating", "mask" or "gabor", as for
+        build_list_of_gratings().
+      directory_path: directory to save the gratings in, created if it
+        doesn't exist. Each file is named after the options that vary, as
+        in "angle=90_spac_freq=0.1", or func_string if none do.
+      options: A dictionary of options, as for build_grating(),
+        build_masked_grating() or build_gabor(), any of which can be lists.
+      workers: Number of gratings to build at once. Defaults to None, one
+        per CPU core.
+      threads: Number of threads each grating is rendered with. Defaults
+        to None, which shares the cores between the workers.
+      progress: Whether to print a line as each grating is finished.
+        Defaults to True.
 
-def convert_raw(filename, new_filename, n_frames, width, height, refreshes_per_frame):
+    Returns:
+      BuildReport namedtuple with the fields files, frames and bytes, the
+      totals built; seconds, the time the batch took; and frames_per_second
+      and mb_per_second, the throughput.
+    """
+    func = _build_function(func_string)
+    path_to_directory = os.path.abspath(os.path.expanduser(directory_path))
+    os.makedirs(path_to_directory, exist_ok=True)
+
+    varying = [key for key, value in options.items() if isinstance(value, list)]
+    jobs = []
+    for values in itertools.product(*[options[key] for key in varying]):
+        options_copy = dict(options, **dict(zip(varying, values)))
+        name = "_".join("%s=%s" %(key, value) for key, value in zip(varying, values)) or func_string
+        jobs.append((os.path.join(path_to_directory, name), options_copy))
+    return _build_batch(func, jobs, workers, threads, progress)
+
+def _build_function(func_string):
+    if func_string == "grating":
+        return build_grating
+    elif func_string == "mask":
+        return build_masked_grating
+    elif func_string == "gabor":
+        return build_gabor
+    raise ValueError("func_string must be either 'grating', 'mask' or 'gabor', not %s" %func_string)
+
+def _build_one(func, filename, options, threads, cache_directory):
+    """
+    Builds one grating of a batch, in a worker process.
+
+    Returns:
+      (filename, frames in the animation, bytes written)
+    """
+    global _build_cache_directory
+    _build_cache_directory = cache_directory
+    func(filename, options, threads)
+    return filename, _read_grating_header(filename)[2], os.path.getsize(filename)
+
+def _build_batch(func, jobs, workers, threads, progress):
+    """
+    Builds each (filename, options) of jobs with func, workers at a time,
+    measuring the refresh rate first if the options don't give one.
+    """
+    if workers is None:
+        workers = os.cpu_count()
+    if workers < 1:
+        raise ValueError("workers set to invalid value of %d, must be >= 1 or None" %workers)
+    workers = min(workers, max(len(jobs), 1))
+    if threads is None:
+        threads = max(1, os.cpu_count() // workers)
+    for filename, options in jobs:
+        _parse_options(options)
+    if any("fps" not in options for filename, options in jobs):
+        fps = rpigratings.measure_refresh_rate()
+        jobs = [(filename, dict(options, fps=options.get("fps", fps))) for filename, options in jobs]
+
+    frames = 0
+    size = 0
+    start = t.time()
+    with concurrent.futures.ProcessPoolExecutor(workers) as pool:
+        futures = [pool.submit(_build_one, func, filename, options, threads, _build_cache_directory)
+                   for filename, options in jobs]
+        try:
+            for n, future in enumerate(concurrent.futures.as_completed(futures)):
+                filename, file_frames, file_size = future.result()
+                frames += file_frames
+                size += file_size
+                if progress:
+                    elapsed = t.time() - start
+                    print("[%d/%d] %s: %d frames, %.1f MB (%.0f frames/s, %.1f MB/s so far)"
+                          %(n + 1, len(jobs), os.path.basename(filename), file_frames, file_size/1e6,
+                            frames/elapsed, size/1e6/elapsed))
+        except BaseException:
+            for future in futures:
+                future.cancel()
+            raise
+    seconds = t.time() - start
+    report = BuildReport(len(jobs), frames, size, seconds, frames/seconds, size/1e6/seconds)
+    if progress:
+        print("Built %d files, %d frames, %.1f MB in %.1f s: %.0f frames/s, %.1f MB/s"
+              %(report.files, report.frames, report.bytes/1e6, report.seconds,
+                report.frames_per_second, report.mb_per_second))
+    return report
+
+def use_build_cache(directory="~/rpg/cache"):
+    """
+    Turns the build cache on, or off with None. While it's on,
+    build_grating(), build_masked_grating(), build_gabor() and the batch
+    builders keep a copy of everything they build in directory, keyed by a
+    hash of every rendering option, the fps, the resolution and
+    DEGREES_SUBTENDED. Building the same grating again is then a hard link
+    to the copy, or a reflink or copy with a new header where only the
+    duration differs, since the frames stored don't depend on it once
+    the duration covers a whole cycle.
+
+    Files built from the cache may be hard links to it, so rebuild them
+    rather than editing them in place.
+
+    Args:
+      directory: where to keep the cache. Defaults to ~/rpg/cache.
+
+    Returns:
+      None
+    """
+    global _build_cache_directory
+    if directory is None:
+        _build_cache_directory = None
+        return
+    directory = os.path.abspath(os.path.expanduser(directory))
+    os.makedirs(directory, exist_ok=True)
+    _build_cache_directory = directory
+
+def build_cache_stats(directory=None):
+    """
+    Reports on the build cache.
+
+    Args:
+      directory: the cache to report on. Defaults to None, the one in use.
+
+    Returns:
+      Dictionary with the directory, the number of entries and the bytes
+      they take up, and the hits and misses of every build through it.
+    """
+    directory = _cache_directory_or_current(directory)
+    entries = _build_cache_entries(directory)
+    stats = {"hits": 0, "misses": 0}
+    try:
+        with open(os.path.join(directory, "stats")) as file:
+            stats.update(json.load(file))
+    except (OSError, ValueError):
+        pass
+    return {"directory": directory, "entries": len(entries),
+            "bytes": sum(size for path, size, mtime in entries),
+            "hits": stats["hits"], "misses": stats["misses"]}
+
+def prune_build_cache(max_bytes=None, max_age_days=None, directory=None):
+    """
+    Removes entries from the build cache, least recently used first.
+    Gratings already built from them are unaffected.
+
+    Args:
+      max_bytes: remove entries until the rest take up no more than this.
+      max_age_days: remove entries not used for this many days.
+      directory: the cache to prune. Defaults to None, the one in use.
+
+    With neither limit set, every entry is removed.
+
+    Returns:
+      (entries removed, bytes freed)
+    """
+    directory = _cache_directory_or_current(directory)
+    entries = sorted(_build_cache_entries(directory), key=lambda entry: entry[2])
+    total = sum(size for path, size, mtime in entries)
+    removed = 0
+    freed = 0
+    for path, size, mtime in entries:
+        too_old = max_age_days is not None and t.time() - mtime > max_age_days*86400
+        too_big = max_bytes is not None and total > max_bytes
+        if too_old or too_big or (max_bytes is None and max_age_days is None):
+            os.remove(path)
+            total -= size
+            removed += 1
+            freed += size
+    return removed, freed
+
+_build_cache_directory = None
+_BUILD_CACHE_VERSION = 3
+_FICLONE = 0x40049409
+
+def _cache_directory_or_current(directory):
+    if directory is None:
+        directory = _build_cache_directory
+    if directory is None:
+        raise ValueError("No build cache in use; call use_build_cache() or pass a directory")
+    return os.path.abspath(os.path.expanduser(directory))
+
+def _build_cache_entries(directory):
+    entries = []
+    for name in os.listdir(directory):
+        if len(name) == 64 and all(c in "0123456789abcdef" for c in name):
+            stat = os.stat(os.path.join(directory, name))
+            entries.append((os.path.join(directory, name), stat.st_size, stat.st_mtime))
+    return entries
+
+def _count_build_cache(field):
+    with open(os.path.join(_build_cache_directory, "stats"), "a+") as file:
+        fcntl.flock(file, fcntl.LOCK_EX)
+        file.seek(0)
+        try:
+            stats = json.loads(file.read() or "{}")
+        except ValueError:
+            stats = {}
+        stats[field] = stats.get(field, 0) + 1
+        file.seek(0)
+        file.truncate()
+        json.dump(stats, file)
+
+def _render(filename, options, threads, percent_sigma=0, percent_diameter=0,
+            percent_center_left=0, percent_center_top=0, percent_padding=0):
+    """
+    Builds a grating from parsed options, through the build cache if
+    one is in use.
+    """
+    filename = os.path.expanduser(filename)
+    shape = (options["angle"], options["spac_freq"], options["temp_freq"],
+             options["contrast"], options["background"],
+             options["resolution"][0], options["resolution"][1],
+             options["waveform"], percent_sigma, percent_diameter,
+             percent_center_left, percent_center_top, percent_padding)
+    fps = options["fps"]
+    if _build_cache_directory is None:
+        rpigratings.build_grating(filename, options["duration"], *shape, _parse_threads(threads),
+                                  options["kernel"], options["format"], fps)
+        return
+    if fps == 0:
+        fps = rpigratings.measure_refresh_rate()
+    key = hashlib.sha256(repr((_BUILD_CACHE_VERSION, rpigratings.DEGREES_SUBTENDED, shape,
+                               options["kernel"], options["format"], fps)).encode()).hexdigest()
+    entry = os.path.join(_build_cache_directory, key)
+    n_frames = int(fps * options["duration"])
+    frames_per_cycle = _cached_frames_per_cycle(entry, n_frames)
+    if frames_per_cycle is None:
+        _count_build_cache("misses")
+        building = "%s.%d.tmp" %(entry, os.getpid())
+        try:
+            rpigratings.build_grating(building, options["duration"], *shape, _parse_threads(threads),
+                                      options["kernel"], options["format"], fps)
+            os.replace(building, entry)
+        except BaseException:
+            #don't leave a half built grating in the cache directory
+            _remove_if_present(building)
+            raise
+        frames_per_cycle = _cached_frames_per_cycle(entry, n_frames)
+    else:
+        _count_build_cache("hits")
+        os.utime(entry)
+    _copy_from_build_cache(entry, filename, n_frames, frames_per_cycle)
+
+def _read_grating_header(filename):
+    """
+    Returns (is rowshift, frames_per_cycle, n_frames) from a grating file.
+    """
+    with open(filename, "rb") as file:
+        header = file.read(48)
+    magic = struct.unpack_from("<I", header)[0]
+    if magic == _CONTAINER_MAGIC:
+        n_frames, frames_per_cycle = struct.unpack_from("<QQ", header, 32)
+        return False, frames_per_cycle, n_frames
+    if magic == _ROWSHIFT_MAGIC:
+        n_frames, frames_per_cycle = struct.unpack_from("<II", header, 4)
+        return True, frames_per_cycle, n_frames
+    frames_per_cycle, n_frames = struct.unpack_from("<H6xH", header)
+    return False, frames_per_cycle, n_frames
+
+def _cached_frames_per_cycle(entry, n_frames):
+    """
+    Works out the frames_per_cycle a build of n_frames would have from
+    a cache entry of the same grating with another duration, or returns
+    None if the entry is missing or can't provide that many frames.
+    """
+    try:
+        rowshift, cached_per_cycle, cached_frames = _read_grating_header(entry)
+    except (OSError, struct.error):
+        return None
+    if cached_per_cycle < cached_frames:
+        #the entry holds a whole cycle, so the build would hold at most that
+        frames_per_cycle = min(cached_per_cycle, n_frames)
+    elif n_frames <= cached_per_cycle:
+        #the entry was cut short by its duration, but is long enough
+        frames_per_cycle = n_frames
+    else:
+        return None
+    if rowshift and frames_per_cycle != cached_per_cycle:
+        #rowshift files can't be cut down, only have their duration changed
+        return None
+    return frames_per_cycle
+
+def _copy_from_build_cache(entry, filename, n_frames, frames_per_cycle):
+    """
+    Puts a grating of n_frames at filename from the cache entry: a hard
+    link if the entry is just that, otherwise a reflink or copy of as
+    much as is needed with the header rewritten.
+    """
+    if os.path.lexists(filename):
+        os.remove(filename)
+    rowshift, cached_per_cycle, cached_frames = _read_grating_header(entry)
+    if (frames_per_cycle, n_frames) == (cached_per_cycle, cached_frames):
+        try:
+            os.link(entry, filename)
+            return
+        except OSError:
+            pass
+    try:
+        _copy_grating(entry, filename, n_frames, frames_per_cycle,
+                      rowshift, cached_per_cycle)
+    except BaseException:
+        #a partial copy would load as a grating that is cut short
+        _remove_if_present(filename)
+        raise
+
+def _copy_grating(entry, filename, n_frames, frames_per_cycle, rowshift, cached_per_cycle):
+    """
+    The copy of _copy_from_build_cache(), when the entry can't simply
+    be linked to.
+    """
+    length = os.path.getsize(entry)
+    if not rowshift:
+        with open(entry, "rb") as source:
+            index_offset = struct.unpack_from("<Q", source.read(64), 56)[0]
+            if frames_per_cycle < cached_per_cycle:
+                #stop at the first frame not needed, which the index says where is
+                source.seek(index_offset + 8 * frames_per_cycle)
+                length = struct.unpack("<Q", source.read(8))[0]
+    with open(entry, "rb") as source, open(filename, "wb") as destination:
+        try:
+            fcntl.ioctl(destination, _FICLONE, source.fileno())
+            destination.truncate(length)
+        except OSError:
+            copied = 0
+            while copied < length:
+                written = os.copy_file_range(source.fileno(), destination.fileno(), length - copied)
+                if written == 0:
+                    break
+                copied += written
+        if rowshift:
+            destination.seek(4)
+            destination.write(struct.pack("<I", n_frames))
+        else:
+            destination.seek(32)
+            destination.write(struct.pack("<QQ", n_frames, frames_per_cycle))
+            #and clear the index entries of the frames left out, as a build would
+            destination.seek(index_offset + 8 * frames_per_cycle)
+            destination.write(bytes(8 * (cached_per_cycle - frames_per_cycle)))
+
+def _remove_if_present(filename):
+    try:
+        os.remove(filename)
+    except FileNotFoundError:
+        pass
+
+def convert_raw(filename, new_filename, n_frames=None, width=None, height=None, refreshes_per_frame=1):
     """
     Converts a raw video/image file saves as uint8: RGBRGBRGB... starting
       in the top left pixel and proceeding rowwise, into a form readily 
       displayed by RPG.
 
+    Pixels are converted a chunk at a time with the vector instructions
+      chosen by set_simd(), and written in large blocks, so converting is
+      usually limited by the disc. It runs without the GIL.
+
     Args:
       filename: the exact path to the raw file, either as relative or absolute
-        e.g. "~/videos/raw1.raw".
+        e.g. "~/videos/raw1.raw". Or the pixels themselves, as any object
+        supporting the buffer protocol that holds them as bytes in that order,
+        e.g. a C-contiguous numpy uint8 array shaped (height, width, 3) for an
+        image or (n_frames, height, width, 3) for a movie, which is read
+        without copying it or saving it to a file first.
       new_filename: the exact path of the converted file to be produced e.g.
         "~/raws/raw1.raw".
-      n_frames: the number of frames in the raw video/image
-      width: the width of the original file in pixels
-      height: the height of the original file in pixels
+      n_frames: the number of frames in the raw video/image, which is how
+        many are converted. Taken from the array's shape if not given.
+      width: the width of the original file in pixels. Taken from the
+        array's shape if not given.
+      height: the height of the original file in pixels. Taken from the
+        array's shape if not given.
       refreshes_per_frame: the number of monitor refreshes to display each frame for.
         For a movie to display at 30 frames per second, on a 60 Hz monitor, this would
         be 2. On a 75 Hz monitor, 25 frames per second would be acheived by setting this
         to 3. If a still image is displayed, if you require it displayed for X seconds,
         and your monitor refresh rate is R Hz, then this value should be set to X * R.
+        Defaults to 1.
 
     Returns:
       None
+
+    Raises:
+      ValueError: if the source holds fewer than n_frames frames of width by
+        height pixels, or the sizes can't be worked out.
     """
 
-    filename = os.path.expanduser(filename)
     new_filename = os.path.expanduser(new_filename)
+    if isinstance(filename, (str, os.PathLike)):
+        filename = os.path.expanduser(os.fspath(filename))
+        if n_frames is None or width is None or height is None:
+            raise ValueError("n_frames, width and height are needed to convert a file")
+    else:
+        shape = memoryview(filename).shape
+        if len(shape) == 3 and shape[2] == 3:
+            shape = (1,) + shape
+        if len(shape) == 4 and shape[3] == 3:
+            n_frames = shape[0] if n_frames is None else n_frames
+            height = shape[1] if height is None else height
+            width = shape[2] if width is None else width
+        if n_frames is None or width is None or height is None:
+            raise ValueError("n_frames, width and height are needed unless the array is "
+                             "shaped (height, width, 3) or (n_frames, height, width, 3)")
     rpigratings.convertraw(filename, new_filename, n_frames, width, height, refreshes_per_frame)
 
+def set_simd(name="auto"):
+    """
+    Chooses the vector instructions used by the lookup table kernel
+      (KERNEL_LUT), FORMAT_ROWSHIFT playback and convert_raw(). Every choice produces
+      exactly the same pixels; only the speed differs. The fastest set the
+      CPU supports is chosen on import, so this is only needed for
+      benchmarking or to work around a fault.
+
+    Args:
+      name: "auto" for the fastest set the CPU supports, or one of "avx2",
+        "sse2" (x86), "neon" (ARM) or "scalar" (plain C, any CPU).
+
+    Returns:
+      The name of the set now in use.
+
+    Raises:
+      ValueError: if the set is unknown or not supported by this CPU.
+    """
+
+    return rpigratings.set_simd(name)
+
+
+def read_log(filename):
+    """
+    Reads a binary log written by one of the Screen.display_*_randomly or
+    Screen.display_rand_*_on_pulse methods with binary_log=True.
+
+    Args:
+      filename: path to the log file. Unlike logfile_name, this is not
+        relative to ~/rpg/logs/
+
+    Returns:
+      list of (file_type, file_displayed, perf) tuples, one per display,
+      where file_type is "Grat" or "Raw" and perf is a performance record
+      as returned by Screen.display_grating(), trace included.
+    """
+    with open(os.path.expanduser(filename), "rb") as file:
+        data = file.read()
+    if data[:len(_LOG_MAGIC)] != _LOG_MAGIC:
+        raise ValueError("%s is not a binary rpg log" %filename)
+    records = []
+    offset = len(_LOG_MAGIC)
+    while offset < len(data):
+        fields = _LOG_RECORD.unpack_from(data, offset)
+        offset += _LOG_RECORD.size
+        name_length, n_frames = fields[-2:]
+        name = data[offset:offset+name_length].decode()
+        offset += name_length
+        trace = data[offset:offset+n_frames*_TRACE_RECORD.size]
+        offset += n_frames*_TRACE_RECORD.size
+        records.append((fields[0].rstrip(b"\x00").decode(), name, GratPerfRec(*fields[1:-2], trace=trace)))
+    return records
 
 class Screen:
-    def __init__(self, resolution=(1280,720), background = 127):
+    def __init__(self, resolution=(1280,720), background = 127, flip_method = FLIP_MAILBOX,
+                 backend = "hardware", refresh_rate = 60, framebuffer_file = None,
+                 cache_budget = 0):
         """
         A class encapsulating the raspberry pi's framebuffer,
           with methods to display drifting gratings and solid colors to
@@ -282,15 +825,55 @@ class Screen:
           resolution: a tuple of the desired width of the display
             resolution as (width, height). Defaults to (1280,720).
           background: value between0 and 255 for the background 
+          flip_method: how the front and back buffers are swapped each frame.
+            FLIP_MAILBOX (the default) asks the videocore firmware to move the
+            displayed region through /dev/vcio; FLIP_PAN uses the framebuffer
+            driver's own FBIOPAN_DISPLAY ioctl, which works on any Linux
+            framebuffer that supports panning.
+          backend: "hardware" (the default) for the Pi's display and GPIO pins,
+            or "sim" for a simulated screen that runs the same display loops
+            on any Linux machine, for testing and benchmarking. The simulated
+            screen waits for vsyncs from the clock and reads trigger pins
+            scheduled with sim_trigger().
+          refresh_rate: vsyncs per second of the "sim" backend. Defaults to 60.
+          framebuffer_file: with the "sim" backend, a file to hold the two
+            frame buffers, so that another process can inspect what is
+            displayed. Defaults to None, which keeps them in memory.
+          cache_budget: bytes of stimuli the display_*_randomly and
+            display_rand_*_on_pulse methods keep loaded after they have been
+            displayed, so that showing them again, from any of those methods,
+            doesn't reread them. The least recently used are dropped first.
+            Defaults to 0, which only shares stimuli that are still in use.
+
+        On creation the screen times a few ways of copying a frame into the
+          framebuffer and keeps the fastest. The attribute blit_method names
+          the one chosen and blit_time is how long it took to copy one frame,
+          in microseconds. refresh_rate is the refresh rate it measured, in
+          vsyncs per second. The attribute cache is the StimulusCache those
+          methods load through.
          """
         if (background < 0 or background > 255):
                 raise ValueError("Background must be between 0 and 255")
+        if flip_method not in (FLIP_MAILBOX, FLIP_PAN):
+                raise ValueError("flip_method must be FLIP_MAILBOX or FLIP_PAN")
+        if backend not in ("hardware", "sim"):
+                raise ValueError("backend must be \"hardware\" or \"sim\"")
+        if framebuffer_file is not None:
+                framebuffer_file = os.path.expanduser(framebuffer_file)
 
         self.background = background
-        self.capsule = rpigratings.init(resolution[0],resolution[1])
-
-
-    def load_grating(self,filename):
+        self.backend = backend
+        self.resolution = (resolution[0], resolution[1])
+        self.capsule = rpigratings.init(resolution[0],resolution[1],flip_method,
+                                        backend,refresh_rate,framebuffer_file)
+        self.blit_method, self.blit_time = rpigratings.blit_info(self.capsule)
+        self.refresh_rate = rpigratings.refresh_rate(self.capsule)
+        self.cache = StimulusCache(self, cache_budget)
+        #one display at a time, whichever thread it's called from
+        self._display_lock = threading.Lock()
+
+
+    def load_grating(self, filename, mmap=False, populate=False, lock=False):
         """
         Load a grating file called filename into local memory. Once loaded
         in this way, display_grating() can be called to display the loaded file
@@ -299,28 +882,82 @@ class Screen:
         Args:
           filename: string containing the exact filename, either as an absolute
             or relative, e.g. "~/gratings/grat1.dat" or "home/pi/grating/grat1.dat"
+          mmap: if True, map the file read-only rather than copying it into
+            memory. Loading is then almost instant and the pages are shared with
+            the operating system's file cache, so many more gratings can be kept
+            loaded than fit in RAM. Pages not yet in RAM are read from disc as
+            they are displayed, which can drop frames unless populate is set.
+          populate: with mmap, read the whole file into RAM before returning.
+          lock: lock the grating in RAM, so it can't be paged out before it is
+            displayed. Fails with OSError if it exceeds the locked memory limit
+            (ulimit -l).
         Returns:
           Grating object
         """
         filename = os.path.expanduser(filename)
-        return Grating(self,filename)
+        return Grating(self, filename, _load_mode(mmap, populate, lock))
 
-    def load_raw(self, filename):
+    def load_raw(self, filename, mmap=False, populate=False, lock=False):
         """
         Load a raw file into local memory. Once loaded in this way, the returned
-        object can be displayed with display_raw()
+        object can be displayed with display_raw(). Raises ValueError if its
+        resolution isn't the screen's.
 
         Args:
           filename: string containint the exact filename, either as an absolute
             or relative path.
+          mmap, populate, lock: as for load_grating()
         Returns:
           Raw object
         """
 
         filename = os.path.expanduser(filename)
-        return Raw(self, filename)
+        return Raw(self, filename, _load_mode(mmap, populate, lock))
+
+    def stimulus_from_buffer(self, array, refresh_per_frame=1):
+        """
+        Wrap frames already in memory as a Raw object, without copying
+        them or writing them to a file, e.g. stimuli generated in Python
+        for each trial of a closed loop experiment. It is displayed with
+        display_raw() or display_raw_async() like a loaded raw.
+
+        The array is used in place and kept alive for as long as the Raw
+        object exists. Changes made to it show the next time it is displayed,
+        so one array can be refilled and shown trial after trial, but it must
+        not be written to while it is being displayed.
+
+        Args:
+          array: a C-contiguous array of RGB565 pixels as 16 bit unsigned
+            integers in the machine's byte order, shaped (height, width) for
+            one frame or (n_frames, height, width) for a movie, matching the
+            screen's resolution. Anything supporting the buffer protocol
+            will do, e.g. a numpy uint16 array. An RGB888 uint8 image can be
+            packed to RGB565 with numpy as
+            (r >> 3 << 11) | (g >> 2 << 5) | (b >> 3), in uint16.
+          refresh_per_frame: monitor refreshes to show each frame for.
+            Defaults to 1.
 
-    def display_grating(self, grating, trigger_pin = 0):
+        Returns:
+          Raw object
+        """
+        view = memoryview(array)
+        if view.format not in ("H", "=H", "@H", "<H" if sys.byteorder == "little" else ">H"):
+                raise ValueError("array must hold 16 bit unsigned RGB565 pixels in native byte "
+                                 "order, e.g. numpy uint16, not %r" %view.format)
+        shape = view.shape
+        if len(shape) == 2:
+                shape = (1,) + shape
+        width, height = self.resolution
+        if len(shape) != 3 or shape[1:] != (height, width) or shape[0] == 0:
+                raise ValueError("array must be shaped (%d, %d) or (n_frames, %d, %d), not %s"
+                                 %(height, width, height, width, view.shape))
+        if not view.c_contiguous:
+                raise ValueError("array must be C-contiguous")
+        if refresh_per_frame < 1:
+                raise ValueError("refresh_per_frame must be at least 1")
+        return Raw(self, None, buffer=array, refresh_per_frame=refresh_per_frame)
+
+    def display_grating(self, grating, trigger_pin = 0, trace = False, keyboard = True):
         """
         Display the passed grating object (grating files are created with
         the draw_grating function and loaded with the Screen.load_grating
@@ -330,7 +967,27 @@ class Screen:
         mean_interframe, stddev_interframe and start_time; these refer
         respectively to the average interframe time in microseconds, the standard
         deviation of the interframe time and grating began to play in Unix Time,
-        respectively.
+        respectively. The fields mean_copy and max_copy are the mean and longest
+        time, in microseconds, spent filling the back buffer each frame; the
+        nearer these are to the interframe time, the closer the grating came
+        to missing a vsync. mean_flip and max_flip are the same for the call
+        that swaps the buffers. missed_vsyncs counts the refreshes on which
+        a frame stayed on screen when it should have been replaced.
+
+        When waiting for a trigger, the display sleeps until the kernel
+        reports an edge on the pin, a key is pressed (unless keyboard is
+        False) or cancel_trigger() is called. cancel_trigger() also stops a
+        grating that is already playing, after the current frame.
+        trigger_time is when the edge arrived (CLOCK_MONOTONIC
+        nanoseconds, timestamped by the kernel where the GPIO driver allows)
+        and trigger_latency the microseconds from it to the first flip. Both
+        are 0 when there was no trigger.
+
+        If trace is True the field trace holds one record per frame as bytes,
+        laid out as TRACE_DTYPE: when the frame started filling the back
+        buffer, when it was flipped and when its vsync arrived (CLOCK_MONOTONIC
+        nanoseconds), the number of refreshes since the first frame's vsync,
+        and the copy and flip times in microseconds. Otherwise trace is None.
 
         Args:
           grating: a grating objected loaded with Screen.load_grating()
@@ -338,21 +995,132 @@ class Screen:
             the GPIO pin (as defined by wiringPi) to wait for a trigger signal.
             Note: digital signal is 3.3 volts max, not 5 volt TTL. 5 volt signals
             risk permanently damaging the raspberry pi.
+          trace: (optional) if True, return the per frame trace.
+          keyboard: (optional) if False, a key pressed at the terminal doesn't
+            end the wait for the trigger; only cancel_trigger() does.
 
         Returns:
-          performance record as a named tuple.
+          performance record as a named tuple, or None if a key was pressed
+          while waiting for the trigger or the display was cancelled.
+
+        Displays can be called from any thread, and other Python threads
+        run while one plays. Calls from several threads take turns.
+        """
+        return self._display_stimulus(rpigratings.display_grating, grating,
+                                      trigger_pin, trace, keyboard)
+
+    def _display_stimulus(self, display, stimulus, trigger_pin, trace, keyboard, token = 0):
+        """
+        Makes a display_grating() or display_raw() call. With a token, from
+        next(_display_tokens), cancel_trigger(token) cancels this call
+        alone, even before it has begun.
         """
         if trigger_pin == 1:
                 raise ValueError("trigger_pin cannot be set to 1. This pin is reserved for feedback")
+        with self._display_lock:
+                rawtuple = display(self.capsule, stimulus.capsule, trigger_pin,
+                                   trace, keyboard, token)
+        if rawtuple is None:
+                return None
+        else:
+                return GratPerfRec(*rawtuple)
+
+    def display_drift(self, options, trigger_pin = 0, trace = False, keyboard = True):
+        """
+        Drift a full screen grating at 0, 90, 180 or 270 degrees without
+        building it first or copying any frames. At these angles each frame
+        is the last one moved along by the grating's speed, so one strip a
+        wavelength longer than the screen is rendered into an enlarged
+        virtual framebuffer, and each refresh the display is only panned
+        across it, as flipping pans between the two buffers. Any duration
+        costs the same memory and next to no CPU, and mean_copy is about 0.
+
+        The strip is rendered before waiting for the trigger, with the
+        background on screen, and the last frame is left showing afterwards.
+        The framebuffer is back to its usual size when this returns.
+
+        Args:
+          options: as for build_grating(). The screen's resolution is used
+            rather than options["resolution"], and options["fps"] defaults to
+            the screen's refresh rate; one frame is shown per refresh.
+            Masks and gabors (percent_diameter or percent_sigma) can't be
+            drifted this way.
+          trigger_pin, trace, keyboard: as for display_grating()
 
+        Returns:
+          As for display_grating()
 
-        rawtuple = rpigratings.display_grating(self.capsule, grating.capsule, trigger_pin)
+        Raises:
+          ValueError: if options["angle"] isn't 0, 90, 180 or 270, or asks
+            for a mask or gabor
+          OSError: if the framebuffer can't be enlarged
+        """
+        if trigger_pin == 1:
+                raise ValueError("trigger_pin cannot be set to 1. This pin is reserved for feedback")
+        options = _parse_options(options)
+        if options["percent_diameter"] or options["percent_sigma"]:
+                raise ValueError("Only full screen gratings can drift by panning, not masks or gabors")
+        fps = options["fps"] or self.refresh_rate
+        with self._display_lock:
+                rawtuple = rpigratings.display_drift(self.capsule, options["duration"], fps,
+                                                     options["angle"], options["spac_freq"],
+                                                     options["temp_freq"], options["contrast"],
+                                                     options["background"], options["waveform"],
+                                                     options["kernel"], trigger_pin, trace, keyboard)
         if rawtuple is None:
                 return None
         else:
                 return GratPerfRec(*rawtuple)
 
-    def display_raw(self, raw, trigger_pin = 0):
+    def display_procedural(self, options, trigger_pin = 0, trace = False, keyboard = True, threads = None):
+        """
+        Play a grating, mask or gabor without building it first: each frame
+        is rendered straight into the back buffer while the one before it is
+        on screen, split across threads, and flipped at the next vsync.
+        Nothing is written to or read from disc, so the options can be
+        changed from one trial to the next at no storage cost.
+
+        A frame has until the vsync after the one it started on. Rendering
+        is done with KERNEL_LUT unless options["kernel"] says otherwise, as
+        KERNEL_EXACT rarely keeps up with a full screen. Frames that finish
+        too late are counted in late_frames, and also show up in
+        missed_vsyncs.
+
+        Args:
+          options: as for build_grating(), build_masked_grating() or
+            build_gabor(), which percent_diameter or percent_sigma choose
+            between. The screen's resolution is used rather than
+            options["resolution"], and options["fps"] defaults to the
+            screen's refresh rate; one frame is shown per refresh.
+          trigger_pin, trace, keyboard: as for display_grating()
+          threads: (optional) the number of threads to render with, as for
+            build_grating(). Defaults to one per core.
+
+        Returns:
+          As for display_grating(), with one more field: late_frames, the
+          frames that weren't rendered by the vsync they were due on.
+        """
+        if trigger_pin == 1:
+                raise ValueError("trigger_pin cannot be set to 1. This pin is reserved for feedback")
+        options = dict({"kernel": KERNEL_LUT}, **options)
+        options = _parse_options(options)
+        threads = _parse_threads(threads)
+        fps = options["fps"] or self.refresh_rate
+        with self._display_lock:
+                rawtuple = rpigratings.display_procedural(self.capsule, options["duration"], fps,
+                                                          options["angle"], options["spac_freq"],
+                                                          options["temp_freq"], options["contrast"],
+                                                          options["background"], options["waveform"],
+                                                          options["percent_sigma"], options["percent_diameter"],
+                                                          options["percent_center_left"],
+                                                          options["percent_center_top"],
+                                                          options["percent_padding"], options["kernel"],
+                                                          threads, trigger_pin, trace, keyboard)
+        if rawtuple is None:
+                return None
+        return ProceduralPerfRec(*rawtuple)
+
+    def display_raw(self, raw, trigger_pin = 0, trace = False, keyboard = True):
         """
         Displays the passed raw object (raw objects are loaded with the 
         Screen.load_raw method) either as soon as possible, or in response
@@ -364,19 +1132,143 @@ class Screen:
             the GPIO pin (as defined by wiringPi) to wait for a trigger signal.
             Note: digital signal is 3.3 volts max, not 5 volt TTL. 5 volt signals
             risk permanently damaging the raspberry pi.
+          trace: (optional) if True, return the per frame trace.
+          keyboard: (optional) as for display_grating().
+
+        Returns:
+          Performance record as named tuple, as for display_grating().
+        """
+        return self._display_stimulus(rpigratings.display_raw, raw,
+                                      trigger_pin, trace, keyboard)
+
+    def display_grating_async(self, grating, trigger_pin = 0, trace = False):
+        """
+        Start displaying grating on a background thread and return at once,
+        so the calling thread can carry on, e.g. to prepare the next trial or
+        run an asyncio event loop, while it waits for the trigger and plays.
+
+        The keyboard is not watched; the returned handle's cancel() method
+        ends the display instead.
+
+        Args:
+          grating, trigger_pin, trace: as for display_grating()
 
         Returns:
-          Performance record as named tuple.
+          DisplayHandle, whose result() is what display_grating() would
+          have returned. It can also be awaited.
+        """
+        if trigger_pin == 1:
+                raise ValueError("trigger_pin cannot be set to 1. This pin is reserved for feedback")
+        return DisplayHandle(self, rpigratings.display_grating, grating, trigger_pin, trace)
+
+    def display_raw_async(self, raw, trigger_pin = 0, trace = False):
         """
+        display_raw() on a background thread, as display_grating_async().
+
+        Args:
+          raw, trigger_pin, trace: as for display_raw()
 
+        Returns:
+          DisplayHandle
+        """
         if trigger_pin == 1:
                 raise ValueError("trigger_pin cannot be set to 1. This pin is reserved for feedback")
+        return DisplayHandle(self, rpigratings.display_raw, raw, trigger_pin, trace)
+
+    def stream_raw(self, filename, trigger_pin = 0, trace = False, buffer_frames = 32, keyboard = True):
+        """
+        Play a raw file straight from disc, for movies too long to load
+        with load_raw(). A reader thread keeps a ring of buffer_frames frames
+        filled ahead of the display, asking the kernel to read ahead of it
+        and dropping frames from the file cache once they're in the ring.
+        The ring is filled before waiting for the trigger.
 
-        rawtuple = rpigratings.display_raw(self.capsule, raw.capsule, trigger_pin)
+        If a frame hasn't been read by the time it is due, the display waits
+        for it and counts an underrun; it will also show up as a missed
+        vsync. Disc speed needs to be at least the movie's data rate, e.g.
+        1.8 MB a frame at 1280x720, times the frames per second.
+
+        Args:
+          filename: the raw file, as for load_raw()
+          trigger_pin, trace, keyboard: as for display_raw()
+          buffer_frames: frames the ring holds. Each takes as much memory as
+            one frame of the screen. Defaults to 32.
+
+        Returns:
+          As for display_raw(), with two more fields: underruns, the frames
+          that had to be waited for, and min_buffered, the fewest frames the
+          ring held ahead of the display while there was enough of the movie
+          left to fill it. A min_buffered near 0 means the disc only just
+          kept up.
+        """
+        if trigger_pin == 1:
+                raise ValueError("trigger_pin cannot be set to 1. This pin is reserved for feedback")
+        filename = os.path.expanduser(filename)
+        with self._display_lock:
+                rawtuple = rpigratings.stream_raw(self.capsule, filename, trigger_pin,
+                                                  buffer_frames, trace, keyboard)
         if rawtuple is None:
                 return None
-        else:
-                return GratPerfRec(*rawtuple)
+        return StreamPerfRec(*rawtuple)
+
+    def display_sequence(self, steps, trigger_pin = 0, trace = False, keyboard = True):
+        """
+        Play a whole list of trials at once, with no Python between them.
+        steps holds loaded gratings and raws, Grey(refreshes) for that many
+        refreshes of the background, and PinEvent(pin, value) to set an
+        output pin (as numbered by wiringPi) high or low. After the trigger,
+        each stimulus or grey period starts on the vsync the previous one
+        ends on, so intertrial intervals are exact multiples of the refresh
+        period and don't drift from the display clock. Pin events take
+        effect as the flip starting the next step returns, or at the end.
+
+        cancel_trigger(), or a key while waiting for the trigger, ends the
+        sequence as it does display_grating().
+
+        Args:
+          steps: list of Grating, Raw, Grey and PinEvent objects. A
+            PinEvent can't set pin 1, reserved for feedback, or trigger_pin.
+          trigger_pin: as for display_grating(). The sequence waits for
+            the trigger once, before its first step.
+          trace, keyboard: as for display_grating(). Each stimulus gets the
+            trace of its own frames, with vsync_count counted from its first.
+
+        Returns:
+          A list with a TrialPerfRec for each stimulus, or None if the
+          sequence was cancelled. Each has the fields of display_grating()'s
+          record, summarising that stimulus's frames (only the first has
+          the trigger), and onset_time, when its first flip returned in
+          CLOCK_MONOTONIC nanoseconds; onset_vsync, the refreshes from the
+          first step's flip to that one; late_vsyncs, how many refreshes
+          later than the frames and grey periods before it scheduled that
+          was, which is 0 unless vsyncs were missed; and stimulus, its
+          filename.
+        """
+        if trigger_pin == 1:
+                raise ValueError("trigger_pin cannot be set to 1. This pin is reserved for feedback")
+        raw_steps = []
+        stimuli = []
+        for step in steps:
+                if isinstance(step, Grey):
+                        raw_steps.append((_STEP_GREY, step.refreshes))
+                elif isinstance(step, PinEvent):
+                        if step.pin == 1:
+                                raise ValueError("PinEvent cannot set pin 1. This pin is reserved for feedback")
+                        if trigger_pin > 0 and step.pin == trigger_pin:
+                                raise ValueError("PinEvent cannot set pin %d, the trigger pin" %step.pin)
+                        raw_steps.append((_STEP_PIN, step.pin, step.value))
+                elif isinstance(step, (Grating, Raw)):
+                        raw_steps.append((_STEP_STIMULUS, step.capsule))
+                        stimuli.append(step)
+                else:
+                        raise TypeError("Steps must be gratings, raws, Grey or PinEvent, not %r" %(step,))
+        with self._display_lock:
+                records = rpigratings.display_sequence(self.capsule, raw_steps, trigger_pin,
+                                                       self.background, trace, keyboard)
+        if records is None:
+                return None
+        return [TrialPerfRec(*record, stimulus=stimulus.filename)
+                for record, stimulus in zip(records, stimuli)]
 
     def display_greyscale(self,color):
         """
@@ -395,7 +1287,8 @@ class Screen:
                 raise ValueError("Color must be between each between 0 and 255.")
         rpigratings.display_color(self.capsule,color,color,color)
 
-    def display_gratings_randomly(self, dir_containing_gratings, intertrial_time, logfile_name="rpglog.txt"):
+    def display_gratings_randomly(self, dir_containing_gratings, intertrial_time, logfile_name="rpglog.txt", binary_log=False,
+                                  prefetch=2, memory_budget=None):
         """
         For each file in directory dir_containing_gratings, attempt to display
         that file as a grating. The order of display is a fixed but psudorandomised.
@@ -404,17 +1297,33 @@ class Screen:
         object created.
 
         Method is blocking, and will not return until all files in directory
-        displayed
+        displayed. The trials play as a few display_sequence() calls, see
+        prefetch, so the grey between the trials of a batch is counted in
+        vsyncs with no Python in between, and the log is written as each
+        batch ends.
 
 
         Args:
           dir_containing_gratings: A relative or absolute directory path
             to a directory containing gratings. Must not contain any other 
             non grating files, or sub directories.
-          intertrial_time: Time between gratings in seconds. Will have 
-            ~1 millisecond accuracy
+          intertrial_time: Time between gratings in seconds. Rounded to a whole
+            number of refreshes, which display_sequence() counts in vsyncs.
+            0 plays the gratings back to back
           logfile_name: Name of log file to write performance record to.
             written into directory ~/rpg/logs/
+          binary_log: (optional) if True, write a binary log holding each
+            frame's trace instead of a line of text. Read it with read_log().
+            Records are appended to an existing binary log, but any other
+            existing file raises ValueError before the first trial.
+          prefetch: (optional) every stimulus of a sequence has to be in
+            memory while it plays, so the trials are split into batches of
+            prefetch+1 stimuli, played as a sequence each. If not 0, the
+            next batch is loaded on a background thread while one plays.
+            Only the gap between batches has Python in it. Defaults to 2.
+          memory_budget: (optional) if set, batches are instead of no more
+            than this many bytes, or half of it if prefetch is not 0, so
+            that the batch playing and the next fit in the budget.
 
         Returns:
           None
@@ -424,21 +1333,14 @@ class Screen:
         path_to_gratings = [dir_containing_gratings + "/" + file for file in os.listdir(dir_containing_gratings)]
         randomized_path = self._randomize_list(path_to_gratings)
 
-        gratings = []
-        print("Loading gratings...")
-        for file in randomized_path:
-            gratings.append(self.load_grating(file))
+        print("Displaying in order of: " + str([path.split("/")[-1] for path in randomized_path ] ))
 
-        print("Displaying in order of: " + str([grating.filename.split("/")[-1] for grating in gratings ] ))
+        self._display_in_sequence(self.cache.load_grating, "Grating", randomized_path, intertrial_time,
+                                  logfile_name, binary_log, prefetch, memory_budget)
 
-        for grating in gratings:
-            perf = self.display_grating(grating)
-            self.display_greyscale(self.background)
-            self._print_log(logfile_name, "Grating", grating.filename, perf)
-            t.sleep(intertrial_time)
 
-
-    def display_raw_randomly(self, dir_containing_raws, intertrial_time, logfile_name="rpglog.txt"):
+    def display_raw_randomly(self, dir_containing_raws, intertrial_time, logfile_name="rpglog.txt", binary_log=False,
+                             prefetch=2, memory_budget=None):
         """
         For each file in directory dir_containing_raws, attempt to display
         that file as a raw. The order of display is a fixed but psudorandomised.
@@ -447,17 +1349,31 @@ class Screen:
         object created.
 
         Method is blocking, and will not return until all files in directory
-        displayed
+        displayed. The trials play as a few display_sequence() calls, as
+        for display_gratings_randomly().
 
 
         Args:
           dir_containing_raws: A relative or absolute directory path
             to a directory containing raws. Must not contain any other 
             non raw files, or sub directories.
-          intertrial_time: Time between raws in seconds. Will have 
-            ~1 millisecond accuracy
+          intertrial_time: Time between raws in seconds. Rounded to a whole
+            number of refreshes, which display_sequence() counts in vsyncs.
+            0 plays the raws back to back
           logfile_name: Name of log file to write performance record to.
             written into directory ~/rpg/logs/
+          binary_log: (optional) if True, write a binary log holding each
+            frame's trace instead of a line of text. Read it with read_log().
+            Records are appended to an existing binary log, but any other
+            existing file raises ValueError before the first trial.
+          prefetch: (optional) every stimulus of a sequence has to be in
+            memory while it plays, so the trials are split into batches of
+            prefetch+1 stimuli, played as a sequence each. If not 0, the
+            next batch is loaded on a background thread while one plays.
+            Only the gap between batches has Python in it. Defaults to 2.
+          memory_budget: (optional) if set, batches are instead of no more
+            than this many bytes, or half of it if prefetch is not 0, so
+            that the batch playing and the next fit in the budget.
 
         Returns:
           None
@@ -467,21 +1383,68 @@ class Screen:
         path_to_raws = [dir_containing_raws + "/" + file for file in os.listdir(dir_containing_raws)]
         randomized_path = self._randomize_list(path_to_raws)
 
-        raws = []
-        print("Loading raws...")
-        for file in randomized_path:
-            raws.append(self.load_raw(file))
-
-        print("Displaying in order of: " + str([raw.filename.split("/")[-1] for raw in raws ] ))
+        print("Displaying in order of: " + str([path.split("/")[-1] for path in randomized_path ] ))
 
-        for raw in raws:
-            perf = self.display_raw(raw)
-            self.display_greyscale(self.background)
-            self._print_log(logfile_name, "Raw", raw.filename, perf)
-            t.sleep(intertrial_time)
+        self._display_in_sequence(self.cache.load_raw, "Raw", randomized_path, intertrial_time,
+                                  logfile_name, binary_log, prefetch, memory_budget)
 
 
-    def display_rand_grating_on_pulse(self, dir_containing_gratings, trigger_pin, logfile_name="rpglog.txt"):
+    def _display_in_sequence(self, load, file_type, paths, intertrial_time, logfile_name,
+                             binary_log, prefetch, memory_budget):
+        """
+        Internal function for display_gratings_randomly() and
+        display_raw_randomly(): plays the stimuli at paths, loaded with
+        load, in batches of prefetch+1 stimuli, or as few as memory_budget
+        allows if it is set, and logs each.
+        """
+        if intertrial_time < 0:
+            raise ValueError("intertrial_time must be >= 0")
+        self._check_log(logfile_name, binary_log)
+        if not paths:
+            return
+        grey_refreshes = int(round(intertrial_time * self.refresh_rate))
+        batch_budget = memory_budget
+        if memory_budget is not None and prefetch:
+            batch_budget = memory_budget // 2
+        if prefetch < 0:
+            raise ValueError("prefetch must be >= 0")
+        batches = [[]]
+        batch_size = 0
+        for n, path in enumerate(paths):
+            if memory_budget is None:
+                full = len(batches[-1]) > prefetch
+            else:
+                size = os.path.getsize(path)
+                full = batches[-1] and batch_size + size > batch_budget
+            if full:
+                batches.append([])
+                batch_size = 0
+            batches[-1].append(n)
+            if memory_budget is not None:
+                batch_size += size
+        #room for the batch playing and, with prefetch, all of the next one
+        longest = max(len(batch) for batch in batches)
+        depth = 2*longest - 1 if prefetch else longest - 1
+        stimuli = _Prefetcher(load, paths, depth, memory_budget)
+        try:
+            for batch in batches:
+                steps = []
+                for n in batch:
+                    steps.append(stimuli.get(n))
+                    if grey_refreshes:
+                        steps.append(Grey(grey_refreshes))
+                records = self.display_sequence(steps, trace=binary_log)
+                del steps
+                if records is None:
+                    return
+                for record in records:
+                    self._print_log(logfile_name, file_type, record.stimulus, record, binary_log)
+                stimuli.release(batch[-1])
+        finally:
+            stimuli.close()
+
+    def display_rand_grating_on_pulse(self, dir_containing_gratings, trigger_pin, logfile_name="rpglog.txt", binary_log=False,
+                                      prefetch=2, memory_budget=None):
         """
         Displays a psudorandom grating from the passed directory in response
         to a 3.3V signal to a GPIO pin. Gauranteed to display each grating
@@ -498,40 +1461,52 @@ class Screen:
             3.3V pulse.
           logfile_name: Name of log file to write performance record to.
             written into directory ~/rpg/logs/
+          binary_log: (optional) if True, write a binary log holding each
+            frame's trace instead of a line of text. Read it with read_log().
+            Records are appended to an existing binary log, but any other
+            existing file raises ValueError before the first trial.
+          prefetch: (optional) how many stimuli to load ahead of the one
+            playing. They're loaded on a background thread while it plays,
+            so only prefetch+1 stimuli are in memory at once.
+          memory_budget: (optional) if set, also keep the stimuli in memory
+            to no more than this many bytes, apart from the one playing.
 
         Returns:
           None
         """
 
+        self._check_log(logfile_name, binary_log)
         self.display_greyscale(self.background)
 
         dir_containing_gratings = os.path.expanduser(dir_containing_gratings)
         path_to_gratings = [dir_containing_gratings + "/" + file for file in os.listdir(dir_containing_gratings)]
         randomized_path = self._randomize_list(path_to_gratings)
 
-        gratings = []
-        print("Loading gratings...")
-        for file in randomized_path:
-            gratings.append(self.load_grating(file))
-
-        print("Displaying in order of: " + str([grating.filename.split("/")[-1] for grating in gratings ] ))
+        print("Displaying in order of: " + str([path.split("/")[-1] for path in randomized_path ] ))
         print("Waiting for pulse on pin " + str(trigger_pin) + ".")
         print("Press any key to stop waiting...")
 
-        n = 0
-        while True:
-            perf = self.display_grating(gratings[n], trigger_pin)
-            self.display_greyscale(self.background)
-            if perf is None:
-                break
-            self._print_log(logfile_name, "Grating", gratings[n].filename, perf)
-            n += 1
-            if n >= len(gratings):
-                n = 0
+        #n counts up forever; the prefetcher goes round the list
+        gratings = _Prefetcher(self.cache.load_grating, randomized_path, prefetch, memory_budget, repeat=True)
+        try:
+            n = 0
+            while True:
+                grating = gratings.get(n)
+                perf = self.display_grating(grating, trigger_pin, binary_log)
+                self.display_greyscale(self.background)
+                if perf is None:
+                    break
+                self._print_log(logfile_name, "Grating", grating.filename, perf, binary_log)
+                del grating
+                gratings.release(n)
+                n += 1
+        finally:
+            gratings.close()
 
         print("Waiting for pulses ended")
 
-    def display_rand_raw_on_pulse(self, dir_containing_raws, trigger_pin, logfile_name="rpglog.txt"):
+    def display_rand_raw_on_pulse(self, dir_containing_raws, trigger_pin, logfile_name="rpglog.txt", binary_log=False,
+                                  prefetch=2, memory_budget=None):
         """
         Displays a psudorandom raw from the passed directory in response
         to a 3.3V signal to a GPIO pin. Gauranteed to display each raw
@@ -548,42 +1523,52 @@ class Screen:
             3.3V pulse.
           logfile_name: Name of log file to write performance record to.
             written into directory ~/rpg/logs/
+          binary_log: (optional) if True, write a binary log holding each
+            frame's trace instead of a line of text. Read it with read_log().
+            Records are appended to an existing binary log, but any other
+            existing file raises ValueError before the first trial.
+          prefetch: (optional) how many stimuli to load ahead of the one
+            playing. They're loaded on a background thread while it plays,
+            so only prefetch+1 stimuli are in memory at once.
+          memory_budget: (optional) if set, also keep the stimuli in memory
+            to no more than this many bytes, apart from the one playing.
 
         Returns:
           None
         """
 
+        self._check_log(logfile_name, binary_log)
         self.display_greyscale(self.background)
 
         dir_containing_raws = os.path.expanduser(dir_containing_raws)
         path_to_raws = [dir_containing_raws + "/" + file for file in os.listdir(dir_containing_raws)]
         randomized_path = self._randomize_list(path_to_raws)
 
-        raws = []
-        print("Loading raws...")
-        for file in randomized_path:
-            raws.append(self.load_raw(file))
-
-        print("Displaying in order of: " + str([raw.filename.split("/")[-1] for raw in raws ] ))
+        print("Displaying in order of: " + str([path.split("/")[-1] for path in randomized_path ] ))
         print("Waiting for pulse on pin " + str(trigger_pin) + ".")
         print("Press any key to stop waiting...")
 
-        n = 0
-        while True:
-            perf = self.display_raw(raws[n], trigger_pin)
-            self.display_greyscale(self.background)
-            if perf is None:
-                break
-            self._print_log(logfile_name, "Raw", raws[n].filename, perf)
-            n += 1
-            if n >= len(raws):
-                n = 0
+        raws = _Prefetcher(self.cache.load_raw, randomized_path, prefetch, memory_budget, repeat=True)
+        try:
+            n = 0
+            while True:
+                raw = raws.get(n)
+                perf = self.display_raw(raw, trigger_pin, binary_log)
+                self.display_greyscale(self.background)
+                if perf is None:
+                    break
+                self._print_log(logfile_name, "Raw", raw.filename, perf, binary_log)
+                del raw
+                raws.release(n)
+                n += 1
+        finally:
+            raws.close()
 
         print("Waiting for pulses ended")
 
 
 
-    def _print_log(self, filename, file_type, file_displayed, perf):
+    def _print_log(self, filename, file_type, file_displayed, perf, binary=False):
         """
         Internal function for print log file
  
@@ -591,16 +1576,51 @@ class Screen:
           filename: string of file displayed
           file_type: string of whether the file was a raw or a grating
           perf: Named tuple of performance record
+          binary: if True, append a binary record with perf's trace instead
+            of a line of text
 
         Returns:
           None
         """
 
         path_of_logfile = os.path.expanduser("~/rpg/logs/") + filename
+        if binary:
+            self._check_log(filename, binary)
+            name = file_displayed.encode()
+            trace = perf.trace if perf.trace is not None else b""
+            with open(path_of_logfile, "ab") as file:
+                if file.tell() == 0:
+                    file.write(_LOG_MAGIC)
+                file.write(_LOG_RECORD.pack(file_type[:4].encode(), perf.start_time, perf.mean_interframe,
+                                            perf.stddev_interframe, perf.mean_copy, perf.max_copy,
+                                            perf.mean_flip, perf.max_flip, perf.missed_vsyncs,
+                                            perf.trigger_time, perf.trigger_latency,
+                                            len(name), len(trace)//_TRACE_RECORD.size))
+                file.write(name)
+                file.write(trace)
+            return
         with open(path_of_logfile, "a") as file:
             file.write("%s: \t %s \t Displayed starting at (unix time): %d \t Average frame duration (micros): %.2f \t  Std Dev of frame duration(FPS): %.2f \n" 
                 %(file_type, file_displayed, perf.start_time, perf.mean_interframe, perf.stddev_interframe))
 
+    def _check_log(self, filename, binary):
+        """
+        Internal function that raises ValueError if a binary log is to be
+        written to filename but it already holds something else, which
+        appending records to would leave unreadable by read_log().
+        """
+        if not binary:
+            return
+        path_of_logfile = os.path.expanduser("~/rpg/logs/") + filename
+        try:
+            with open(path_of_logfile, "rb") as file:
+                magic = file.read(len(_LOG_MAGIC))
+        except FileNotFoundError:
+            return
+        if magic and magic != _LOG_MAGIC:
+            raise ValueError("%s is not a binary log, so binary records can't be added to it; "
+                             "choose another logfile_name" % path_of_logfile)
+
     def _randomize_list(self, lst):
         """
         Internal function for psudorandomizing gratings paths. Files paths are hashed
@@ -624,6 +1644,103 @@ class Screen:
             randomized_gratings.append( lst[el[1]] )
         return randomized_gratings
 
+    def enable_realtime(self, priority=50, cpu=None, lock=True, probe_frames=120):
+        """
+        Runs later display calls in real-time mode: on a thread of their own
+        with SCHED_FIFO priority, pinned to one CPU, on a locked and
+        pre-faulted stack, with the stimulus, trace and framebuffer locked in
+        RAM so none of it can be paged out mid-animation.
+
+        SCHED_FIFO needs root, CAP_SYS_NICE or an RLIMIT_RTPRIO of at least
+        priority, and locking needs RLIMIT_MEMLOCK (ulimit -l) to cover the
+        stimulus. Whatever isn't allowed is done without; the returned report
+        says what was granted.
+
+        Each stimulus is locked the first time it is shown in this mode and
+        stays locked until it is released, as if loaded with lock=True, so a
+        stimulus shown many times is only locked once. The framebuffer
+        likewise stays locked until the mode is turned off.
+
+        To show what difference it makes, probe_frames frames of the display
+        loop, without a stimulus, are timed before and after turning it on.
+        The screen shows whatever it was showing throughout.
+
+        Args:
+          priority: SCHED_FIFO priority, 1 to 99. Defaults to 50.
+          cpu: CPU to pin the display thread to. Defaults to None, the last
+            one, which is the one to isolate with isolcpus= on the kernel
+            command line.
+          lock: whether to lock memory. Defaults to True.
+          probe_frames: frames to time before and after. Defaults to 120.
+
+        Returns:
+          a RealtimeReport namedtuple with the mean and standard deviation of
+          the interframe time in microseconds and the missed vsyncs before
+          (before_mean, before_stddev, before_missed) and after (after_mean,
+          after_stddev, after_missed) turning the mode on, and whether the
+          display thread got SCHED_FIFO (fifo), was pinned (pinned) and had
+          its memory locked (locked).
+        """
+        if cpu is None:
+            cpu = os.cpu_count() - 1
+        if cpu < 0 or cpu >= os.cpu_count():
+            raise ValueError("cpu must be between 0 and %d" %(os.cpu_count() - 1))
+        if priority < 1:
+            raise ValueError("priority must be at least 1; use disable_realtime() to turn it off")
+        with self._display_lock:
+            before = rpigratings.probe_jitter(self.capsule, probe_frames)
+            rpigratings.set_realtime(self.capsule, priority, cpu, lock)
+            after = rpigratings.probe_jitter(self.capsule, probe_frames)
+        granted = after[3]
+        return RealtimeReport(before[0], before[1], before[2], after[0], after[1], after[2],
+                              bool(granted & _REALTIME_FIFO), bool(granted & _REALTIME_PINNED),
+                              bool(granted & _REALTIME_LOCKED))
+
+    def disable_realtime(self):
+        """
+        Turns real-time mode off, so display calls run on the calling
+        thread again.
+
+        Returns:
+          None
+        """
+        rpigratings.set_realtime(self.capsule, 0, -1, False)
+
+    def cancel_trigger(self, token = 0):
+        """
+        Ends a display_grating() or display_raw() call's wait for its
+        trigger, or its playback after the current frame, and the call then
+        returns None as if a key had been pressed. Can be called from another
+        thread. If no call is under way, it does nothing.
+
+        Args:
+          token: (internal) cancel only the call made with this token, see
+            DisplayHandle.cancel()
+
+        Returns:
+          None
+        """
+        rpigratings.cancel_trigger(self.capsule, token)
+
+    def sim_trigger(self, pin, delay=0, duration=0.05):
+        """
+        Simulate a trigger pulse on an input pin of a Screen created with
+        backend="sim", as if a 3.3V signal had been applied to it.
+
+        Args:
+          pin: the GPIO pin (as defined by wiringPi) to pulse.
+          delay: seconds from now until the pin goes high. Defaults to 0.
+          duration: seconds the pin stays high. Defaults to 0.05.
+
+        The start of the pulse is delivered as an edge, the way the GPIO
+        driver reports one, so a display waiting on the pin wakes at once
+        and reports the scheduled start as its trigger_time.
+
+        Returns:
+          None
+        """
+        rpigratings.sim_trigger(self.capsule, pin, delay, duration)
+
     def close(self):
         """
         Destroy this object, cleaning up its memory and restoring previous
@@ -636,8 +1753,12 @@ class Screen:
           None
         """
 
+        if getattr(self, "capsule", None) is None:
+                return
         print("Screen object has been closed. You will need to make a new one")
+        self.cache.clear()
         rpigratings.close_display(self.capsule)
+        self.capsule = None
         del self
 
     def __del__(self):
@@ -646,26 +1767,296 @@ class Screen:
 
 
 class Grating:
-	def __init__(self, master, filename):
+	def __init__(self, master, filename, mode=0):
 		if type(master).__name__ != "Screen":
 			raise ValueError("master must be a Screen instance")
-		self.master = master
+		#A weak reference, as the Screen's cache may keep this stimulus
+		self._master = weakref.ref(master)
 		self.filename = filename
-		self.capsule = rpigratings.load_grating(master.capsule,filename)
+		self.capsule = rpigratings.load_grating(master.capsule,filename,mode)
+	@property
+	def master(self):
+		return self._master()
 	def __del__(self):
 		rpigratings.unload_grating(self.capsule)
 
 
 class Raw:
-	def __init__(self, master, filename):
+	def __init__(self, master, filename, mode=0, buffer=None, refresh_per_frame=1):
 		if type(master).__name__ != "Screen":
 			raise ValueError("master must be a Screen instance")
-		self.master = master
+		self._master = weakref.ref(master)
 		self.filename = filename
-		self.capsule = rpigratings.load_raw(filename)
+		if buffer is None:
+			self.capsule = rpigratings.load_raw(master.capsule, filename, mode)
+		else:
+			#displayed in place; the capsule holds the buffer until unloaded
+			self.buffer = buffer
+			self.capsule = rpigratings.raw_from_buffer(master.capsule, buffer, refresh_per_frame)
+	@property
+	def master(self):
+		return self._master()
 	def __del__(self):
 		rpigratings.unload_raw(self.capsule)
 
+#Tokens for display calls that can be cancelled on their own, see DisplayHandle
+_display_tokens = itertools.count(1)
+
+class DisplayHandle:
+    """
+    A display running on a background thread, returned by
+    Screen.display_grating_async() and Screen.display_raw_async().
+
+    Poll it with done(), block on it with result(), or await it from a
+    coroutine. The stimulus is kept loaded until the display ends.
+    """
+
+    def __init__(self, screen, display, stimulus, trigger_pin, trace):
+        self.future = concurrent.futures.Future()
+        self._screen = screen
+        self._lock = threading.Lock()
+        self._finished = False
+        self._cancelled = False
+        #Cancels this display alone, however long it waits for its turn
+        self._token = next(_display_tokens)
+        self._thread = threading.Thread(target=self._run, daemon=True,
+                                        args=(display, stimulus, trigger_pin, trace))
+        self._thread.start()
+
+    def _run(self, display, stimulus, trigger_pin, trace):
+        self.future.set_running_or_notify_cancel()
+        try:
+            with self._lock:
+                cancelled = self._cancelled
+            if cancelled:
+                result = None
+            else:
+                result = self._screen._display_stimulus(display, stimulus, trigger_pin,
+                                                        trace, False, self._token)
+        except BaseException as error:
+            with self._lock:
+                self._finished = True
+            self.future.set_exception(error)
+        else:
+            with self._lock:
+                self._finished = True
+            self.future.set_result(result)
+
+    def done(self):
+        """
+        Returns:
+          True once the display has ended, however it ended.
+        """
+        return self.future.done()
+
+    def result(self, timeout=None):
+        """
+        Wait for the display to end.
+
+        Args:
+          timeout: seconds to wait, or None (the default) to wait for as long
+            as it takes.
+
+        Returns:
+          the performance record, or None if the display was cancelled.
+          Raises whatever the display raised, or TimeoutError if it is still
+          running after timeout seconds.
+        """
+        return self.future.result(timeout)
+
+    def cancel(self):
+        """
+        End the display, whether it is still waiting for its turn behind
+        other displays (it is then skipped), waiting for its trigger or
+        already playing (after the current frame). Its result is then None.
+        Other displays on the screen aren't affected.
+
+        Returns:
+          True if the display was still running, False if it had already
+          ended.
+        """
+        with self._lock:
+            if self._finished:
+                return False
+            self._cancelled = True
+            self._screen.cancel_trigger(self._token)
+            return True
+
+    def __await__(self):
+        import asyncio
+        return asyncio.wrap_future(self.future).__await__()
+
+class StimulusCache:
+    """
+    Shares loaded gratings and raws between the trial loops of a Screen.
+    Stimuli are keyed by the file's path, device, inode, modification
+    time and size, and by how they were loaded, so a file that is changed
+    or replaced is loaded afresh.
+
+    Any stimulus still in use is handed out again rather than loaded
+    twice. On top of that, up to budget bytes of stimuli (by file size)
+    are kept after their last use, dropping the least recently used
+    first. hits, misses and evictions count lookups that found a loaded
+    stimulus, lookups that had to load one, and stimuli dropped to stay
+    within budget; size is the bytes currently kept.
+    """
+    def __init__(self, screen, budget=0):
+        if budget < 0:
+            raise ValueError("cache_budget must be >= 0")
+        #A weak reference, so deleting the Screen still closes it at once
+        self.screen = weakref.ref(screen)
+        self.budget = budget
+        self.size = 0
+        self.hits = 0
+        self.misses = 0
+        self.evictions = 0
+        self.live = weakref.WeakValueDictionary()
+        self.kept = OrderedDict()
+        self.lock = threading.Lock()
+
+    def load_grating(self, filename, mmap=False, populate=False, lock=False):
+        """As Screen.load_grating(), through the cache."""
+        return self._load(Grating, filename, _load_mode(mmap, populate, lock))
+
+    def load_raw(self, filename, mmap=False, populate=False, lock=False):
+        """As Screen.load_raw(), through the cache."""
+        return self._load(Raw, filename, _load_mode(mmap, populate, lock))
+
+    def _load(self, kind, filename, mode):
+        filename = os.path.realpath(os.path.expanduser(filename))
+        stat = os.stat(filename)
+        key = (kind.__name__, filename, stat.st_dev, stat.st_ino, stat.st_mtime_ns, stat.st_size, mode)
+        with self.lock:
+            stimulus = self.live.get(key)
+            if stimulus is not None:
+                self.hits += 1
+                self._keep(key, stimulus, stat.st_size)
+                return stimulus
+            self.misses += 1
+        #Load without the lock, so a prefetching thread doesn't hold up lookups
+        stimulus = kind(self.screen(), filename, mode)
+        with self.lock:
+            stimulus = self.live.setdefault(key, stimulus)
+            self._keep(key, stimulus, stat.st_size)
+        return stimulus
+
+    def _keep(self, key, stimulus, size):
+        if key in self.kept:
+            self.kept.move_to_end(key)
+            return
+        if size > self.budget:
+            return
+        self.kept[key] = (stimulus, size)
+        self.size += size
+        while self.size > self.budget:
+            self.size -= self.kept.popitem(last=False)[1][1]
+            self.evictions += 1
+
+    def stats(self):
+        """Returns the counters as a dictionary."""
+        with self.lock:
+            return {"hits": self.hits, "misses": self.misses, "evictions": self.evictions,
+                    "size": self.size, "budget": self.budget, "kept": len(self.kept)}
+
+    def clear(self):
+        """Drops every kept stimulus. Those still in use stay loaded."""
+        with self.lock:
+            self.kept.clear()
+            self.size = 0
+
+class _Prefetcher:
+    """
+    Loads stimuli on a background thread ahead of a trial loop. Stimulus
+    n is paths[n], or with repeat, paths[n % len(paths)] so that a loop
+    can go round the list forever.
+    At most depth stimuli past the oldest unreleased one are loaded, and
+    if memory_budget is set, the files loaded add up to no more than that
+    many bytes unless only one is loaded.
+
+    Loading and displaying both release the GIL, so the thread reads the
+    next file while the current one plays. stalls counts the times get()
+    had to wait for it.
+    """
+    def __init__(self, load, paths, depth, memory_budget=None, repeat=False):
+        if depth < 0:
+            raise ValueError("prefetch must be >= 0")
+        if not paths:
+            raise ValueError("There are no stimuli to load")
+        self.load = load
+        self.paths = paths
+        self.depth = depth
+        self.memory_budget = memory_budget
+        self.repeat = repeat
+        self.loaded = {}
+        self.resident = 0
+        self.next = 0
+        self.oldest = 0
+        self.stalls = 0
+        self.error = None
+        self.stopping = False
+        self.condition = threading.Condition()
+        self.thread = threading.Thread(target=self._run, daemon=True)
+        self.thread.start()
+
+    def _room_for(self, size):
+        if self.next - self.oldest > self.depth:
+            return False
+        if self.memory_budget is None or not self.loaded:
+            return True
+        return self.resident + size <= self.memory_budget
+
+    def _run(self):
+        #Any error ends the thread, and is raised by get() for the
+        #stimulus it was loading rather than leaving get() waiting
+        try:
+            while self.repeat or self.next < len(self.paths):
+                path = self.paths[self.next % len(self.paths)]
+                try:
+                    size = os.path.getsize(path)
+                except OSError:
+                    size = 0
+                with self.condition:
+                    while not self.stopping and not self._room_for(size):
+                        self.condition.wait()
+                    if self.stopping:
+                        return
+                stimulus = self.load(path)
+                with self.condition:
+                    self.loaded[self.next] = (stimulus, size)
+                    self.resident += size
+                    self.next += 1
+                    self.condition.notify_all()
+        except Exception as error:
+            with self.condition:
+                self.error = (self.next, error)
+                self.condition.notify_all()
+
+    def get(self, n):
+        """Returns stimulus n, waiting for it to load if it hasn't yet."""
+        with self.condition:
+            if n not in self.loaded:
+                self.stalls += 1
+            while n not in self.loaded:
+                if self.error is not None and self.error[0] <= n:
+                    raise self.error[1]
+                self.condition.wait()
+            return self.loaded[n][0]
+
+    def release(self, n):
+        """Lets stimulus n, and any before it, be unloaded."""
+        with self.condition:
+            for old in [old for old in self.loaded if old <= n]:
+                self.resident -= self.loaded.pop(old)[1]
+            self.oldest = n + 1
+            self.condition.notify_all()
+
+    def close(self):
+        with self.condition:
+            self.stopping = True
+            self.condition.notify_all()
+        self.thread.join()
+        self.loaded.clear()
+
 def _parse_options(options):
     """
     An internal function for testing if options have been
@@ -718,6 +2109,24 @@ def _parse_options(options):
     if "waveform" not in op:
         op["waveform"] = SINE
 
+    if "kernel" in op:
+        if op["kernel"] not in (KERNEL_EXACT, KERNEL_LUT):
+            raise ValueError("options['kernel'] set to invalid value of %d, must be rpg.KERNEL_EXACT or rpg.KERNEL_LUT" %op["kernel"])
+    else:
+        op["kernel"] = KERNEL_EXACT
+
+    if "format" in op:
+        if op["format"] not in (FORMAT_FRAMES, FORMAT_ROWSHIFT):
+            raise ValueError("options['format'] set to invalid value of %d, must be rpg.FORMAT_FRAMES or rpg.FORMAT_ROWSHIFT" %op["format"])
+    else:
+        op["format"] = FORMAT_FRAMES
+
+    if "fps" in op:
+        if op["fps"] <= 0:
+            raise ValueError("options['fps'] set to invalid value of %d, must be set > 0 or not set" %op["fps"])
+    else:
+        op["fps"] = 0
+
     if "percent_sigma" in op:
         if op["percent_sigma"] <= 0:
             raise ValueError("options['percent_sigma'] set to invalid value of %d, must be set > 0 or not set" %op["percent_sigma"])
@@ -743,3 +2152,33 @@ def _parse_options(options):
         op["percent_padding"] = 0
 
     return op
+
+def _load_mode(mmap, populate, lock):
+    if populate and not mmap:
+        raise ValueError("populate only applies when mmap is True")
+    mode = 0
+    if mmap:
+        mode |= _LOAD_MMAP
+    if populate:
+        mode |= _LOAD_POPULATE
+    if lock:
+        mode |= _LOAD_LOCK
+    return mode
+
+def _parse_threads(threads):
+    """
+    An internal function for checking the threads argument of the
+    build functions.
+
+    Args:
+      threads: None, or the number of threads to render with.
+
+    Returns:
+      Thread count suitable for passing to _rpigratings.build_grating,
+      where 0 means one thread per core.
+    """
+    if threads is None:
+        return 0
+    if threads < 1:
+        raise ValueError("threads set to invalid value of %d, must be >= 1 or None" %threads)
+    return int(threads)
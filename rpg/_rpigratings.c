@@ -5,17 +5,45 @@
 #include <inttypes.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <sys/ioctl.h>
 #include <sys/select.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <string.h>
+#include <limits.h>
 #include <time.h>
+#ifdef HAVE_WIRINGPI
 #include <wiringPi.h>
+#else
+//wiringPi's values, for the backends' pin functions
+#define INPUT 0
+#define OUTPUT 1
+#define LOW 0
+#define HIGH 1
+#endif
 #include <termios.h>
-#include <stropts.h>
 #include <stdbool.h>
+#include <stdarg.h>
 #include <linux/fb.h>
+#include <linux/gpio.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RPG_X86
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define RPG_NEON
+#endif
+#if defined(__arm__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
 
 #define ANGLE_0 -1
 #define ANGLE_90 -2
@@ -23,11 +51,61 @@
 #define ANGLE_270 -4
 #define SINE 1
 #define SQUARE 0
+#define KERNEL_EXACT 0
+#define KERNEL_LUT 1
+#define FORMAT_FRAMES 0
+#define FORMAT_ROWSHIFT 1
 
+#define ROWSHIFT_MAGIC 0x52535052 //"RPSR", can't be the start of a fileheader_t
+#define ROWSHIFT_LEVELS 255 //envelope weights are quantised to this many steps
+
+#define CONTAINER_MAGIC 0x32475052 //"RPG2", can't be the start of a legacy header either
+#define CONTAINER_VERSION 2
+#define CONTAINER_ALIGN 4096 //every frame in a container starts on a multiple of this
+#define CONTAINER_GRATING 1
+#define CONTAINER_RAW 2
+#define PIXEL_RGB565 1
+#define ROI_ALIGN 32 //pixels, a region of interest's columns start and end on multiples of this
+
+#define LUT_SUBSTEPS 64 //table entries per pixel of wavelength, a power of 2
+#define ENVELOPE_CACHE_MAPS 4 //envelope maps kept for reuse once no build is using them
+
+#define FLIP_MAILBOX 0 //flip by setting the virtual offset through /dev/vcio
+#define FLIP_PAN 1 //flip with the framebuffer's FBIOPAN_DISPLAY ioctl
+
+#define LOAD_MMAP 1 //map the file read-only instead of copying it to the heap
+#define LOAD_POPULATE 2 //read every page of a mapping in before returning
+#define LOAD_LOCK 4 //lock the stimulus in RAM so it can't be paged out
+#define LOAD_BORROWED 8 //the frames are a Python object's buffer, see raw_from_buffer()
+
+#define STEP_STIMULUS 0 //a sequence step that plays a loaded stimulus
+#define STEP_GREY 1 //one that shows the background for a number of refreshes
+#define STEP_PIN 2 //one that sets an output pin as the next step starts
+
+#define CONVERT_CHUNK 65536 //pixels convert_raw() packs and writes at a time
+
+
+#define REALTIME_FIFO 1 //the display thread ran with SCHED_FIFO
+#define REALTIME_PINNED 2 //the display thread was pinned to its CPU
+#define REALTIME_LOCKED 4 //the stimuli and trace were locked in RAM
+#define DISPLAY_STACK (1024*1024) //bytes of stack for a real-time display thread
+#define TRIGGER_POLL_MS 1 //how often poll_for_trigger() reads the pin
 
 #define DEGREES_SUBTENDED 80 //The degrees of visual angle
 			     // subtended by the screen
 
+struct blitter;
+
+typedef struct {
+	//How display calls run, see run_display()
+	int priority; //SCHED_FIFO priority of the display thread, 0 to display on the calling thread
+	int cpu; //CPU the display thread is pinned to, or -1
+	int lock; //lock the stimuli, trace and framebuffer in RAM while displaying
+	int granted; //REALTIME_* flags for what the last display call got
+	uint16_t* locked_map; //the framebuffer mapping locked by run_display(), or NULL
+	size_t locked_map_size;
+} realtime_options;
+
 typedef struct {
 	int framebuffer;
 	uint16_t * map;
@@ -36,13 +114,98 @@ typedef struct {
 	unsigned int depth; //bits per pixel,
 	unsigned int header; //size of initial header in bytes,
 	unsigned int size; //size of buffer in bytes.
+	unsigned int virtual_width; //of the mapped virtual framebuffer: width and 2*height,
+	unsigned int virtual_height; //except while display_drift() has it enlarged
 	unsigned int orig_width;  //These three values store
 	unsigned int orig_height; //the screen settings so they
 	unsigned int orig_depth;  //can be reset at program termination.
-	int error;
+	int mailbox; //open /dev/vcio, for FLIP_MAILBOX
+	int flip_method; //FLIP_MAILBOX or FLIP_PAN
+	struct fb_var_screeninfo var; //screen settings, for FLIP_PAN
+	struct blitter* blit; //fastest way to copy a frame in, see choose_blitter()
+	long blit_usecs; //time blit took to copy one frame when chosen
+	int refresh_rate; //measured once by init()
+	int cancel_fd; //eventfd; writing to it ends a wait for a trigger, or a display
+	int displaying; //whether a display call is under way, see begin_display()
+	long display_token; //that call's, or 0
+	long cancelled_token; //one cancel_trigger() ended before its call began
+	int keyboard; //whether a key pressed at the terminal ends a wait for a trigger
+	realtime_options realtime;
+	struct backend* backend; //what the screen and pins actually are
+	void* backend_data; //the backend's own state
+	int error; //init() failed, or the framebuffer was lost since, see drift_restore()
 } fb_config;
 
 typedef struct {
+	//Settings for init() that only some backends use
+	int refresh_rate; //simulated vsyncs per second
+	char* framebuffer_file; //file to map the simulated framebuffer from, or NULL
+} backend_options;
+
+typedef struct backend {
+	/*Everything that touches the display hardware or GPIO goes
+	through one of these, so the display loops can run against the
+	Pi's framebuffer or a simulated one. open() sets up map and the
+	orig_* settings of an fb_config with width, height, depth and
+	size already filled in, returning nonzero with a Python error set
+	on failure. The pin functions take wiringPi's pin numbers and
+	values; read_pin() returns -1 if the backend can't read pins.
+	edge_fd() returns a descriptor that polls readable when the pin
+	goes high, or -1 if the backend can't provide one, and
+	edge_time() takes one edge from it, returning when it happened
+	in CLOCK_MONOTONIC nanoseconds, or -1 if there was none.
+	pan() shows the virtual framebuffer from (x, y), as flip() does
+	from (0, 0) or (0, height), and set_virtual() resizes and remaps
+	it, raising an error, returning nonzero, if it can't. It's called
+	without the GIL*/
+	const char* name;
+	int (*open)(fb_config* fb0, backend_options* options);
+	int (*close)(fb_config* fb0);
+	int (*flip)(fb_config* fb0, int buffer_num);
+	int (*wait_vsync)(fb_config* fb0);
+	int (*refresh_rate)(fb_config* fb0);
+	void (*pin_mode)(fb_config* fb0, int pin, int mode);
+	int (*read_pin)(fb_config* fb0, int pin);
+	void (*write_pin)(fb_config* fb0, int pin, int value);
+	int (*edge_fd)(fb_config* fb0, int pin);
+	int64_t (*edge_time)(fb_config* fb0, int fd);
+	int (*pan)(fb_config* fb0, int x, int y);
+	int (*set_virtual)(fb_config* fb0, int width, int height);
+} backend;
+
+#define SIM_PINS 64 //wiringPi pin numbers the simulated backend knows
+#define HARDWARE_PINS 32 //wiringPi pin numbers with a BCM GPIO line
+
+typedef struct {
+	//State of the hardware backend
+	int edge_fds[HARDWARE_PINS]; //GPIO line event descriptors, or -1
+} hardware_state;
+
+typedef struct {
+	//A scheduled high pulse on a simulated input pin
+	int pin;
+	struct timespec start;
+	struct timespec end;
+	int delivered; //its edge has been taken with sim_edge_time()
+} sim_pulse;
+
+typedef struct {
+	//State of the simulated backend
+	int refresh_rate;
+	struct timespec epoch; //time of the first simulated vsync
+	long vsyncs; //vsyncs waited for
+	int x_offset; //where in the virtual framebuffer the screen was last panned to
+	int y_offset;
+	int file; //descriptor of the file the framebuffer is mapped from, or -1
+	int pins[SIM_PINS]; //last value written to each pin
+	pthread_mutex_t lock; //guards pulses, which Python can add to at any time
+	sim_pulse* pulses;
+	int n_pulses;
+	int edge_timers[SIM_PINS]; //timerfds standing in for GPIO line events, or -1
+} sim_state;
+
+typedef struct {
+	//Header of a legacy FORMAT_FRAMES grating, followed by its frames
 	uint16_t frames_per_cycle;
 	uint16_t spacial_frequency;
 	uint16_t temporal_frequency;
@@ -51,14 +214,186 @@ typedef struct {
 }fileheader_t;
 
 typedef struct {
-	// Unecessarily large variable types so that all
-	// variables are 4 bytes long
-	long int width;
-	long int height;
-	long int refresh_per_frame;
-	long int n_frames;
+	//Header of a legacy raw file, followed by its frames. These were
+	//longs on the Pi, so are 4 bytes whatever the host
+	int32_t width;
+	int32_t height;
+	int32_t refresh_per_frame;
+	int32_t n_frames;
 } fileheader_raw;
 
+typedef struct {
+	/*Header of a versioned container, which FORMAT_FRAMES gratings
+	and converted raws are written as. It is followed, at index_offset,
+	by the uint64_t byte offset of each of the stored_frames frames,
+	which are multiples of alignment so each frame can be mapped,
+	prefetched or read with O_DIRECT on its own. A grating plays its
+	stored frames in a loop until n_frames have been shown, a raw
+	shows each for refresh_per_frame refreshes. Frames need only cover
+	the roi, the rest of the screen being the background pixel; headers
+	too short to have an roi are from files whose frames cover it all*/
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size; //bytes, for readers of later versions
+	uint32_t kind; //CONTAINER_GRATING or CONTAINER_RAW
+	uint32_t pixel_format; //PIXEL_RGB565
+	uint32_t width;
+	uint32_t height;
+	uint32_t alignment;
+	uint64_t n_frames;
+	uint64_t stored_frames;
+	uint64_t frame_size; //bytes in each frame, not counting padding
+	uint64_t index_offset;
+	uint32_t refresh_per_frame;
+	uint32_t frames_per_second; //a grating was built for, or 0
+	float spacial_frequency;
+	float temporal_frequency;
+	uint32_t roi_x; //the rectangle of the screen each frame covers
+	uint32_t roi_y;
+	uint32_t roi_width;
+	uint32_t roi_height;
+	uint32_t background; //RGB565 pixel outside the roi
+	uint32_t reserved;
+} fileheader_v2;
+
+typedef struct {
+	/*Header of a FORMAT_ROWSHIFT grating. It is followed by
+	n_tables tables of table_length pixels, each one period of the
+	grating at one envelope weight; the int64_t phase of the first
+	pixel of each row at frame 0; the int64_t phase added to every
+	row for each of the frames_per_cycle frames; and, if n_tables > 1,
+	a width*height map of which table each pixel is drawn from.
+	Phases are 16.16 fixed point table positions, and step is how
+	far the phase advances from one pixel to the next along a row*/
+	uint32_t magic;
+	uint32_t n_frames;
+	uint32_t frames_per_cycle;
+	uint32_t width;
+	uint32_t height;
+	uint32_t table_length;
+	uint32_t n_tables;
+	uint32_t reserved;
+	uint16_t frames_per_second;
+	uint16_t spacial_frequency;
+	uint16_t temporal_frequency;
+	uint16_t reserved2;
+	int64_t step;
+} fileheader_rowshift;
+
+typedef struct {
+	/*What happened to one frame of a display call. Times are
+	CLOCK_MONOTONIC nanoseconds. The layout is fixed so Python can
+	read a trace straight out of its buffer, see rpg.TRACE_FIELDS*/
+	int64_t start_ns; //began filling the back buffer
+	int64_t flip_ns; //asked for the buffers to be flipped
+	int64_t vsync_ns; //the last vsync waited for arrived
+	int64_t vsync_count; //refresh periods between the first frame's vsync and this one's
+	int32_t copy_us; //filling the back buffer took this long
+	int32_t flip_us; //the flip call took this long
+} frame_record;
+
+typedef struct {
+	//Summary of a display call's trace, in microseconds
+	float mean_interframe;
+	float std_interframe;
+	float mean_copy;
+	float max_copy;
+	float mean_flip;
+	float max_flip;
+	int missed_vsyncs; //refreshes a frame stayed on screen beyond its time
+	int64_t trigger_ns; //CLOCK_MONOTONIC time of the trigger's edge, or 0
+	float trigger_latency; //from the trigger's edge to the first flip
+} display_summary;
+
+typedef struct {
+	//The rectangle of the screen a stimulus's frames cover
+	int x;
+	int y;
+	int width;
+	int height;
+	uint16_t background; //pixel of the rest of the screen
+} screen_roi;
+
+typedef struct {
+	//A grating or raw file loaded by load_stimulus(), or a raw made by raw_from_buffer()
+	uint16_t* data; //the whole file, header first, or NULL if LOAD_BORROWED
+	size_t size; //in bytes, of the file or of the borrowed frames
+	int mode; //the LOAD_* flags it was loaded with
+	int n_frames; //frames played
+	int refresh_per_frame;
+	long stored_frames; //frames stored, played in a loop if fewer than n_frames
+	uint16_t** frames; //each stored frame, in data or in borrowed, or NULL for FORMAT_ROWSHIFT
+	screen_roi roi; //what each frame covers, the whole screen unless its container says otherwise
+	Py_buffer borrowed; //with LOAD_BORROWED, the buffer the frames are in
+} stimulus;
+
+typedef struct {
+	//Pointers into a loaded FORMAT_ROWSHIFT file
+	fileheader_rowshift* header;
+	uint16_t* tables;
+	int64_t* row_phase;
+	int64_t* frame_phase;
+	uint8_t* envelope; //NULL for full screen gratings
+	int repeat; //as phase_lut.repeat
+} rowshift_grating;
+
+typedef struct {
+	//Everything build_frame needs to render a frame,
+	//worked out once per grating in build_grating
+	double angle; //ANGLE_0 to ANGLE_270, or radians
+	double sine;
+	double cosine;
+	int wavelength; //pixels per cycle
+	int speed; //pixels per frame
+	int waveform;
+	double contrast;
+	int background;
+	int center_j;
+	int center_i;
+	int sigma;
+	int radius;
+	int padding;
+	int reach; //a mask or gabor is background beyond this point_radius, see grating_roi()
+	screen_roi roi; //outside which every frame is background
+	struct envelope_map* envelope; //NULL for full screen gratings
+	struct phase_lut* lut; //NULL unless rendering with KERNEL_LUT
+} grating_params;
+
+typedef struct envelope_map {
+	/*The weight of every pixel in a mask or gabor's roi, or -1 for
+	the background, worked out once by envelope_map_acquire() and
+	shared by every grating of the same geometry*/
+	int width; //of the screen
+	int height;
+	int center_j;
+	int center_i;
+	int sigma;
+	int radius;
+	int padding;
+	int reach;
+	screen_roi roi;
+	double* weights; //roi.width*roi.height of them, a row at a time
+	int users; //grating_params using it, guarded by envelope_cache_lock
+	struct envelope_map* next; //in envelope_cache, most recently used first
+} envelope_map;
+
+typedef struct phase_lut {
+	/*One period of the carrier, sampled LUT_SUBSTEPS times per
+	pixel, so that rendering a pixel is a phase lookup rather
+	than a call to sin()*/
+	int length; //entries in wave and packed
+	int64_t period; //length in 16.16 fixed point
+	int64_t step; //phase advance per pixel along a row, 16.16
+	double dy; //phase advance per row, in pixels
+	double bias; //0.5 to round phases to the nearest entry, 0 to truncate
+	double amplitude; //brightness of a full weight, full contrast carrier
+	double offset; //brightness the carrier is centred on
+	int repeat; //pixels after which every row repeats itself, 0 if never
+	double* wave; //unweighted carrier, see *_carrier()
+	uint16_t* packed; //full weight pixel values, plus one spare entry
+	uint16_t grey[256]; //rgb_to_uint(i,i,i)
+} phase_lut;
+
 uint16_t rgb_to_uint(int red, int green, int blue){
 	/*Convert an rgb value to a 16bit, RGB565
 	value*/
@@ -67,6 +402,30 @@ uint16_t rgb_to_uint(int red, int green, int blue){
 		 ((31*(blue +4))/255);
 }
 
+void raise_without_gil(PyObject* exception, const char* format, ...){
+	/*Sets a Python exception from code that may be running with
+	the GIL released, as building, loading and displaying do*/
+	va_list args;
+	va_start(args, format);
+	PyGILState_STATE gil = PyGILState_Ensure();
+	if(exception == PyExc_MemoryError){
+		PyErr_NoMemory();
+	}else{
+		PyErr_FormatV(exception, format, args);
+	}
+	PyGILState_Release(gil);
+	va_end(args);
+}
+
+void raise_errno_without_gil(const char* filename){
+	//As raise_without_gil(), an OSError for errno and filename
+	int error = errno;
+	PyGILState_STATE gil = PyGILState_Ensure();
+	errno = error;
+	PyErr_SetFromErrnoWithFilename(PyExc_OSError, filename);
+	PyGILState_Release(gil);
+}
+
 int gcd(int a, int b){
 	/*Helper function to get the greatest
 	common denominator of 2 ints*/
@@ -90,7 +449,7 @@ struct timespec get_current_time(int* status){
 	struct timespec t;
 	if(clock_gettime(CLOCK_REALTIME,&t)){
 		*status = -1;
-		PyErr_SetString(PyExc_OSError,"Failed realtime clock_gettime call");
+		raise_without_gil(PyExc_OSError, "Failed realtime clock_gettime call");
 	}else{
 		*status = 0;
 	}
@@ -123,8 +482,10 @@ int kbhit(void) {
 		is_init = true;
 	}
 
-	int bytesWaiting;
-	ioctl(STDIN, FIONREAD, &bytesWaiting);
+	int bytesWaiting = 0;
+	if (ioctl(STDIN, FIONREAD, &bytesWaiting) == -1) {
+		return 0; //not a terminal or pipe, so no keys to wait for
+	}
 	return bytesWaiting;
 }
 
@@ -147,6 +508,17 @@ float mean_long(long a[], int  n) {
 	return ((float) sum)/n;
 }
 
+long max_long(long a[], int n) {
+	int i;
+	long max = 0;
+	for (i = 0; i < n; i++) {
+		if (a[i] > max) {
+			max = a[i];
+		}
+	}
+	return max;
+}
+
 float std_long(long a[], int n) {
 	float mean = mean_long(a, n);
 	float error_sum = 0;
@@ -160,27 +532,63 @@ float std_long(long a[], int n) {
 }
 
 int get_refresh_rate(void) {
+	/*Measures the refresh rate of /dev/fb0 by timing vsyncs, or where
+	the driver can't wait for one, works it out from the display timings.
+	Raises OSError or ValueError, returning -1, if neither can be done.
+	Can be called with the GIL released*/
 	int fb = open("/dev/fb0",O_RDWR);
+	if (fb == -1) {
+		raise_errno_without_gil("/dev/fb0");
+		return -1;
+	}
 	int n_reps = 11;
-	struct timespec times[n_reps];
-	int clock_status;
+	//CLOCK_MONOTONIC, as the display traces, so a step of the wall clock can't spoil a measurement
+	int64_t times[n_reps];
+	struct timespec now;
 	__u32 dummy = 0;
 
 	int i;
 	for (i = 0; i < n_reps; i++) {
-		ioctl(fb, FBIO_WAITFORVSYNC, &dummy);
-		times[i] = get_current_time(&clock_status);
+		if (ioctl(fb, FBIO_WAITFORVSYNC, &dummy)) {
+			break;
+		}
+		if (clock_gettime(CLOCK_MONOTONIC, &now)) {
+			raise_without_gil(PyExc_OSError, "Failed monotonic clock_gettime call (%s)", strerror(errno));
+			close(fb);
+			return -1;
+		}
+		times[i] = now.tv_nsec + 1000000000*(int64_t)(now.tv_sec);
 	}
 
-	close(fb);
-
-	long delta_usecs[n_reps-1];
-	for (i = 0; i < n_reps-1; i++) {
-		delta_usecs[i] = cmp_times(times[i], times[i+1]);
+	if (i == n_reps) {
+		close(fb);
+		long delta_usecs[n_reps-1];
+		for (i = 0; i < n_reps-1; i++) {
+			delta_usecs[i] = (times[i+1] - times[i])/1000;
+		}
+		float mean_usecs = mean_long(delta_usecs, n_reps-1);
+		if (mean_usecs > 0) {
+			return int_round( 1/( mean_usecs/1000000 ) );
+		}
+		raise_without_gil(PyExc_ValueError, "Vsyncs on /dev/fb0 are not being timed, so its refresh rate can't be measured; give fps instead");
+		return -1;
 	}
 
-	int frame_rate = int_round( 1/( mean_long(delta_usecs, n_reps-1)/1000000 ) );
-	return frame_rate;
+	struct fb_var_screeninfo var;
+	if (ioctl(fb, FBIOGET_VSCREENINFO, &var)) {
+		raise_errno_without_gil("/dev/fb0");
+		close(fb);
+		return -1;
+	}
+	close(fb);
+	//pixclock is picoseconds per pixel, and each line and frame has margins and a sync
+	uint64_t line = (uint64_t)var.left_margin + var.xres + var.right_margin + var.hsync_len;
+	uint64_t frame = (uint64_t)var.upper_margin + var.yres + var.lower_margin + var.vsync_len;
+	if (var.pixclock == 0 || line == 0 || frame == 0) {
+		raise_without_gil(PyExc_ValueError, "/dev/fb0 can't wait for a vsync and reports no display timings, so its refresh rate can't be measured; give fps instead");
+		return -1;
+	}
+	return int_round(1e12/((double)var.pixclock*line*frame));
 }
 
 double gaussian(int radius, int sigma) {
@@ -193,14 +601,17 @@ employ the raspberry pi's mailbox property interface to facilitate
 communciation with the videocore. For more information, refer to
 github.com/raspberrypi/firmware/wiki/Mailbox-property-interface*/
 
-void flip_buffer(int buffer_num, fb_config fb0){
-	/* Flip the front- and back-buffers in the double-buffering
-	system */
+int hardware_pan(fb_config* fb0, int x, int y){
+	/* Show the virtual framebuffer from (x,y) */
 
-	int fd = open("/dev/vcio",O_RDWR|O_SYNC);
-	if(fd == -1){
-		perror("VCIO OPEN ERROR: ");
-		return 1;
+	if(fb0->flip_method == FLIP_PAN){
+		fb0->var.xoffset = x;
+		fb0->var.yoffset = y;
+		if(ioctl(fb0->framebuffer, FBIOPAN_DISPLAY, &fb0->var) == -1){
+			perror("BUFFER FLIP PAN ERROR");
+			return 1;
+		}
+		return 0;
 	}
 
 	volatile uint32_t property[32] __attribute__((aligned(16))) = 
@@ -215,24 +626,37 @@ void flip_buffer(int buffer_num, fb_config fb0){
 	0
 	};
 	property[0] = 8*sizeof(property[0]);
-	if(buffer_num != 0){
-		property[6] = fb0.height;
-	}
+	property[5] = x;
+	property[6] = y;
 	//send request via property interface using ioctl
 
-	if(ioctl(fd, _IOWR(100, 0, char *), property) == -1){
+	if(ioctl(fb0->mailbox, _IOWR(100, 0, char *), property) == -1){
 		perror("BUFFER FLIP IOCTL ERROR");
+		return 1;
 	}
-	close(fd);
+	return 0;
 }
 
+int hardware_flip(fb_config* fb0, int buffer_num){
+	/* Flip the front- and back-buffers in the double-buffering
+	system */
+	return hardware_pan(fb0, 0, buffer_num != 0 ? fb0->height : 0);
+}
 
-uint16_t squarewave(int x, int y, int t, int wavelength, int speed, double angle, double cosine, double sine, double weight, double contrast, int background){
-	//Returns a (x,y) pixel's brightness for a squarewave
-	unsigned short black = 0;
-	unsigned short white = 255;
-	double brightness;
-	double x_prime, int_part, frac_part;
+
+int flip_buffer(int buffer_num, fb_config fb0){
+	return fb0.backend->flip(&fb0, buffer_num);
+}
+
+int wait_vsync(fb_config fb0){
+	return fb0.backend->wait_vsync(&fb0);
+}
+
+
+double grating_phase(int x, int y, int t, int speed, double angle, double cosine, double sine){
+	//Returns the distance of pixel (x,y) along the direction
+	//of propagation at frame t, in pixels
+	double x_prime;
 	if(angle == ANGLE_0){
 		x_prime = -x + speed*t;
 	}else if(angle == ANGLE_90){
@@ -244,6 +668,17 @@ uint16_t squarewave(int x, int y, int t, int wavelength, int speed, double angle
 	}else{
 		x_prime = (cosine*x + sine*y) + speed*t;
 	}
+	return x_prime;
+}
+
+
+double squarewave_carrier(double x_prime, int wavelength){
+	//Returns the unweighted brightness offset from mid-grey of a
+	//squarewave at x_prime, -128 (white) or 127 (black)
+	unsigned short black = 0;
+	unsigned short white = 255;
+	double brightness;
+	double int_part, frac_part;
 	frac_part = modf(x_prime,&int_part);
 	brightness = ( ((double) ((((int)(int_part))%wavelength + wavelength)%wavelength)+frac_part) / wavelength);
 	if(brightness < 0.5){
@@ -251,61 +686,58 @@ uint16_t squarewave(int x, int y, int t, int wavelength, int speed, double angle
 	} else {
 		brightness = black;
 	}
-	brightness = contrast * weight * (127 - brightness) + 127;
+	return 127 - brightness;
+}
 
-	return rgb_to_uint(brightness, brightness, brightness);
+double sinewave_carrier(double x_prime, int wavelength){
+	return sin(2*M_PI*(x_prime)/wavelength);
 }
 
 
+uint16_t squarewave_at(double x_prime, int wavelength, double weight, double contrast, int background){
+	double brightness = contrast * weight * squarewave_carrier(x_prime, wavelength) + 127;
+	return rgb_to_uint(brightness, brightness, brightness);
+}
 
-uint16_t sinewave(int x, int y, int t, int wavelength, int speed, double angle, double cosine, double sine, double weight, double contrast, int background){
-	//Returns a (x,y) pixel's brightness for a sine wave
-	double brightness;
-	double x_prime;
-	if(angle == ANGLE_0){
-		x_prime = -x + speed*t;
-	}else if(angle == ANGLE_90){
-		x_prime = y + speed*t;
-	}else if(angle==ANGLE_180){
-		x_prime = x + speed*t;
-	}else if(angle==ANGLE_270){
-		x_prime = -y + speed*t;
-	}else{
-		x_prime = (cosine*x + sine*y)+(speed*t);
+uint16_t sinewave_at(double x_prime, int wavelength, double weight, double contrast, int background){
+	double brightness = contrast * weight * 127 * sinewave_carrier(x_prime, wavelength) + 127;
+	return rgb_to_uint(brightness,brightness,brightness);
+}
+
+uint16_t gabor_at(double x_prime, int wavelength, double weight, double contrast, int background){
+	double brightness, amplitude;
+	if (background < 128) {
+	  amplitude = contrast * weight * background;
+	} else {
+	  amplitude = contrast * weight * (255 - background);
 	}
+	brightness = amplitude * sinewave_carrier(x_prime, wavelength) + background;
+	return rgb_to_uint(brightness,brightness,brightness);
+}
 
-	brightness = contrast * weight * 127 * sin(2*M_PI*(x_prime)/wavelength) + 127;
 
-	return rgb_to_uint(brightness,brightness,brightness);
+uint16_t squarewave(int x, int y, int t, int wavelength, int speed, double angle, double cosine, double sine, double weight, double contrast, int background){
+	//Returns a (x,y) pixel's brightness for a squarewave
+	double x_prime = grating_phase(x, y, t, speed, angle, cosine, sine);
+	return squarewave_at(x_prime, wavelength, weight, contrast, background);
+}
+
+uint16_t sinewave(int x, int y, int t, int wavelength, int speed, double angle, double cosine, double sine, double weight, double contrast, int background){
+	//Returns a (x,y) pixel's brightness for a sine wave
+	double x_prime = grating_phase(x, y, t, speed, angle, cosine, sine);
+	return sinewave_at(x_prime, wavelength, weight, contrast, background);
 }
 
 uint16_t gabor(int x, int y, int t, int wavelength, int speed, double angle, double cosine, double sine, double weight, double contrast, int background) {
         //Returns a (x,y) pixel's brightness for a gabor patch
-        double brightness, x_prime, amplitude;
-
-
-        if(angle == ANGLE_0){
-                x_prime = -x + speed*t;
-        }else if(angle == ANGLE_90){
-                x_prime = y + speed*t;
-        }else if(angle==ANGLE_180){
-                x_prime = x + speed*t;
-        }else if(angle==ANGLE_270){
-                x_prime = -y + speed*t;
-        }else{
-                x_prime = (cosine*x + sine*y)+(speed*t);
-        }
-        if (background < 128) {
-          amplitude = contrast * weight * background;
-        } else {
-          amplitude = contrast * weight * (255 - background);
-        }
-        brightness = amplitude * sin(2*M_PI*(x_prime)/wavelength) + background;
-        return rgb_to_uint(brightness,brightness,brightness);
+	double x_prime = grating_phase(x, y, t, speed, angle, cosine, sine);
+	return gabor_at(x_prime, wavelength, weight, contrast, background);
 }
 
 
-uint16_t * build_frame(int t, double angle, fb_config framebuffer, int wavelength, int speed, int waveform, double contrast, int background, int center_j, int center_i, int sigma, int radius, int padding){
+void set_grating_angle(grating_params* params, double angle){
+	/*Cardinal angles are flagged so the waveform functions can
+	skip the rotation, all others are converted to radians*/
 	angle = ((int)(angle)%360 + 360)%360;
 	if(angle==0){
 		angle = ANGLE_0;
@@ -322,379 +754,3149 @@ uint16_t * build_frame(int t, double angle, fb_config framebuffer, int wavelengt
 	else{
 		angle = (180-angle)*M_PI/180;
 	}
-	double sine = sin(angle);
-	double cosine = cos(angle);
-	uint16_t * array_start;
-	array_start = malloc(framebuffer.size);
-	uint16_t* write_location = array_start;
-	int i,j;
-	for(i=0;i<framebuffer.height;i++){ //for each row of pixels
-		for(j=0;j<framebuffer.width;j++){ //for each column of pixels
-			//set each pixel's brightness
-			if( radius == 0 && sigma == 0) { //if we have no radius or sigma and are doing fullscreen
-				if(waveform==SQUARE){
-					*write_location = squarewave(j,i,t,wavelength,speed,angle,cosine,sine, 1, contrast, background);
-				}else if(waveform==SINE){
-					*write_location = sinewave(j,i,t,wavelength,speed,angle,cosine,sine, 1, contrast, background);
-				}
-			} else if (sigma == 0) { //if sigma == 0 then we're doing a circle  and hence aren't doing full screen
-	                        int point_radius = (int) sqrt( ((j-center_j) * (j-center_j)) + ((i-center_i) * (i-center_i)) );
-				if( point_radius > radius + padding) { //if we are outside the circular mask
-					*write_location = rgb_to_uint(background,background,background);
-				}else if( point_radius <= radius) { //if we are inside the central radius
-					if(waveform==SQUARE) {
-						*write_location = squarewave(j,i,t,wavelength,speed,angle,cosine,sine, 1, contrast, background);
-					}else if(waveform==SINE) {
-						*write_location = sinewave(j,i,t,wavelength,speed,angle,cosine,sine, 1, contrast, background);
-					}
-				} else { //we must be in the padding region
-					double weight = (radius + padding - point_radius) / padding;
-					if(waveform==SQUARE) {
-						*write_location = squarewave(j,i,t,wavelength,speed,angle,cosine,sine, weight, contrast, background);
-					}else if (waveform==SINE){
-						*write_location = sinewave(j,i,t,wavelength,speed,angle,cosine,sine, weight, contrast, background);
-					}
-				}
-			} else { //we must be doing a gabor
-                                int point_radius = (int) sqrt( ((j-center_j) * (j-center_j)) + ((i-center_i) * (i-center_i)) );
-				double weight = gaussian(point_radius, sigma);
-	                        //you can't do a squarewave gabor. I do not permit such abominations.
-        	                *write_location = gabor(j,i,t,wavelength,speed,angle,cosine,sine, weight, contrast, background);
-			}
-			write_location++;
-		}
-	}
-	//and return a pointer to this pixel data
-	return array_start;
+	params->angle = angle;
+	params->sine = sin(angle);
+	params->cosine = cos(angle);
 }
 
 
-int build_grating(char * filename, double duration, double angle, double sf, double tf, double contrast, int background, int width, int height, int waveform, double percent_sigma, double percent_diameter, double percent_center_left, double percent_center_top, double percent_padding){
-	int fps = get_refresh_rate();
-        printf("Refresh rate measured as: %d hz\n", fps);
-	fb_config fb0;
-	fb0.width = width;
-	fb0.height = height;
-	fb0.depth = 16;
-	fb0.size = (fb0.height)*(fb0.depth)*(fb0.width)/8;
-	FILE * file = fopen(filename, "wb");
-	if(file == NULL){
-		perror("File creation failed\n");
-		PyErr_SetString(PyExc_OSError,"File creation failed.");
-		return 1;
+phase_lut* phase_lut_create(grating_params* p){
+	/*Sample one period of p's waveform. Cardinal angles only
+	ever land on whole pixels, which are table entries, so
+	they come out exactly as KERNEL_EXACT renders them; other
+	angles are rounded to the nearest 1/LUT_SUBSTEPS of a pixel*/
+	phase_lut* lut = malloc(sizeof(phase_lut));
+	if(lut == NULL){
+		return NULL;
 	}
-	int wavelength = (fb0.width/DEGREES_SUBTENDED)/sf;
-
-	int speed = wavelength*tf/fps;
-	if(speed==0){
-		speed = 1;
+	lut->length = p->wavelength * LUT_SUBSTEPS;
+	lut->period = (int64_t)(lut->length) << 16;
+	lut->wave = malloc(lut->length*sizeof(double));
+	//the spare entry lets the vector kernels read 32 bits at the last entry
+	lut->packed = calloc(lut->length + 1, sizeof(uint16_t));
+	if(lut->wave == NULL || lut->packed == NULL){
+		free(lut->wave);
+		free(lut->packed);
+		free(lut);
+		return NULL;
 	}
-	double actual_tf = ((double)(speed*fps)) / wavelength;
-	int sigma = fb0.width * percent_sigma / 100;
-	int radius = fb0.width * percent_diameter / 200;
-	int center_j = fb0.width * percent_center_left / 100;
-	int center_i = fb0.height * percent_center_top / 100;
-	double padding = radius * percent_padding / 100;
-	if(actual_tf!=tf){
-		printf("Grating %s has a requested temporal frequency of %f, actual temporal frequency will be %f\n",filename,tf,actual_tf);
+	double dx;
+	if(p->angle == ANGLE_0){
+		dx = -1;
+		lut->dy = 0;
+	}else if(p->angle == ANGLE_90){
+		dx = 0;
+		lut->dy = 1;
+	}else if(p->angle == ANGLE_180){
+		dx = 1;
+		lut->dy = 0;
+	}else if(p->angle == ANGLE_270){
+		dx = 0;
+		lut->dy = -1;
+	}else{
+		dx = p->cosine;
+		lut->dy = p->sine;
 	}
-	//Calculate the minimum number of frames required for a full cycle
-	//(worst case is just FPS*DURATION) and write it, tf, and sf in a header.
-	fileheader_t header;
-	header.frames_per_second = fps;
-	header.frames_per_cycle = wavelength / gcd(wavelength,speed);
-	if(header.frames_per_cycle > fps * duration) {
-		header.frames_per_cycle = fps * duration;
-	}
-	header.n_frames = fps * duration;
-	header.spacial_frequency = (uint16_t)(sf);
-	header.temporal_frequency = (uint16_t)(tf);
-	fwrite(&header,sizeof(fileheader_t),1,file);
-	int t, clock_status;
-	struct timespec time1, time2;
-	time1 = get_current_time(&clock_status);
-	if(clock_status){
-		return -1;
+	lut->step = llround(dx*LUT_SUBSTEPS*65536) % lut->period;
+	if(lut->step < 0){
+		lut->step += lut->period;
 	}
-	for (t=0;t<header.frames_per_cycle;t++){
-		uint16_t* frame = build_frame(t,angle,fb0,wavelength, speed, waveform, contrast, background, center_j, center_i, sigma, radius, padding);
-		fwrite(frame,sizeof(uint16_t),fb0.height*fb0.width,file);
-		free(frame);
-		if(t==4){
-			time2 = get_current_time(&clock_status);
-			if(clock_status){
-				return -1;
-			}
-			printf("Expected time to completion: %ld seconds\n",header.frames_per_cycle*cmp_times(time1,time2)/1000000/5);
-		}
+	lut->repeat = 0;
+	if(lut->step == 0){
+		lut->repeat = 1;
+	}else if((lut->step*p->wavelength) % lut->period == 0){
+		lut->repeat = p->wavelength;
 	}
-	fclose(file);
-	return 0;
-}
-
-uint16_t* load_grating(char* filename, fb_config fb0){
-	int page_size = getpagesize();
-	int bytes_already_read = 0;
-	int read_size,frames;
 
-	int filedes = open(filename, O_RDWR);
-	if(filedes == -1){
-		perror("Failed to open file");
-		return NULL;
+	if(p->sigma != 0){
+		lut->amplitude = p->background < 128 ? p->background : 255 - p->background;
+		lut->offset = p->background;
+	}else if(p->waveform == SQUARE){
+		lut->amplitude = 1;
+		lut->offset = 127;
+	}else{
+		lut->amplitude = 127;
+		lut->offset = 127;
 	}
-	//Start by aquiring the header so we can determine the filesize...
-	uint16_t* header = mmap(NULL,6,PROT_READ,MAP_PRIVATE,
-					filedes,0);
-	if(header==MAP_FAILED){
-		perror("From mmap for header access");
-		exit(1);
+	//The squarewave steps exactly on table entries, so truncate onto them
+	lut->bias = (p->waveform == SQUARE && p->sigma == 0) ? 0 : 0.5;
+
+	int k;
+	for(k = 0; k < lut->length; k++){
+		double x_prime = (double)(k) / LUT_SUBSTEPS;
+		if(p->sigma != 0){
+			lut->wave[k] = sinewave_carrier(x_prime, p->wavelength);
+			lut->packed[k] = gabor_at(x_prime, p->wavelength, 1, p->contrast, p->background);
+		}else if(p->waveform == SQUARE){
+			lut->wave[k] = squarewave_carrier(x_prime, p->wavelength);
+			lut->packed[k] = squarewave_at(x_prime, p->wavelength, 1, p->contrast, p->background);
+		}else{
+			lut->wave[k] = sinewave_carrier(x_prime, p->wavelength);
+			lut->packed[k] = sinewave_at(x_prime, p->wavelength, 1, p->contrast, p->background);
+		}
 	}
-	frames = header[0];
-	int file_fps = header[3];
-	int refresh_rate = get_refresh_rate();
-	if (refresh_rate != file_fps) {
-		printf("File generated at %d FPS, but monitor running at %d HZ. This will cause inaccurate timing \n", file_fps, refresh_rate);
-	}
-	int file_size = frames*fb0.size + sizeof(fileheader_t);
-	//clean up the header from the heap
-	munmap(header, 6);
-	//now copy file_size bytes across using mmap
-	uint16_t *frame_data = malloc(file_size);
-	while(bytes_already_read < file_size){
-		read_size = 20000*page_size;
-		if(read_size + bytes_already_read >= file_size){
-			read_size = file_size - bytes_already_read;
-		}
-		uint16_t *mmap_start = mmap(NULL, read_size,PROT_READ,MAP_PRIVATE,
-						filedes,bytes_already_read);
-		if(mmap_start == MAP_FAILED){
-			perror("From MMAP attempt to read");
-			exit(1);
-		}
-		//Copy read_size bytes across
-		memcpy(frame_data+(bytes_already_read/2),mmap_start,read_size);
-		bytes_already_read += read_size;
-		munmap(mmap_start,read_size);
+	for(k = 0; k < 256; k++){
+		lut->grey[k] = rgb_to_uint(k, k, k);
 	}
-	close(filedes);
-	return frame_data;
+	return lut;
 }
 
-
-uint16_t* load_raw(char* filename) {
-	int page_size = getpagesize();
-	int bytes_already_read = 0;
-	int read_size;
-	int fh = open(filename, O_RDWR);
-	if(fh == -1) {
-		perror("Failed to open file");
-		return NULL;
-	}
-	off_t len = lseek(fh, 0, SEEK_END);
-	if (len == -1) {
-		printf("Checking File Length Failed.\n");
-		return NULL;
+void phase_lut_destroy(phase_lut* lut){
+	if(lut == NULL){
+		return;
 	}
+	free(lut->wave);
+	free(lut->packed);
+	free(lut);
+}
 
-	uint16_t *frame_data = malloc(len);
-	while(bytes_already_read < len) {
-		read_size = 20000*page_size;
-		if(read_size + bytes_already_read >= len) {
-			read_size = len - bytes_already_read;
-		}
-		uint16_t *mmap_start = mmap(NULL, read_size, PROT_READ,
-					    MAP_PRIVATE, fh, bytes_already_read);
-		if(mmap_start == MAP_FAILED) {
-			perror("MMAP failed to read");
-			return NULL;
-		}
-		memcpy(frame_data+(bytes_already_read/2),mmap_start,read_size);
-		bytes_already_read += read_size;
-		munmap(mmap_start,read_size);
+int64_t phase_lut_row_start(phase_lut* lut, grating_params* p, int row, int t){
+	//16.16 table position of the first pixel of a row
+	double x_prime = lut->dy*row + p->speed*t;
+	int64_t phase = (int64_t)floor((x_prime*LUT_SUBSTEPS + lut->bias)*65536) % lut->period;
+	if(phase < 0){
+		phase += lut->period;
 	}
-	close(fh);
-	return frame_data;
+	return phase;
 }
 
-int convert_raw(char* filename, char* new_filename, int n_frames, int width, int height, int refresh_per_frame) {
-
-	int fh = open(filename, O_RDWR);
-	if (fh == -1) {
-		perror("Failed to open file");
-		return 1;
+uint16_t phase_lut_weighted(phase_lut* lut, double contrast, int k, double weight){
+	//Same arithmetic as the *_at() functions, minus the sin()
+	double brightness = contrast * weight * lut->amplitude * lut->wave[k] + lut->offset;
+	int level = brightness;
+	if(level >= 0 && level < 256){
+		return lut->grey[level];
 	}
+	return rgb_to_uint(brightness, brightness, brightness);
+}
 
-	FILE * new_file = fopen(new_filename, "wb");
-	if (new_file == NULL) {
-		perror("Failed to open new file");
-		return 1;
-	}
 
-	fileheader_raw header;
-	header.n_frames = n_frames;
-	header.width = width;
-	header.height = height;
-	header.refresh_per_frame = refresh_per_frame;
-	fwrite(&header, sizeof(fileheader_raw),1,new_file);
+/*Row kernels for the lookup table renderers. Each comes in a plain C
+version and, where the instruction set helps, vector versions, which
+produce exactly the same pixels. One set is picked at import time by
+select_pixel_kernels() according to what the CPU supports.
 
-	off_t len = lseek(fh, 0, SEEK_END);
-	if (len == -1) {
-		printf("Checking File Length Failed.\n");
-		return 1;
-	}
-	char *buffer = mmap(0, len, PROT_READ, MAP_PRIVATE, fh, 0);
+  lut_row: n pixels of table, starting at 16.16 phase and advancing
+      by step each pixel, wrapping at period.
+  lut_row_envelope: as lut_row, but pixel j is read from table
+      envelope[j] of a set of table_length long tables.
+  weighted_row: n pixels of lut's carrier at the given weights, as
+      phase_lut_weighted(), or background where the weight is < 0.
+  pack_rgb888: n RGB888 pixels (3 bytes each) to RGB565, as
+      rgb_to_uint(), for convert_raw().
 
-	if (buffer == MAP_FAILED){
-		PyErr_SetString(PyExc_OSError,"MMAP failed");
-		return 1;
-	}
-	int i = 0;
-	char r, g, b;
-	uint16_t new_byte;
-	while (i < len) {
-		r = buffer[i];
-		g = buffer[i+1];
-		b = buffer[i+2];
-		i += 3;
-		new_byte = rgb_to_uint(r,g,b);
-               // printf("red = %i \t green = %i \t  blue = %i \t  byte = %i \n", r,g,b, new_byte);
-
-		fwrite(&new_byte,sizeof(uint16_t), 1, new_file);
-	}
-	munmap(buffer, len);
-	fclose(new_file);
-	close(fh);
-	return 0;
-}
+The vector versions keep phases in 32 bit lanes, so fall back to the
+plain versions for tables over 32768 entries (512 pixel wavelengths).
+Tables must have one readable entry after their end.*/
 
-double* display_raw(uint16_t *frame_data, fb_config fb0, int trig_pin) {
+typedef struct {
+	const char* name;
+	void (*lut_row)(uint16_t* out, const uint16_t* table, int64_t phase, int64_t step, int64_t period, int n);
+	void (*lut_row_envelope)(uint16_t* out, const uint16_t* tables, int table_length, const uint8_t* envelope, int64_t phase, int64_t step, int64_t period, int n);
+	void (*weighted_row)(uint16_t* out, phase_lut* lut, double contrast, int64_t phase, const double* weights, uint16_t background, int n);
+	void (*pack_rgb888)(uint16_t* out, const uint8_t* rgb, size_t n);
+} pixel_kernels;
 
-	pinMode(1, OUTPUT);
-	digitalWrite(1, LOW);
-	if (trig_pin > 0) {
-		pinMode(trig_pin, INPUT);
-		while (digitalRead(trig_pin) == 0) {
-			if (kbhit()) {
-				return 0;
-			}
+void lut_row_scalar(uint16_t* out, const uint16_t* table, int64_t phase, int64_t step, int64_t period, int n){
+	int j;
+	for(j = 0; j < n; j++){
+		out[j] = table[phase >> 16];
+		phase += step;
+		if(phase >= period){
+			phase -= period;
 		}
 	}
-	fileheader_raw* header = frame_data;
-	frame_data += sizeof(fileheader_raw)/sizeof(float);
-
-	uint16_t *write_loc;
-	int t, buffer, pixel, clock_status, waits;
-	write_loc = fb0.map + fb0.size/2;
-	float *frame_duration_mean = malloc(2*sizeof(float));
-	float *frame_duration_std = frame_duration_mean+1;
-	struct timespec frame_start, frame_end;
-	__u32 dummy = 0;
+}
 
-	int n_frames = header -> n_frames;
-	int refresh_per_frame = header -> refresh_per_frame;
-        long timings[n_frames-1];
-	for (t = 0; t < n_frames; t++) {
-		frame_end = frame_start;
-		frame_start = get_current_time(&clock_status);
-		if(clock_status) {
-			return NULL;
+void lut_row_envelope_scalar(uint16_t* out, const uint16_t* tables, int table_length, const uint8_t* envelope, int64_t phase, int64_t step, int64_t period, int n){
+	int j;
+	for(j = 0; j < n; j++){
+		out[j] = tables[envelope[j]*table_length + (phase >> 16)];
+		phase += step;
+		if(phase >= period){
+			phase -= period;
 		}
+	}
+}
 
-		buffer = (t+1)%2;
-		for(pixel = 0; pixel < fb0.size/2; pixel++) {
-			*write_loc = frame_data[(t*fb0.size/2)+pixel];
-			write_loc++;
+void weighted_row_scalar(uint16_t* out, phase_lut* lut, double contrast, int64_t phase, const double* weights, uint16_t background, int n){
+	int j;
+	for(j = 0; j < n; j++){
+		int k = phase >> 16;
+		if(weights[j] < 0){
+			out[j] = background;
+		}else if(weights[j] == 1){
+			//packed holds exactly this
+			out[j] = lut->packed[k];
+		}else{
+			out[j] = phase_lut_weighted(lut, contrast, k, weights[j]);
 		}
-		flip_buffer(buffer, fb0);
-		for (waits = 0; waits < refresh_per_frame; waits++) {
-			ioctl(fb0.framebuffer, FBIO_WAITFORVSYNC, &dummy);
-		}
-		if (t != 0) {
-			timings[t-1] = cmp_times(frame_end, frame_start);
-		}
-		if(!buffer) {
-			write_loc = fb0.map + fb0.size/2;
-			digitalWrite(1, HIGH);
-		} else {
-			write_loc = fb0.map;
-			digitalWrite(1, LOW);
+		phase += lut->step;
+		if(phase >= lut->period){
+			phase -= lut->period;
 		}
 	}
-	*frame_duration_mean = mean_long(timings, n_frames-1);
-	*frame_duration_std = std_long(timings, n_frames-1);
-	return frame_duration_mean;
 }
 
-double* display_grating(uint16_t* frame_data, fb_config fb0, int trig_pin){
+void pack_rgb888_scalar(uint16_t* out, const uint8_t* rgb, size_t n){
+	size_t j;
+	for(j = 0; j < n; j++){
+		out[j] = rgb_to_uint(rgb[3*j], rgb[3*j+1], rgb[3*j+2]);
+	}
+}
 
-	pinMode(1, OUTPUT);
-	digitalWrite(1, LOW);
-	if (trig_pin > 0) {
-		pinMode(trig_pin, INPUT);
-		while (digitalRead(trig_pin) == 0) {
-			if (kbhit()) {
-				return 0;
-			}
+void lane_phases(uint32_t* lanes, int n_lanes, int64_t phase, int64_t step, int64_t period){
+	//Phases of n_lanes consecutive pixels, for loading into a vector
+	int i;
+	for(i = 0; i < n_lanes; i++){
+		lanes[i] = phase;
+		phase += step;
+		if(phase >= period){
+			phase -= period;
 		}
 	}
+}
 
-	fileheader_t* header = frame_data;
-	frame_data += sizeof(fileheader_t)/sizeof(uint16_t);
+bool lanes_fit(int64_t period){
+	return period < ((int64_t)(1) << 31);
+}
 
-	uint16_t *write_loc;
-	int t, buffer, pixel, frame, clock_status;
-	write_loc = fb0.map + fb0.size/2;
-	float* frame_duration_mean = malloc(2*sizeof(float));
-	float* frame_duration_std = frame_duration_mean+1;
-	struct timespec frame_start, frame_end;
-	__u32 dummy = 0;
 
-	int n_frames = header->n_frames;
-	long timings[n_frames-1];
-	for (t=0; t < n_frames; t++){
-                frame_end = frame_start;
-                frame_start = get_current_time(&clock_status);
-		if(clock_status) {
-			return NULL;
-		}
+#ifdef RPG_X86
 
-		frame = t%(header->frames_per_cycle);
-		buffer = (t+1)%2;
-		for(pixel = 0; pixel<fb0.size/2; pixel++){
-			*write_loc = frame_data[(frame*fb0.size/2)+pixel];
-			write_loc++;
+__attribute__((target("sse2")))
+void weighted_row_sse2(uint16_t* out, phase_lut* lut, double contrast, int64_t phase, const double* weights, uint16_t background, int n){
+	//Two pixels of brightness arithmetic at a time
+	__m128d c = _mm_set1_pd(contrast);
+	__m128d a = _mm_set1_pd(lut->amplitude);
+	__m128d o = _mm_set1_pd(lut->offset);
+	int j, i;
+	for(j = 0; j + 2 <= n; j += 2){
+		int k[2];
+		for(i = 0; i < 2; i++){
+			k[i] = phase >> 16;
+			phase += lut->step;
+			if(phase >= lut->period){
+				phase -= lut->period;
+			}
 		}
-
-		flip_buffer(buffer, fb0);
-		ioctl(fb0.framebuffer, FBIO_WAITFORVSYNC, &dummy);
-
-		if (t != 0) {
-			timings[t-1] = cmp_times(frame_end, frame_start);
+		__m128d wave = _mm_set_pd(lut->wave[k[1]], lut->wave[k[0]]);
+		__m128d brightness = _mm_add_pd(_mm_mul_pd(_mm_mul_pd(_mm_mul_pd(c, _mm_loadu_pd(weights + j)), a), wave), o);
+		__m128i levels = _mm_cvttpd_epi32(brightness);
+		int level[2] = {_mm_cvtsi128_si32(levels), _mm_cvtsi128_si32(_mm_srli_si128(levels, 4))};
+		for(i = 0; i < 2; i++){
+			if(weights[j+i] < 0){
+				out[j+i] = background;
+			}else if(level[i] >= 0 && level[i] < 256){
+				out[j+i] = lut->grey[level[i]];
+			}else{
+				out[j+i] = phase_lut_weighted(lut, contrast, k[i], weights[j+i]);
+			}
 		}
+	}
+	weighted_row_scalar(out + j, lut, contrast, phase, weights + j, background, n - j);
+}
+
+__attribute__((target("avx2")))
+void lut_row_avx2(uint16_t* out, const uint16_t* table, int64_t phase, int64_t step, int64_t period, int n){
+	//Eight pixels at a time, gathering 32 bits per pixel and keeping the low 16
+	if(!lanes_fit(period)){
+		lut_row_scalar(out, table, phase, step, period, n);
+		return;
+	}
+	uint32_t lanes[8];
+	lane_phases(lanes, 8, phase, step, period);
+	__m256i phases = _mm256_loadu_si256((__m256i*)lanes);
+	__m256i step8 = _mm256_set1_epi32((step*8) % period);
+	__m256i period8 = _mm256_set1_epi32(period);
+	__m256i low = _mm256_set1_epi32(0xFFFF);
+	int j;
+	for(j = 0; j + 8 <= n; j += 8){
+		__m256i k = _mm256_srli_epi32(phases, 16);
+		__m256i pixels = _mm256_and_si256(_mm256_i32gather_epi32((const int*)table, k, 2), low);
+		_mm_storeu_si128((__m128i*)(out + j), _mm_packus_epi32(_mm256_castsi256_si128(pixels), _mm256_extracti128_si256(pixels, 1)));
+		phases = _mm256_add_epi32(phases, step8);
+		phases = _mm256_min_epu32(phases, _mm256_sub_epi32(phases, period8));
+	}
+	lut_row_scalar(out + j, table, (uint32_t)(_mm256_extract_epi32(phases, 0)), step, period, n - j);
+}
+
+__attribute__((target("avx2")))
+void lut_row_envelope_avx2(uint16_t* out, const uint16_t* tables, int table_length, const uint8_t* envelope, int64_t phase, int64_t step, int64_t period, int n){
+	if(!lanes_fit(period)){
+		lut_row_envelope_scalar(out, tables, table_length, envelope, phase, step, period, n);
+		return;
+	}
+	uint32_t lanes[8];
+	lane_phases(lanes, 8, phase, step, period);
+	__m256i phases = _mm256_loadu_si256((__m256i*)lanes);
+	__m256i step8 = _mm256_set1_epi32((step*8) % period);
+	__m256i period8 = _mm256_set1_epi32(period);
+	__m256i length = _mm256_set1_epi32(table_length);
+	__m256i low = _mm256_set1_epi32(0xFFFF);
+	int j;
+	for(j = 0; j + 8 <= n; j += 8){
+		__m256i table = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)(envelope + j)));
+		__m256i k = _mm256_add_epi32(_mm256_mullo_epi32(table, length), _mm256_srli_epi32(phases, 16));
+		__m256i pixels = _mm256_and_si256(_mm256_i32gather_epi32((const int*)tables, k, 2), low);
+		_mm_storeu_si128((__m128i*)(out + j), _mm_packus_epi32(_mm256_castsi256_si128(pixels), _mm256_extracti128_si256(pixels, 1)));
+		phases = _mm256_add_epi32(phases, step8);
+		phases = _mm256_min_epu32(phases, _mm256_sub_epi32(phases, period8));
+	}
+	lut_row_envelope_scalar(out + j, tables, table_length, envelope + j, (uint32_t)(_mm256_extract_epi32(phases, 0)), step, period, n - j);
+}
+
+__attribute__((target("avx2")))
+void weighted_row_avx2(uint16_t* out, phase_lut* lut, double contrast, int64_t phase, const double* weights, uint16_t background, int n){
+	/*Four pixels at a time. The grey levels are packed to RGB565
+	with rgb_to_uint()'s arithmetic, dividing by 255 exactly as
+	(x*0x8081)>>23, which holds for every x below 65536*/
+	if(!lanes_fit(lut->period)){
+		weighted_row_scalar(out, lut, contrast, phase, weights, background, n);
+		return;
+	}
+	uint32_t lanes[4];
+	lane_phases(lanes, 4, phase, lut->step, lut->period);
+	__m128i phases = _mm_loadu_si128((__m128i*)lanes);
+	__m128i step4 = _mm_set1_epi32((lut->step*4) % lut->period);
+	__m128i period4 = _mm_set1_epi32(lut->period);
+	__m256d c = _mm256_set1_pd(contrast);
+	__m256d a = _mm256_set1_pd(lut->amplitude);
+	__m256d o = _mm256_set1_pd(lut->offset);
+	__m256i narrow = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+	__m128i reciprocal = _mm_set1_epi32(0x8081);
+	int j, i;
+	for(j = 0; j + 4 <= n; j += 4){
+		__m128i k = _mm_srli_epi32(phases, 16);
+		__m256d w = _mm256_loadu_pd(weights + j);
+		__m256d brightness = _mm256_add_pd(_mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(c, w), a), _mm256_i32gather_pd(lut->wave, k, 8)), o);
+		__m128i level = _mm256_cvttpd_epi32(brightness);
+		__m128i outside = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(
+					_mm256_castpd_si256(_mm256_cmp_pd(w, _mm256_setzero_pd(), _CMP_LT_OQ)), narrow));
+		__m128i out_of_range = _mm_andnot_si128(outside, _mm_or_si128(
+					_mm_cmplt_epi32(level, _mm_setzero_si128()),
+					_mm_cmpgt_epi32(level, _mm_set1_epi32(255))));
+		if(_mm_movemask_epi8(out_of_range)){
+			int ks[4];
+			_mm_storeu_si128((__m128i*)ks, k);
+			for(i = 0; i < 4; i++){
+				out[j+i] = weights[j+i] < 0 ? background : phase_lut_weighted(lut, contrast, ks[i], weights[j+i]);
+			}
+		}else{
+			__m128i red = _mm_mullo_epi32(_mm_add_epi32(level, _mm_set1_epi32(4)), _mm_set1_epi32(31));
+			__m128i green = _mm_mullo_epi32(_mm_add_epi32(level, _mm_set1_epi32(2)), _mm_set1_epi32(63));
+			red = _mm_srli_epi32(_mm_mullo_epi32(red, reciprocal), 23);
+			green = _mm_srli_epi32(_mm_mullo_epi32(green, reciprocal), 23);
+			__m128i pixels = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(red, 11), _mm_slli_epi32(green, 5)), red);
+			pixels = _mm_blendv_epi8(pixels, _mm_set1_epi32(background), outside);
+			_mm_storel_epi64((__m128i*)(out + j), _mm_packus_epi32(pixels, pixels));
+		}
+		phases = _mm_add_epi32(phases, step4);
+		phases = _mm_min_epu32(phases, _mm_sub_epi32(phases, period4));
+	}
+	weighted_row_scalar(out + j, lut, contrast, (uint32_t)(_mm_cvtsi128_si32(phases)), weights + j, background, n - j);
+}
+
+__attribute__((target("avx2")))
+__m256i rgb888_channel_avx2(__m128i a, __m128i b, __m128i c, const __m128i* picks){
+	//One channel of 16 pixels held in the 48 bytes a, b and c, widened to 16 bits
+	__m128i bytes = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, picks[0]), _mm_shuffle_epi8(b, picks[1])),
+				_mm_shuffle_epi8(c, picks[2]));
+	return _mm256_cvtepu8_epi16(bytes);
+}
+
+__attribute__((target("avx2")))
+__m256i rgb565_field_avx2(__m256i channel, int scale, int offset){
+	//(scale*channel + offset)/255, dividing exactly as (x + (x>>8) + 1)>>8
+	__m256i x = _mm256_add_epi16(_mm256_mullo_epi16(channel, _mm256_set1_epi16(scale)), _mm256_set1_epi16(offset));
+	x = _mm256_add_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), _mm256_set1_epi16(1));
+	return _mm256_srli_epi16(x, 8);
+}
+
+__attribute__((target("avx2")))
+void pack_rgb888_avx2(uint16_t* out, const uint8_t* rgb, size_t n){
+	/*Sixteen pixels at a time. Each channel is picked out of the 48
+	bytes with a byte shuffle per 16, then packed with rgb_to_uint()'s
+	arithmetic in 16 bit lanes*/
+	const __m128i red[3] = {
+		_mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+		_mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1),
+		_mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)};
+	const __m128i green[3] = {
+		_mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+		_mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1),
+		_mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)};
+	const __m128i blue[3] = {
+		_mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+		_mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1),
+		_mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)};
+	size_t j;
+	for(j = 0; j + 16 <= n; j += 16){
+		const __m128i* in = (const __m128i*)(rgb + 3*j);
+		__m128i a = _mm_loadu_si128(in);
+		__m128i b = _mm_loadu_si128(in + 1);
+		__m128i c = _mm_loadu_si128(in + 2);
+		__m256i r = rgb565_field_avx2(rgb888_channel_avx2(a, b, c, red), 31, 124);
+		__m256i g = rgb565_field_avx2(rgb888_channel_avx2(a, b, c, green), 63, 126);
+		__m256i bl = rgb565_field_avx2(rgb888_channel_avx2(a, b, c, blue), 31, 124);
+		__m256i pixels = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi16(r, 11), _mm256_slli_epi16(g, 5)), bl);
+		_mm256_storeu_si256((__m256i*)(out + j), pixels);
+	}
+	pack_rgb888_scalar(out + j, rgb + 3*j, n - j);
+}
+
+#endif
+
+
+#ifdef RPG_NEON
+
+void lut_row_neon(uint16_t* out, const uint16_t* table, int64_t phase, int64_t step, int64_t period, int n){
+	//Four phases at a time; NEON has no gather, so the loads are per lane
+	if(!lanes_fit(period)){
+		lut_row_scalar(out, table, phase, step, period, n);
+		return;
+	}
+	uint32_t lanes[4];
+	lane_phases(lanes, 4, phase, step, period);
+	uint32x4_t phases = vld1q_u32(lanes);
+	uint32x4_t step4 = vdupq_n_u32((step*4) % period);
+	uint32x4_t period4 = vdupq_n_u32(period);
+	int j;
+	for(j = 0; j + 4 <= n; j += 4){
+		uint32x4_t k = vshrq_n_u32(phases, 16);
+		out[j] = table[vgetq_lane_u32(k, 0)];
+		out[j+1] = table[vgetq_lane_u32(k, 1)];
+		out[j+2] = table[vgetq_lane_u32(k, 2)];
+		out[j+3] = table[vgetq_lane_u32(k, 3)];
+		phases = vaddq_u32(phases, step4);
+		phases = vminq_u32(phases, vsubq_u32(phases, period4));
+	}
+	lut_row_scalar(out + j, table, vgetq_lane_u32(phases, 0), step, period, n - j);
+}
+
+void lut_row_envelope_neon(uint16_t* out, const uint16_t* tables, int table_length, const uint8_t* envelope, int64_t phase, int64_t step, int64_t period, int n){
+	if(!lanes_fit(period)){
+		lut_row_envelope_scalar(out, tables, table_length, envelope, phase, step, period, n);
+		return;
+	}
+	uint32_t lanes[4];
+	lane_phases(lanes, 4, phase, step, period);
+	uint32x4_t phases = vld1q_u32(lanes);
+	uint32x4_t step4 = vdupq_n_u32((step*4) % period);
+	uint32x4_t period4 = vdupq_n_u32(period);
+	int j;
+	for(j = 0; j + 4 <= n; j += 4){
+		uint32_t tables_used[4] = {envelope[j], envelope[j+1], envelope[j+2], envelope[j+3]};
+		uint32x4_t k = vmlaq_n_u32(vshrq_n_u32(phases, 16), vld1q_u32(tables_used), table_length);
+		out[j] = tables[vgetq_lane_u32(k, 0)];
+		out[j+1] = tables[vgetq_lane_u32(k, 1)];
+		out[j+2] = tables[vgetq_lane_u32(k, 2)];
+		out[j+3] = tables[vgetq_lane_u32(k, 3)];
+		phases = vaddq_u32(phases, step4);
+		phases = vminq_u32(phases, vsubq_u32(phases, period4));
+	}
+	lut_row_envelope_scalar(out + j, tables, table_length, envelope + j, vgetq_lane_u32(phases, 0), step, period, n - j);
+}
+
+uint16x8_t rgb565_field_neon(uint8x8_t channel, uint8_t scale, uint16_t offset){
+	//(scale*channel + offset)/255, dividing exactly as (x + (x>>8) + 1)>>8
+	uint16x8_t x = vmlal_u8(vdupq_n_u16(offset), channel, vdup_n_u8(scale));
+	return vshrq_n_u16(vaddq_u16(vaddq_u16(x, vshrq_n_u16(x, 8)), vdupq_n_u16(1)), 8);
+}
+
+void pack_rgb888_neon(uint16_t* out, const uint8_t* rgb, size_t n){
+	//Sixteen pixels at a time, split into channels by vld3
+	size_t j;
+	int half;
+	for(j = 0; j + 16 <= n; j += 16){
+		uint8x16x3_t pixels = vld3q_u8(rgb + 3*j);
+		for(half = 0; half < 2; half++){
+			uint8x8_t r = half ? vget_high_u8(pixels.val[0]) : vget_low_u8(pixels.val[0]);
+			uint8x8_t g = half ? vget_high_u8(pixels.val[1]) : vget_low_u8(pixels.val[1]);
+			uint8x8_t b = half ? vget_high_u8(pixels.val[2]) : vget_low_u8(pixels.val[2]);
+			uint16x8_t packed = vorrq_u16(vorrq_u16(vshlq_n_u16(rgb565_field_neon(r, 31, 124), 11),
+						vshlq_n_u16(rgb565_field_neon(g, 63, 126), 5)),
+					rgb565_field_neon(b, 31, 124));
+			vst1q_u16(out + j + 8*half, packed);
+		}
+	}
+	pack_rgb888_scalar(out + j, rgb + 3*j, n - j);
+}
+
+#ifdef __aarch64__
+void weighted_row_neon(uint16_t* out, phase_lut* lut, double contrast, int64_t phase, const double* weights, uint16_t background, int n){
+	//Two pixels of brightness arithmetic at a time; 32 bit ARM has no double NEON
+	float64x2_t c = vdupq_n_f64(contrast);
+	float64x2_t a = vdupq_n_f64(lut->amplitude);
+	float64x2_t o = vdupq_n_f64(lut->offset);
+	int j, i;
+	for(j = 0; j + 2 <= n; j += 2){
+		int k[2];
+		for(i = 0; i < 2; i++){
+			k[i] = phase >> 16;
+			phase += lut->step;
+			if(phase >= lut->period){
+				phase -= lut->period;
+			}
+		}
+		float64x2_t wave = vsetq_lane_f64(lut->wave[k[1]], vdupq_n_f64(lut->wave[k[0]]), 1);
+		float64x2_t brightness = vaddq_f64(vmulq_f64(vmulq_f64(vmulq_f64(c, vld1q_f64(weights + j)), a), wave), o);
+		int64x2_t levels = vcvtq_s64_f64(brightness);
+		int64_t level[2] = {vgetq_lane_s64(levels, 0), vgetq_lane_s64(levels, 1)};
+		for(i = 0; i < 2; i++){
+			if(weights[j+i] < 0){
+				out[j+i] = background;
+			}else if(level[i] >= 0 && level[i] < 256){
+				out[j+i] = lut->grey[level[i]];
+			}else{
+				out[j+i] = phase_lut_weighted(lut, contrast, k[i], weights[j+i]);
+			}
+		}
+	}
+	weighted_row_scalar(out + j, lut, contrast, phase, weights + j, background, n - j);
+}
+#endif
+
+#endif
+
+
+pixel_kernels scalar_kernels = {"scalar", lut_row_scalar, lut_row_envelope_scalar, weighted_row_scalar, pack_rgb888_scalar};
+#ifdef RPG_X86
+pixel_kernels sse2_kernels = {"sse2", lut_row_scalar, lut_row_envelope_scalar, weighted_row_sse2, pack_rgb888_scalar};
+pixel_kernels avx2_kernels = {"avx2", lut_row_avx2, lut_row_envelope_avx2, weighted_row_avx2, pack_rgb888_avx2};
+#endif
+#ifdef RPG_NEON
+#ifdef __aarch64__
+pixel_kernels neon_kernels = {"neon", lut_row_neon, lut_row_envelope_neon, weighted_row_neon, pack_rgb888_neon};
+#else
+pixel_kernels neon_kernels = {"neon", lut_row_neon, lut_row_envelope_neon, weighted_row_scalar, pack_rgb888_neon};
+#endif
+#endif
+
+pixel_kernels* kernels = &scalar_kernels;
+
+bool pixel_kernels_supported(pixel_kernels* candidate){
+	if(candidate == &scalar_kernels){
+		return true;
+	}
+#ifdef RPG_X86
+	__builtin_cpu_init();
+	if(candidate == &sse2_kernels){
+		return __builtin_cpu_supports("sse2");
+	}
+	if(candidate == &avx2_kernels){
+		return __builtin_cpu_supports("avx2");
+	}
+#endif
+#ifdef RPG_NEON
+	if(candidate == &neon_kernels){
+#if defined(__arm__)
+		return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#else
+		return true;
+#endif
+	}
+#endif
+	return false;
+}
+
+int select_pixel_kernels(const char* name){
+	/*Use the named set of row kernels, or with "auto" the fastest
+	the CPU supports. Returns 1 if name is unknown or unsupported.
+	Must not be called while anything is rendering*/
+	pixel_kernels* candidates[] = {
+#ifdef RPG_X86
+		&avx2_kernels,
+		&sse2_kernels,
+#endif
+#ifdef RPG_NEON
+		&neon_kernels,
+#endif
+		&scalar_kernels
+	};
+	int i;
+	int n_candidates = sizeof(candidates)/sizeof(candidates[0]);
+	for(i = 0; i < n_candidates; i++){
+		bool wanted = strcmp(name, "auto") == 0 || strcmp(name, candidates[i]->name) == 0;
+		if(wanted && pixel_kernels_supported(candidates[i])){
+			kernels = candidates[i];
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void lut_row_repeated(uint16_t* out, const uint16_t* table, int64_t phase, int64_t step, int64_t period, int n, int repeat){
+	/*As lut_row, but if the row repeats itself every repeat
+	pixels, render one repeat and copy it along the row*/
+	if(repeat <= 0 || repeat >= n){
+		kernels->lut_row(out, table, phase, step, period, n);
+		return;
+	}
+	kernels->lut_row(out, table, phase, step, period, repeat);
+	int done = repeat;
+	while(done < n){
+		int chunk = done < n - done ? done : n - done;
+		memcpy(out + done, out, chunk*sizeof(uint16_t));
+		done += chunk;
+	}
+}
+
+/*Envelope maps. A mask or gabor's envelope doesn't change from frame
+to frame, or between gratings that differ only in angle, frequency or
+waveform, so rather than take the sqrt() and exp() of every pixel of
+every frame, each process keeps the last few maps of weights it has
+worked out and hands them to every build of the same geometry.*/
+
+static envelope_map* envelope_cache = NULL;
+static pthread_mutex_t envelope_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+double envelope_weight(grating_params* p, int i, int j){
+	/*The weight of pixel (j,i) of a mask or gabor, or -1 if it is
+	background: 1 inside a mask, falling off across its padding, or
+	the gabor's gaussian out to p->reach*/
+	int point_radius = (int) sqrt( ((j-p->center_j) * (j-p->center_j)) + ((i-p->center_i) * (i-p->center_i)) );
+	if( point_radius > p->reach) {
+		return -1;
+	}
+	if (p->sigma != 0) {
+		return gaussian(point_radius, p->sigma);
+	}
+	if( point_radius <= p->radius) {
+		return 1;
+	}
+	return (p->radius + p->padding - point_radius) / p->padding;
+}
+
+bool envelope_map_matches(envelope_map* map, grating_params* p, fb_config fb0){
+	return map->width == (int)fb0.width && map->height == (int)fb0.height &&
+		map->center_j == p->center_j && map->center_i == p->center_i &&
+		map->sigma == p->sigma && map->radius == p->radius &&
+		map->padding == p->padding && map->reach == p->reach;
+}
+
+envelope_map* envelope_map_acquire(grating_params* p, fb_config fb0){
+	/*The map of p's envelope over p->roi, from the cache or worked out
+	now, or NULL if out of memory. Release it with envelope_map_release()*/
+	pthread_mutex_lock(&envelope_cache_lock);
+	envelope_map** link;
+	for(link = &envelope_cache; *link != NULL; link = &(*link)->next){
+		envelope_map* map = *link;
+		if(envelope_map_matches(map, p, fb0)){
+			*link = map->next;
+			map->next = envelope_cache;
+			envelope_cache = map;
+			map->users++;
+			pthread_mutex_unlock(&envelope_cache_lock);
+			return map;
+		}
+	}
+	pthread_mutex_unlock(&envelope_cache_lock);
+
+	envelope_map* map = malloc(sizeof(envelope_map));
+	double* weights = malloc((size_t)(p->roi.width)*p->roi.height*sizeof(double));
+	if(map == NULL || weights == NULL){
+		free(map);
+		free(weights);
+		return NULL;
+	}
+	map->width = fb0.width;
+	map->height = fb0.height;
+	map->center_j = p->center_j;
+	map->center_i = p->center_i;
+	map->sigma = p->sigma;
+	map->radius = p->radius;
+	map->padding = p->padding;
+	map->reach = p->reach;
+	map->roi = p->roi;
+	map->weights = weights;
+	int i, j;
+	for(i = 0; i < p->roi.height; i++){
+		for(j = 0; j < p->roi.width; j++){
+			*weights++ = envelope_weight(p, p->roi.y + i, p->roi.x + j);
+		}
+	}
+	//another build may have made the same map meanwhile, which does no harm
+	pthread_mutex_lock(&envelope_cache_lock);
+	map->users = 1;
+	map->next = envelope_cache;
+	envelope_cache = map;
+	pthread_mutex_unlock(&envelope_cache_lock);
+	return map;
+}
+
+void envelope_map_release(envelope_map* released){
+	/*Stops using a map, freeing any maps no build is using beyond the
+	ENVELOPE_CACHE_MAPS most recently used*/
+	if(released == NULL){
+		return;
+	}
+	pthread_mutex_lock(&envelope_cache_lock);
+	released->users--;
+	int unused = 0;
+	envelope_map** link = &envelope_cache;
+	while(*link != NULL){
+		envelope_map* map = *link;
+		if(map->users == 0 && ++unused > ENVELOPE_CACHE_MAPS){
+			*link = map->next;
+			free(map->weights);
+			free(map);
+		}else{
+			link = &map->next;
+		}
+	}
+	pthread_mutex_unlock(&envelope_cache_lock);
+}
+
+const double* envelope_row(envelope_map* map, int i){
+	//Row i of the screen's weights over map->roi, or NULL if it's all background
+	if(i < map->roi.y || i >= map->roi.y + map->roi.height){
+		return NULL;
+	}
+	return map->weights + (size_t)(i - map->roi.y)*map->roi.width;
+}
+
+void build_frame_rows_lut(uint16_t* frame, int t, grating_params* p, fb_config framebuffer, int first_row, int last_row){
+	/*KERNEL_LUT version of build_frame_rows()*/
+	phase_lut* lut = p->lut;
+	uint16_t background = rgb_to_uint(p->background,p->background,p->background);
+	uint16_t* write_location = frame + first_row*framebuffer.width;
+	int i,j;
+	for(i=first_row;i<last_row;i++){
+		int64_t phase = phase_lut_row_start(lut, p, i, t);
+		if(p->envelope == NULL) {
+			lut_row_repeated(write_location, lut->packed, phase, lut->step, lut->period, framebuffer.width, lut->repeat);
+			write_location += framebuffer.width;
+			continue;
+		}
+		const double* weights = envelope_row(p->envelope, i);
+		screen_roi* roi = &p->envelope->roi;
+		for(j=0;j<(int)framebuffer.width;j++){
+			if(weights == NULL || j < roi->x || j >= roi->x + roi->width){
+				write_location[j] = background;
+			}
+		}
+		if(weights != NULL){
+			//the phase roi->x pixels along, as stepping there would leave it
+			phase = (phase + (int64_t)(roi->x)*lut->step) % lut->period;
+			kernels->weighted_row(write_location + roi->x, lut, p->contrast, phase, weights, background, roi->width);
+		}
+		write_location += framebuffer.width;
+	}
+}
+
+
+void build_frame_rows(uint16_t* frame, int t, grating_params* p, fb_config framebuffer, int first_row, int last_row){
+	/*Render rows [first_row, last_row) of frame t into frame, which
+	points to the start of a buffer of framebuffer.size bytes*/
+	if(p->lut != NULL){
+		build_frame_rows_lut(frame, t, p, framebuffer, first_row, last_row);
+		return;
+	}
+	uint16_t* write_location = frame + first_row*framebuffer.width;
+	screen_roi* roi = &p->roi;
+	int i,j;
+	for(i=first_row;i<last_row;i++){ //for each row of pixels
+		const double* weights = p->envelope != NULL ? envelope_row(p->envelope, i) : NULL;
+		for(j=0;j<framebuffer.width;j++){ //for each column of pixels
+			//set each pixel's brightness
+			if( p->radius == 0 && p->sigma == 0) { //if we have no radius or sigma and are doing fullscreen
+				if(p->waveform==SQUARE){
+					*write_location = squarewave(j,i,t,p->wavelength,p->speed,p->angle,p->cosine,p->sine, 1, p->contrast, p->background);
+				}else if(p->waveform==SINE){
+					*write_location = sinewave(j,i,t,p->wavelength,p->speed,p->angle,p->cosine,p->sine, 1, p->contrast, p->background);
+				}
+			} else { //a mask or a gabor, weighted by its envelope map
+				double weight = weights != NULL && j >= roi->x && j < roi->x + roi->width ? weights[j - roi->x] : -1;
+				if( weight < 0) { //if we are outside the circular mask, or the gabor has faded
+					*write_location = rgb_to_uint(p->background,p->background,p->background);
+				} else if (p->sigma != 0) { //we must be doing a gabor
+					//you can't do a squarewave gabor. I do not permit such abominations.
+					*write_location = gabor(j,i,t,p->wavelength,p->speed,p->angle,p->cosine,p->sine, weight, p->contrast, p->background);
+				} else if(p->waveform==SQUARE) { //inside the mask, or in its padding
+					*write_location = squarewave(j,i,t,p->wavelength,p->speed,p->angle,p->cosine,p->sine, weight, p->contrast, p->background);
+				} else if (p->waveform==SINE){
+					*write_location = sinewave(j,i,t,p->wavelength,p->speed,p->angle,p->cosine,p->sine, weight, p->contrast, p->background);
+				}
+			}
+			write_location++;
+		}
+	}
+}
+
+
+/*A small pool of worker threads for splitting a frame between cores.
+The calling thread always renders band 0 itself, so a pool of one
+thread never starts a worker and behaves exactly like the old
+single threaded loop.*/
+
+typedef void (*render_job)(void* job_args, int band, int n_bands);
+
+typedef struct render_pool render_pool;
+
+//CPUs the process may run on, taken at import, for render workers
+//created by a display thread that has been pinned to one of them
+static cpu_set_t process_cpus;
+static int have_process_cpus = 0;
+
+typedef struct {
+	render_pool* pool;
+	int band;
+} render_worker_args;
+
+struct render_pool {
+	int n_threads;
+	pthread_t* threads;
+	render_worker_args* worker_args;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	render_job job;
+	void* job_args;
+	unsigned long generation;
+	int pending;
+	bool quit;
+};
+
+void* render_worker(void* arg){
+	render_worker_args* self = arg;
+	render_pool* pool = self->pool;
+	unsigned long seen = 0;
+	pthread_mutex_lock(&pool->lock);
+	while(1){
+		while(pool->generation == seen && !pool->quit){
+			pthread_cond_wait(&pool->start, &pool->lock);
+		}
+		if(pool->quit){
+			break;
+		}
+		seen = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+		pool->job(pool->job_args, self->band, pool->n_threads);
+		pthread_mutex_lock(&pool->lock);
+		pool->pending--;
+		if(pool->pending == 0){
+			pthread_cond_signal(&pool->done);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+render_pool* render_pool_create(int n_threads){
+	/*n_threads <= 0 uses one thread per online core*/
+	if(n_threads <= 0){
+		n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if(n_threads <= 0){
+			n_threads = 1;
+		}
+	}
+	render_pool* pool = calloc(1, sizeof(render_pool));
+	if(pool == NULL){
+		return NULL;
+	}
+	pool->threads = calloc(n_threads, sizeof(pthread_t));
+	pool->worker_args = calloc(n_threads, sizeof(render_worker_args));
+	if(pool->threads == NULL || pool->worker_args == NULL){
+		free(pool->threads);
+		free(pool->worker_args);
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pool->n_threads = 1;
+	int i;
+	for(i = 1; i < n_threads; i++){
+		pool->worker_args[i].pool = pool;
+		pool->worker_args[i].band = i;
+		if(pthread_create(&pool->threads[i], NULL, render_worker, &pool->worker_args[i])){
+			//carry on with however many workers we did manage to start
+			break;
+		}
+		if(have_process_cpus){
+			pthread_setaffinity_np(pool->threads[i], sizeof(process_cpus), &process_cpus);
+		}
+		pool->n_threads++;
+	}
+	return pool;
+}
+
+void render_pool_run(render_pool* pool, render_job job, void* job_args){
+	/*Run job once per band, blocking until every band is finished*/
+	if(pool->n_threads > 1){
+		pthread_mutex_lock(&pool->lock);
+		pool->job = job;
+		pool->job_args = job_args;
+		pool->pending = pool->n_threads - 1;
+		pool->generation++;
+		pthread_cond_broadcast(&pool->start);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	job(job_args, 0, pool->n_threads);
+	if(pool->n_threads > 1){
+		pthread_mutex_lock(&pool->lock);
+		while(pool->pending > 0){
+			pthread_cond_wait(&pool->done, &pool->lock);
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+void render_pool_destroy(render_pool* pool){
+	int i;
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+	for(i = 1; i < pool->n_threads; i++){
+		pthread_join(pool->threads[i], NULL);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->start);
+	pthread_cond_destroy(&pool->done);
+	free(pool->threads);
+	free(pool->worker_args);
+	free(pool);
+}
+
+
+typedef struct {
+	uint16_t* frame;
+	int t;
+	grating_params* params;
+	fb_config framebuffer;
+	int first_row;
+	int last_row;
+} frame_job;
+
+void build_frame_band(void* job_args, int band, int n_bands){
+	/*Rows are dealt out round robin rather than in blocks, so
+	a mask or gabor in the middle of the screen doesn't leave
+	the threads rendering the top and bottom of it idle*/
+	frame_job* job = job_args;
+	int row;
+	for(row = job->first_row + band; row < job->last_row; row += n_bands){
+		build_frame_rows(job->frame, job->t, job->params, job->framebuffer, row, row+1);
+	}
+}
+
+void build_frame(uint16_t* frame, int t, grating_params* params, fb_config framebuffer, int first_row, int last_row, render_pool* pool){
+	/*Render rows [first_row, last_row) of frame t into frame, splitting
+	them across pool*/
+	frame_job job;
+	job.frame = frame;
+	job.t = t;
+	job.params = params;
+	job.framebuffer = framebuffer;
+	job.first_row = first_row;
+	job.last_row = last_row;
+	render_pool_run(pool, build_frame_band, &job);
+}
+
+
+int rowshift_envelope_level(grating_params* p, int i, int j){
+	/*Which table pixel (j,i) of a masked grating or gabor is drawn
+	from: 0 for the background outside a mask, otherwise 1 plus its
+	weight quantised to ROWSHIFT_LEVELS-1 steps*/
+	double weight = envelope_weight(p, i, j);
+	if(weight < 0){
+		return 0;
+	}
+	return 1 + (int)(weight*(ROWSHIFT_LEVELS-1) + 0.5);
+}
+
+int write_rowshift(FILE* file, grating_params* p, fb_config fb0, fileheader_v2* frames_header){
+	/*Write a FORMAT_ROWSHIFT grating. p must have been set up with
+	KERNEL_LUT, whose table this format stores*/
+	phase_lut* lut = p->lut;
+	fileheader_rowshift header;
+	memset(&header, 0, sizeof(header));
+	header.magic = ROWSHIFT_MAGIC;
+	header.n_frames = frames_header->n_frames;
+	header.frames_per_cycle = frames_header->stored_frames;
+	header.width = fb0.width;
+	header.height = fb0.height;
+	header.table_length = lut->length;
+	header.frames_per_second = frames_header->frames_per_second;
+	header.spacial_frequency = (uint16_t)(frames_header->spacial_frequency);
+	header.temporal_frequency = (uint16_t)(frames_header->temporal_frequency);
+	header.step = lut->step;
+
+	bool has_envelope = p->radius != 0 || p->sigma != 0;
+	uint8_t* envelope = NULL;
+	uint16_t* table = malloc(lut->length*sizeof(uint16_t));
+	int64_t* phases = malloc((fb0.height + header.frames_per_cycle)*sizeof(int64_t));
+	if(has_envelope){
+		envelope = malloc(fb0.width*fb0.height);
+	}
+	if(table == NULL || phases == NULL || (has_envelope && envelope == NULL)){
+		free(table);
+		free(phases);
+		free(envelope);
+		raise_without_gil(PyExc_MemoryError, NULL);
+		return 1;
+	}
+
+	//Only store tables for the envelope levels actually used
+	int level_table[ROWSHIFT_LEVELS+1];
+	int levels[ROWSHIFT_LEVELS+1];
+	int i, j, k, level;
+	header.n_tables = 1;
+	levels[0] = ROWSHIFT_LEVELS;
+	if(has_envelope){
+		header.n_tables = 0;
+		for(level = 0; level <= ROWSHIFT_LEVELS; level++){
+			level_table[level] = -1;
+		}
+		for(i = 0; i < fb0.height; i++){
+			for(j = 0; j < fb0.width; j++){
+				level = rowshift_envelope_level(p, i, j);
+				if(level_table[level] == -1){
+					level_table[level] = header.n_tables;
+					levels[header.n_tables] = level;
+					header.n_tables++;
+				}
+				envelope[i*fb0.width + j] = level_table[level];
+			}
+		}
+	}
+
+	fwrite(&header, sizeof(fileheader_rowshift), 1, file);
+	uint16_t background = rgb_to_uint(p->background,p->background,p->background);
+	for(i = 0; i < header.n_tables; i++){
+		level = levels[i];
+		for(k = 0; k < lut->length; k++){
+			if(level == 0){
+				table[k] = background;
+			}else if(level == ROWSHIFT_LEVELS && p->sigma == 0){
+				table[k] = lut->packed[k];
+			}else{
+				table[k] = phase_lut_weighted(lut, p->contrast, k, (double)(level-1)/(ROWSHIFT_LEVELS-1));
+			}
+		}
+		fwrite(table, sizeof(uint16_t), lut->length, file);
+	}
+	for(i = 0; i < fb0.height; i++){
+		phases[i] = phase_lut_row_start(lut, p, i, 0);
+	}
+	for(i = 0; i < header.frames_per_cycle; i++){
+		phases[fb0.height + i] = (((int64_t)(p->speed)*i*LUT_SUBSTEPS) << 16) % lut->period;
+	}
+	fwrite(phases, sizeof(int64_t), fb0.height + header.frames_per_cycle, file);
+	if(has_envelope){
+		fwrite(envelope, 1, fb0.width*fb0.height, file);
+	}
+	free(table);
+	free(phases);
+	free(envelope);
+	return 0;
+}
+
+bool is_rowshift(void* grating_data){
+	return ((fileheader_rowshift*)(grating_data))->magic == ROWSHIFT_MAGIC;
+}
+
+void rowshift_parse(void* grating_data, rowshift_grating* grating){
+	fileheader_rowshift* header = grating_data;
+	grating->header = header;
+	grating->tables = (uint16_t*)(header + 1);
+	grating->row_phase = (int64_t*)(grating->tables + (size_t)(header->n_tables)*header->table_length);
+	grating->frame_phase = grating->row_phase + header->height;
+	grating->envelope = NULL;
+	if(header->n_tables > 1){
+		grating->envelope = (uint8_t*)(grating->frame_phase + header->frames_per_cycle);
+	}
+	int wavelength = header->table_length / LUT_SUBSTEPS;
+	int64_t period = (int64_t)(header->table_length) << 16;
+	grating->repeat = 0;
+	if(header->step == 0){
+		grating->repeat = 1;
+	}else if((header->step*wavelength) % period == 0){
+		grating->repeat = wavelength;
+	}
+}
+
+typedef struct {
+	rowshift_grating* grating;
+	int frame;
+	uint16_t* write_loc;
+} rowshift_job;
+
+void rowshift_band(void* job_args, int band, int n_bands){
+	/*Reconstruct a band of rows of one frame of a FORMAT_ROWSHIFT
+	grating: each pixel is a table lookup at a phase that steps
+	along the row*/
+	rowshift_job* job = job_args;
+	rowshift_grating* grating = job->grating;
+	fileheader_rowshift* header = grating->header;
+	int64_t period = (int64_t)(header->table_length) << 16;
+	int64_t frame_phase = grating->frame_phase[job->frame];
+	int width = header->width;
+	int first_row = header->height*band/n_bands;
+	int last_row = header->height*(band+1)/n_bands;
+	int row;
+	for(row = first_row; row < last_row; row++){
+		int64_t phase = grating->row_phase[row] + frame_phase;
+		if(phase >= period){
+			phase -= period;
+		}
+		uint16_t* write_loc = job->write_loc + row*width;
+		if(grating->envelope == NULL){
+			lut_row_repeated(write_loc, grating->tables, phase, header->step, period, width, grating->repeat);
+		}else{
+			kernels->lut_row_envelope(write_loc, grating->tables, header->table_length, grating->envelope + row*width,
+					phase, header->step, period, width);
+		}
+	}
+}
+
+void rowshift_frame(rowshift_grating* grating, int frame, uint16_t* write_loc, render_pool* pool){
+	rowshift_job job;
+	job.grating = grating;
+	job.frame = frame;
+	job.write_loc = write_loc;
+	render_pool_run(pool, rowshift_band, &job);
+}
+
+
+void full_screen_roi(screen_roi* roi, fb_config fb0){
+	roi->x = 0;
+	roi->y = 0;
+	roi->width = fb0.width;
+	roi->height = fb0.height;
+	roi->background = 0;
+}
+
+void grating_roi(grating_params* p, fb_config fb0){
+	/*Works out p->reach and p->roi, the rectangle outside which every
+	frame is the background: a mask and its padding, or a gabor out to
+	where drawing it would give the background anyway, widened so its
+	columns start and end on multiples of ROI_ALIGN*/
+	screen_roi* roi = &p->roi;
+	full_screen_roi(roi, fb0);
+	roi->background = rgb_to_uint(p->background, p->background, p->background);
+	p->reach = INT_MAX;
+	if(p->radius == 0 && p->sigma == 0){
+		return;
+	}
+	if(p->sigma == 0){
+		p->reach = p->radius + p->padding;
+	}else{
+		/*gabor_at() truncates brightness, so once the envelope moves a
+		pixel less than a level it is drawn as the background or, where
+		the carrier is negative, one level below. The patch can only
+		stop there if those two pack to the same pixel; otherwise its
+		tail reaches the edge of the screen*/
+		if(rgb_to_uint(p->background - 1, p->background - 1, p->background - 1) != roi->background){
+			return;
+		}
+		//as gabor_at()
+		double amplitude = fabs(p->contrast) * (p->background < 128 ? p->background : 255 - p->background);
+		for(p->reach = -1; p->reach < (int)(fb0.width + fb0.height); p->reach++){
+			if(amplitude * gaussian(p->reach + 1, p->sigma) < 1){
+				break;
+			}
+		}
+	}
+	//point_radius is truncated, so pixels drawn are less than reach + 1 away
+	int reach = p->reach < 0 ? 0 : p->reach;
+	int left = p->center_j - reach < 0 ? 0 : (p->center_j - reach)/ROI_ALIGN*ROI_ALIGN;
+	int right = p->center_j + reach + 1 > fb0.width ? fb0.width : p->center_j + reach + 1;
+	int top = p->center_i - reach < 0 ? 0 : p->center_i - reach;
+	int bottom = p->center_i + reach + 1 > fb0.height ? fb0.height : p->center_i + reach + 1;
+	right = (right + ROI_ALIGN - 1)/ROI_ALIGN*ROI_ALIGN;
+	if(right > fb0.width){
+		right = fb0.width;
+	}
+	if(left < right && top < bottom){
+		//otherwise the patch is off the screen, which is left as it is
+		roi->x = left;
+		roi->y = top;
+		roi->width = right - left;
+		roi->height = bottom - top;
+	}
+}
+
+void grating_params_release(grating_params* params){
+	envelope_map_release(params->envelope);
+	phase_lut_destroy(params->lut);
+}
+
+int grating_params_init(grating_params* params, fb_config fb0, int fps, double angle, double sf, double tf, double contrast, int background, int waveform, double percent_sigma, double percent_diameter, double percent_center_left, double percent_center_top, double percent_padding, int kernel){
+	/*Work out the pixel geometry of a grating from its options.
+	The caller must release it with grating_params_release()*/
+	params->wavelength = (fb0.width/DEGREES_SUBTENDED)/sf;
+
+	params->speed = params->wavelength*tf/fps;
+	if(params->speed==0){
+		params->speed = 1;
+	}
+	params->sigma = fb0.width * percent_sigma / 100;
+	params->radius = fb0.width * percent_diameter / 200;
+	params->center_j = fb0.width * percent_center_left / 100;
+	params->center_i = fb0.height * percent_center_top / 100;
+	params->padding = params->radius * percent_padding / 100;
+	params->waveform = waveform;
+	params->contrast = contrast;
+	params->background = background;
+	set_grating_angle(params, angle);
+	grating_roi(params, fb0);
+	params->envelope = NULL;
+	params->lut = NULL;
+	if(params->radius != 0 || params->sigma != 0){
+		params->envelope = envelope_map_acquire(params, fb0);
+	}
+	if(kernel == KERNEL_LUT){
+		params->lut = phase_lut_create(params);
+	}
+	if(((params->radius != 0 || params->sigma != 0) && params->envelope == NULL) ||
+			(kernel == KERNEL_LUT && params->lut == NULL)){
+		grating_params_release(params);
+		raise_without_gil(PyExc_MemoryError, NULL);
+		return 1;
+	}
+	return 0;
+}
+
+
+/*Versioned containers. A container is a fileheader_v2, its frame
+index, padding up to the first aligned offset, and then the frames one
+after another, each padded out to the alignment. The legacy formats
+can still be read, see index_stimulus()*/
+
+static const char container_padding[CONTAINER_ALIGN]; //zeros written after each frame
+
+void container_init(fileheader_v2* header, int kind, fb_config fb0, uint64_t n_frames, uint64_t stored_frames){
+	memset(header, 0, sizeof(fileheader_v2));
+	header->magic = CONTAINER_MAGIC;
+	header->version = CONTAINER_VERSION;
+	header->header_size = sizeof(fileheader_v2);
+	header->kind = kind;
+	header->pixel_format = PIXEL_RGB565;
+	header->width = fb0.width;
+	header->height = fb0.height;
+	header->alignment = CONTAINER_ALIGN;
+	header->n_frames = n_frames;
+	header->stored_frames = stored_frames;
+	header->frame_size = fb0.size;
+	header->index_offset = sizeof(fileheader_v2);
+	header->refresh_per_frame = 1;
+	header->roi_width = fb0.width;
+	header->roi_height = fb0.height;
+}
+
+void container_set_roi(fileheader_v2* header, screen_roi* roi){
+	//Makes the frames of a new container cover only roi
+	header->roi_x = roi->x;
+	header->roi_y = roi->y;
+	header->roi_width = roi->width;
+	header->roi_height = roi->height;
+	header->background = roi->background;
+	header->frame_size = (uint64_t)(roi->width)*roi->height*sizeof(uint16_t);
+}
+
+void container_roi(fileheader_v2* header, screen_roi* roi){
+	//What header's frames cover, all of the screen if it's too short to say
+	if(header->header_size < sizeof(fileheader_v2)){
+		roi->x = 0;
+		roi->y = 0;
+		roi->width = header->width;
+		roi->height = header->height;
+		roi->background = 0;
+		return;
+	}
+	roi->x = header->roi_x;
+	roi->y = header->roi_y;
+	roi->width = header->roi_width;
+	roi->height = header->roi_height;
+	roi->background = header->background;
+}
+
+size_t container_frame_padding(fileheader_v2* header){
+	//Bytes of container_padding written after each frame
+	return (header->alignment - header->frame_size%header->alignment)%header->alignment;
+}
+
+char* container_prologue(fileheader_v2* header, size_t* size){
+	/*Lays out a new container: returns its header and index, padded
+	to where the first frame goes, in *size bytes from the heap, or
+	NULL if out of memory*/
+	uint64_t end = header->index_offset + header->stored_frames*sizeof(uint64_t);
+	uint64_t first = (end + header->alignment - 1)/header->alignment*header->alignment;
+	uint64_t stride = header->frame_size + container_frame_padding(header);
+	char* prologue = calloc(1, first);
+	if(prologue == NULL){
+		return NULL;
+	}
+	memcpy(prologue, header, sizeof(fileheader_v2));
+	uint64_t* index = (uint64_t*)(prologue + header->index_offset);
+	uint64_t i;
+	for(i = 0; i < header->stored_frames; i++){
+		index[i] = first + i*stride;
+	}
+	*size = first;
+	return prologue;
+}
+
+int check_container(fileheader_v2* header, uint64_t file_size, int kind, fb_config fb0, const char* filename){
+	/*Raises ValueError, returning 1, unless header is of a container
+	of this kind that fits in file_size bytes and can be shown on fb0.
+	Called with the GIL*/
+	screen_roi roi;
+	container_roi(header, &roi);
+	if(header->version != CONTAINER_VERSION || header->header_size < offsetof(fileheader_v2, roi_x)){
+		PyErr_Format(PyExc_ValueError, "%s is a version %u stimulus file, this is version %d of rpg",
+				filename, header->version, CONTAINER_VERSION);
+	}else if(header->kind != (uint32_t)kind){
+		PyErr_Format(PyExc_ValueError, "%s is a %s, not a %s", filename,
+				kind == CONTAINER_RAW ? "grating" : "raw", kind == CONTAINER_RAW ? "raw" : "grating");
+	}else if(header->pixel_format != PIXEL_RGB565){
+		PyErr_Format(PyExc_ValueError, "%s has pixels of unknown format %u", filename, header->pixel_format);
+	}else if(header->width != fb0.width || header->height != fb0.height){
+		PyErr_Format(PyExc_ValueError, "%s was built at %ux%u, but the screen is %dx%d",
+				filename, header->width, header->height, fb0.width, fb0.height);
+	}else if(header->n_frames == 0 || header->stored_frames == 0 || header->refresh_per_frame == 0){
+		PyErr_Format(PyExc_ValueError, "%s has no frames to play", filename);
+	}else if(header->n_frames > INT_MAX){
+		PyErr_Format(PyExc_ValueError, "%s has more frames than can be played", filename);
+	}else if(header->header_size >= sizeof(fileheader_v2) &&
+			(header->roi_width == 0 || header->roi_height == 0 ||
+			header->roi_x > header->width || header->roi_width > header->width - header->roi_x ||
+			header->roi_y > header->height || header->roi_height > header->height - header->roi_y)){
+		PyErr_Format(PyExc_ValueError, "%s has frames covering %ux%u at (%u, %u), which is not on the screen",
+				filename, header->roi_width, header->roi_height, header->roi_x, header->roi_y);
+	}else if(header->frame_size != (uint64_t)(roi.width)*roi.height*sizeof(uint16_t) ||
+			header->alignment == 0 || header->index_offset%sizeof(uint64_t) ||
+			header->index_offset > file_size ||
+			header->stored_frames > (file_size - header->index_offset)/sizeof(uint64_t)){
+		PyErr_Format(PyExc_ValueError, "%s is shorter than its header says", filename);
+	}
+	return PyErr_Occurred() != NULL;
+}
+
+int check_rowshift(fileheader_rowshift* header, uint64_t file_size, fb_config fb0, const char* filename){
+	/*Raises ValueError, returning 1, unless header is of a
+	FORMAT_ROWSHIFT grating whose tables, phases and envelope all fit
+	in file_size bytes and which can be shown on fb0. Called with the GIL*/
+	uint64_t left = file_size - sizeof(fileheader_rowshift);
+	uint64_t table_entries = (uint64_t)(header->n_tables)*header->table_length;
+	uint64_t n_phases = (uint64_t)(header->height) + header->frames_per_cycle;
+	uint64_t envelope_size = header->n_tables > 1 ? (uint64_t)(header->width)*header->height : 0;
+	if(file_size < sizeof(fileheader_rowshift)){
+		PyErr_Format(PyExc_ValueError, "%s is too short to be a grating", filename);
+	}else if(header->width != fb0.width || header->height != fb0.height){
+		PyErr_Format(PyExc_ValueError, "%s was built at %ux%u, but the screen is %dx%d",
+				filename, header->width, header->height, fb0.width, fb0.height);
+	}else if(header->n_frames == 0 || header->frames_per_cycle == 0){
+		PyErr_Format(PyExc_ValueError, "%s has no frames to play", filename);
+	}else if(header->n_frames > INT_MAX){
+		PyErr_Format(PyExc_ValueError, "%s has more frames than can be played", filename);
+	}else if(header->n_tables == 0 || header->table_length == 0){
+		PyErr_Format(PyExc_ValueError, "%s has no lookup table to draw frames from", filename);
+	}else if(table_entries > left/sizeof(uint16_t) ||
+			n_phases > (left - table_entries*sizeof(uint16_t))/sizeof(int64_t) ||
+			envelope_size > left - table_entries*sizeof(uint16_t) - n_phases*sizeof(int64_t)){
+		PyErr_Format(PyExc_ValueError, "%s is shorter than its header says", filename);
+	}
+	return PyErr_Occurred() != NULL;
+}
+
+int check_rowshift_data(rowshift_grating* grating, const char* filename){
+	/*Raises ValueError, returning 1, unless every phase of a grating
+	that passed check_rowshift() is within its table and every pixel of
+	its envelope names one of its tables, as rowshift_band() assumes*/
+	fileheader_rowshift* header = grating->header;
+	int64_t period = (int64_t)(header->table_length) << 16;
+	uint64_t i;
+	bool bad = header->step < 0 || header->step >= period;
+	for(i = 0; !bad && i < header->height; i++){
+		bad = grating->row_phase[i] < 0 || grating->row_phase[i] >= period;
+	}
+	for(i = 0; !bad && i < header->frames_per_cycle; i++){
+		bad = grating->frame_phase[i] < 0 || grating->frame_phase[i] >= period;
+	}
+	if(grating->envelope != NULL){
+		for(i = 0; !bad && i < (uint64_t)(header->width)*header->height; i++){
+			bad = grating->envelope[i] >= header->n_tables;
+		}
+	}
+	if(bad){
+		PyErr_Format(PyExc_ValueError, "%s has phases or an envelope outside its lookup tables", filename);
+		return 1;
+	}
+	return 0;
+}
+
+int check_container_index(uint64_t* index, fileheader_v2* header, uint64_t file_size, const char* filename){
+	//Raises ValueError, returning 1, unless every frame index points to is in the file
+	uint64_t i;
+	for(i = 0; i < header->stored_frames; i++){
+		if(index[i] > file_size || file_size - index[i] < header->frame_size || index[i]%sizeof(uint16_t)){
+			PyErr_Format(PyExc_ValueError, "%s is shorter than its header says", filename);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int build_grating(char * filename, double duration, double angle, double sf, double tf, double contrast, int background, int width, int height, int waveform, double percent_sigma, double percent_diameter, double percent_center_left, double percent_center_top, double percent_padding, int threads, int kernel, int format, int fps){
+	//fps of 0 means build for the refresh rate of the screen
+	if(fps == 0){
+		fps = get_refresh_rate();
+		if(fps <= 0){
+			return 1;
+		}
+		printf("Refresh rate measured as: %d hz\n", fps);
+	}
+	fb_config fb0;
+	fb0.width = width;
+	fb0.height = height;
+	fb0.depth = 16;
+	fb0.size = (fb0.height)*(fb0.depth)*(fb0.width)/8;
+	FILE * file = fopen(filename, "wb");
+	if(file == NULL){
+		raise_without_gil(PyExc_OSError, "Could not create %s (%s)", filename, strerror(errno));
+		return 1;
+	}
+	grating_params params;
+	if(format == FORMAT_ROWSHIFT){
+		//the row-shift format stores the lookup table
+		kernel = KERNEL_LUT;
+	}
+	if(grating_params_init(&params, fb0, fps, angle, sf, tf, contrast, background, waveform,
+				percent_sigma, percent_diameter, percent_center_left,
+				percent_center_top, percent_padding, kernel)){
+		fclose(file);
+		return 1;
+	}
+	double actual_tf = ((double)(params.speed*fps)) / params.wavelength;
+	if(actual_tf!=tf){
+		printf("Grating %s has a requested temporal frequency of %f, actual temporal frequency will be %f\n",filename,tf,actual_tf);
+	}
+	//Calculate the minimum number of frames required for a full cycle
+	//(worst case is just FPS*DURATION) and write it, tf, and sf in a header.
+	fileheader_v2 header;
+	uint64_t n_frames = fps * duration;
+	uint64_t frames_per_cycle = params.wavelength / gcd(params.wavelength,params.speed);
+	if(frames_per_cycle > n_frames) {
+		frames_per_cycle = n_frames;
+	}
+	container_init(&header, CONTAINER_GRATING, fb0, n_frames, frames_per_cycle);
+	header.frames_per_second = fps;
+	header.spacial_frequency = sf;
+	header.temporal_frequency = tf;
+	if(format == FORMAT_ROWSHIFT){
+		int status = write_rowshift(file, &params, fb0, &header);
+		grating_params_release(&params);
+		fclose(file);
+		return status;
+	}
+	//only the part of the screen the grating is drawn on is stored
+	screen_roi* roi = &params.roi;
+	container_set_roi(&header, roi);
+	size_t prologue_size;
+	char* prologue = container_prologue(&header, &prologue_size);
+	uint16_t* frame = malloc(fb0.size);
+	render_pool* pool = render_pool_create(threads);
+	if(prologue == NULL || frame == NULL || pool == NULL){
+		free(prologue);
+		free(frame);
+		if(pool != NULL){
+			render_pool_destroy(pool);
+		}
+		grating_params_release(&params);
+		fclose(file);
+		raise_without_gil(PyExc_MemoryError, NULL);
+		return 1;
+	}
+	fwrite(prologue, prologue_size, 1, file);
+	free(prologue);
+	size_t padding = container_frame_padding(&header);
+	uint64_t t;
+	int row, clock_status;
+	struct timespec time1, time2;
+	time1 = get_current_time(&clock_status);
+	for (t=0;t<frames_per_cycle && !clock_status;t++){
+		build_frame(frame, t, &params, fb0, roi->y, roi->y + roi->height, pool);
+		for(row = roi->y; row < roi->y + roi->height; row++){
+			fwrite(frame + row*fb0.width + roi->x, sizeof(uint16_t), roi->width, file);
+		}
+		fwrite(container_padding, padding, 1, file);
+		if(t==4){
+			time2 = get_current_time(&clock_status);
+			if(!clock_status){
+				printf("Expected time to completion: %ld seconds\n",(long)frames_per_cycle*cmp_times(time1,time2)/1000000/5);
+			}
+		}
+	}
+	render_pool_destroy(pool);
+	grating_params_release(&params);
+	free(frame);
+	fclose(file);
+	return clock_status ? -1 : 0;
+}
+
+void* stimulus_memory(stimulus* loaded){
+	//Where loaded's file, or its borrowed frames, are
+	return (loaded->mode & LOAD_BORROWED) ? loaded->borrowed.buf : (void*)(loaded->data);
+}
+
+int unload_stimulus(stimulus* loaded){
+	/*Called with the GIL, which releasing a borrowed buffer needs*/
+	if(loaded->mode & LOAD_LOCK){
+		munlock(stimulus_memory(loaded), loaded->size);
+	}
+	if(loaded->mode & LOAD_BORROWED){
+		PyBuffer_Release(&loaded->borrowed);
+	}else if(loaded->mode & LOAD_MMAP){
+		munmap(loaded->data, loaded->size);
+	}else{
+		free(loaded->data);
+	}
+	free(loaded->frames);
+	free(loaded);
+	return 0;
+}
+
+stimulus* load_stimulus(int filedes, char* filename, size_t size, int mode){
+	/*Reads the first size bytes of an open file into memory,
+	either copying them to the heap or, with LOAD_MMAP, mapping the
+	file so that pages are shared with the page cache and only read
+	when first displayed. Copies are page aligned, like mappings, so
+	a container's frames are too. Closes filedes. The reading is done
+	without the GIL so other Python threads can run meanwhile*/
+	struct stat file_stat;
+	if(fstat(filedes, &file_stat) == -1 || (size_t)file_stat.st_size < size){
+		PyErr_Format(PyExc_ValueError, "%s is shorter than its header says", filename);
+		close(filedes);
+		return NULL;
+	}
+	stimulus* loaded = malloc(sizeof(stimulus));
+	if(loaded == NULL){
+		close(filedes);
+		PyErr_NoMemory();
+		return NULL;
+	}
+	loaded->size = size;
+	loaded->mode = mode;
+	loaded->frames = NULL;
+	if(mode & LOAD_MMAP){
+		int flags = MAP_PRIVATE;
+		if(mode & LOAD_POPULATE){
+			flags |= MAP_POPULATE;
+		}
+		Py_BEGIN_ALLOW_THREADS
+		loaded->data = mmap(NULL, size, PROT_READ, flags, filedes, 0);
+		if(loaded->data != MAP_FAILED && (mode & LOAD_POPULATE)){
+			//MAP_POPULATE is only a hint on some kernels
+			madvise(loaded->data, size, MADV_WILLNEED);
+		}
+		Py_END_ALLOW_THREADS
+		if(loaded->data == MAP_FAILED){
+			PyErr_SetFromErrnoWithFilename(PyExc_OSError, filename);
+			free(loaded);
+			close(filedes);
+			return NULL;
+		}
+	}else{
+		//copy size bytes across using mmap, a chunk at a time
+		int page_size = getpagesize();
+		size_t bytes_already_read = 0;
+		size_t read_size;
+		if(posix_memalign((void**)&loaded->data, CONTAINER_ALIGN, size)){
+			free(loaded);
+			close(filedes);
+			PyErr_NoMemory();
+			return NULL;
+		}
+		int failed = 0;
+		Py_BEGIN_ALLOW_THREADS
+		while(bytes_already_read < size){
+			read_size = 20000*page_size;
+			if(read_size + bytes_already_read >= size){
+				read_size = size - bytes_already_read;
+			}
+			uint16_t *mmap_start = mmap(NULL, read_size,PROT_READ,MAP_PRIVATE,
+							filedes,bytes_already_read);
+			if(mmap_start == MAP_FAILED){
+				failed = errno;
+				break;
+			}
+			//Copy read_size bytes across
+			memcpy(loaded->data+(bytes_already_read/2),mmap_start,read_size);
+			bytes_already_read += read_size;
+			munmap(mmap_start,read_size);
+		}
+		Py_END_ALLOW_THREADS
+		if(failed){
+			errno = failed;
+			PyErr_SetFromErrnoWithFilename(PyExc_OSError, filename);
+			free(loaded->data);
+			free(loaded);
+			close(filedes);
+			return NULL;
+		}
+	}
+	close(filedes);
+	int locked = 0;
+	if(mode & LOAD_LOCK){
+		Py_BEGIN_ALLOW_THREADS
+		locked = mlock(loaded->data, size);
+		Py_END_ALLOW_THREADS
+	}
+	if(locked == -1){
+		PyErr_Format(PyExc_OSError, "Could not lock %s in memory (%s), try raising ulimit -l",
+				filename, strerror(errno));
+		loaded->mode &= ~LOAD_LOCK;
+		unload_stimulus(loaded);
+		return NULL;
+	}
+	return loaded;
+}
+
+int index_stimulus(stimulus* loaded, int kind, fb_config fb0, char* filename){
+	/*Works out how many frames loaded has and where each one is,
+	from whichever of the container or legacy headers its file starts
+	with. Raises ValueError, returning 1, if it can't be shown on fb0*/
+	char* data = (char*)loaded->data;
+	size_t first = 0;
+	uint64_t* index = NULL;
+	full_screen_roi(&loaded->roi, fb0);
+	if(loaded->size >= sizeof(fileheader_v2) && ((fileheader_v2*)data)->magic == CONTAINER_MAGIC){
+		fileheader_v2* header = (fileheader_v2*)data;
+		if(check_container(header, loaded->size, kind, fb0, filename)){
+			return 1;
+		}
+		container_roi(header, &loaded->roi);
+		index = (uint64_t*)(data + header->index_offset);
+		if(check_container_index(index, header, loaded->size, filename)){
+			return 1;
+		}
+		loaded->n_frames = header->n_frames;
+		loaded->stored_frames = header->stored_frames;
+		loaded->refresh_per_frame = kind == CONTAINER_RAW ? header->refresh_per_frame : 1;
+	}else if(kind == CONTAINER_GRATING && is_rowshift(data)){
+		//drawn by rowshift_frame() rather than copied from frames
+		fileheader_rowshift* header = (fileheader_rowshift*)data;
+		rowshift_grating grating;
+		if(check_rowshift(header, loaded->size, fb0, filename)){
+			return 1;
+		}
+		rowshift_parse(data, &grating);
+		if(check_rowshift_data(&grating, filename)){
+			return 1;
+		}
+		loaded->n_frames = header->n_frames;
+		loaded->stored_frames = header->frames_per_cycle;
+		loaded->refresh_per_frame = 1;
+		return 0;
+	}else if(kind == CONTAINER_GRATING){
+		fileheader_t* header = (fileheader_t*)data;
+		loaded->n_frames = header->n_frames;
+		loaded->stored_frames = header->frames_per_cycle;
+		loaded->refresh_per_frame = 1;
+		first = sizeof(fileheader_t);
+	}else{
+		fileheader_raw* header = (fileheader_raw*)data;
+		if(loaded->size < sizeof(fileheader_raw)){
+			PyErr_Format(PyExc_ValueError, "%s is too short to be a raw file", filename);
+			return 1;
+		}
+		if(header->width != (int32_t)fb0.width || header->height != (int32_t)fb0.height){
+			PyErr_Format(PyExc_ValueError, "%s is %dx%d, but the screen is %dx%d",
+					filename, header->width, header->height, fb0.width, fb0.height);
+			return 1;
+		}
+		if(header->n_frames <= 0 || header->refresh_per_frame <= 0){
+			PyErr_Format(PyExc_ValueError, "%s has no frames to play", filename);
+			return 1;
+		}
+		if((loaded->size - sizeof(fileheader_raw))/fb0.size < (size_t)header->n_frames){
+			PyErr_Format(PyExc_ValueError, "%s is shorter than its header says", filename);
+			return 1;
+		}
+		loaded->n_frames = header->n_frames;
+		loaded->stored_frames = header->n_frames;
+		loaded->refresh_per_frame = header->refresh_per_frame;
+		first = sizeof(fileheader_raw);
+	}
+	if(loaded->stored_frames == 0){
+		PyErr_Format(PyExc_ValueError, "%s has no frames to play", filename);
+		return 1;
+	}
+	loaded->frames = malloc(loaded->stored_frames*sizeof(uint16_t*));
+	if(loaded->frames == NULL){
+		PyErr_NoMemory();
+		return 1;
+	}
+	long i;
+	for(i = 0; i < loaded->stored_frames; i++){
+		loaded->frames[i] = (uint16_t*)(data + (index != NULL ? index[i] : first + (size_t)(i)*fb0.size));
+	}
+	return 0;
+}
+
+stimulus* load_grating(char* filename, fb_config fb0, int mode){
+	int filedes = open(filename, O_RDONLY);
+	if(filedes == -1){
+		perror("Failed to open file");
+		return NULL;
+	}
+	//Start by reading the header so we can determine the filesize...
+	union {
+		fileheader_t frames;
+		fileheader_rowshift rowshift;
+		fileheader_v2 v2;
+	} header;
+	memset(&header, 0, sizeof(header));
+	struct stat file_stat;
+	if(fstat(filedes, &file_stat) == -1 ||
+			pread(filedes, &header, sizeof(header), 0) < (ssize_t)sizeof(fileheader_t)){
+		PyErr_Format(PyExc_ValueError, "%s is too short to be a grating", filename);
+		close(filedes);
+		return NULL;
+	}
+	int file_fps;
+	size_t file_size = file_stat.st_size;
+	if(header.v2.magic == CONTAINER_MAGIC){
+		file_fps = header.v2.frames_per_second;
+	}else if(is_rowshift(&header)){
+		if(check_rowshift(&header.rowshift, file_size, fb0, filename)){
+			close(filedes);
+			return NULL;
+		}
+		file_fps = header.rowshift.frames_per_second;
+	}else{
+		//a legacy file, which is only as long as its frames
+		file_fps = header.frames.frames_per_second;
+		file_size = (size_t)(header.frames.frames_per_cycle)*fb0.size + sizeof(fileheader_t);
+	}
+	if (fb0.refresh_rate != file_fps) {
+		printf("File generated at %d FPS, but monitor running at %d HZ. This will cause inaccurate timing \n", file_fps, fb0.refresh_rate);
+	}
+	stimulus* loaded = load_stimulus(filedes, filename, file_size, mode);
+	if(loaded != NULL && index_stimulus(loaded, CONTAINER_GRATING, fb0, filename)){
+		unload_stimulus(loaded);
+		return NULL;
+	}
+	return loaded;
+}
+
+
+stimulus* load_raw(char* filename, fb_config fb0, int mode) {
+	int fh = open(filename, O_RDONLY);
+	if(fh == -1) {
+		perror("Failed to open file");
+		return NULL;
+	}
+	off_t len = lseek(fh, 0, SEEK_END);
+	if (len == -1) {
+		printf("Checking File Length Failed.\n");
+		close(fh);
+		return NULL;
+	}
+	stimulus* loaded = load_stimulus(fh, filename, len, mode);
+	if (loaded != NULL && index_stimulus(loaded, CONTAINER_RAW, fb0, filename)) {
+		unload_stimulus(loaded);
+		return NULL;
+	}
+	return loaded;
+}
+
+stimulus* raw_from_buffer(PyObject* source, fb_config fb0, int refresh_per_frame) {
+	/*A raw whose frames are source's buffer of RGB565 pixels, used
+	in place. The buffer is held until unload_stimulus(), which keeps
+	source alive and, for types like bytearray, stops it being resized.
+	Called with the GIL*/
+	stimulus* raw = calloc(1, sizeof(stimulus));
+	if (raw == NULL) {
+		PyErr_NoMemory();
+		return NULL;
+	}
+	if (PyObject_GetBuffer(source, &raw->borrowed, PyBUF_C_CONTIGUOUS) == -1) {
+		free(raw);
+		return NULL;
+	}
+	size_t frame_size = fb0.size;
+	Py_ssize_t length = raw->borrowed.len;
+	if (raw->borrowed.itemsize != 2 || length == 0 || length % frame_size != 0 || refresh_per_frame <= 0) {
+		PyErr_Format(PyExc_ValueError, "Expected whole %dx%d frames of 16 bit pixels and refresh_per_frame > 0, "
+				"got %zd bytes of %zd byte items", fb0.width, fb0.height, length, raw->borrowed.itemsize);
+		PyBuffer_Release(&raw->borrowed);
+		free(raw);
+		return NULL;
+	}
+	long n_frames = length / frame_size;
+	raw->frames = n_frames <= INT_MAX ? malloc(n_frames*sizeof(uint16_t*)) : NULL;
+	if (raw->frames == NULL) {
+		PyBuffer_Release(&raw->borrowed);
+		free(raw);
+		PyErr_NoMemory();
+		return NULL;
+	}
+	long i;
+	for (i = 0; i < n_frames; i++) {
+		raw->frames[i] = (uint16_t*)((char*)raw->borrowed.buf + i*frame_size);
+	}
+	raw->data = NULL;
+	full_screen_roi(&raw->roi, fb0);
+	raw->n_frames = n_frames;
+	raw->stored_frames = n_frames;
+	raw->refresh_per_frame = refresh_per_frame;
+	raw->size = length;
+	raw->mode = LOAD_BORROWED;
+	return raw;
+}
+
+int read_fully(int file, void* buffer, size_t size, off_t offset){
+	//pread() all of size bytes, returning 0, errno, or -1 at end of file
+	char* at = buffer;
+	while (size > 0) {
+		ssize_t got = pread(file, at, size, offset);
+		if (got == -1 && errno == EINTR) {
+			continue;
+		}
+		if (got <= 0) {
+			return got == 0 ? -1 : errno;
+		}
+		at += got;
+		offset += got;
+		size -= got;
+	}
+	return 0;
+}
+
+int write_fully(int file, const void* buffer, size_t size){
+	//write() all of size bytes, returning 0 or errno
+	const char* at = buffer;
+	while (size > 0) {
+		ssize_t put = write(file, at, size);
+		if (put == -1 && errno == EINTR) {
+			continue;
+		}
+		if (put == -1) {
+			return errno;
+		}
+		at += put;
+		size -= put;
+	}
+	return 0;
+}
+
+int pack_rgb888_file(int destination, int source, const uint8_t* rgb, size_t first, size_t n_pixels){
+	/*Packs n_pixels of RGB888, from pixel first on, to RGB565 with
+	kernels->pack_rgb888 and writes them to destination, CONVERT_CHUNK
+	pixels at a time. They are read from source, or taken from rgb if
+	it isn't NULL. Returns 0, errno, or -1 if source ended early*/
+	uint16_t* packed = malloc(CONVERT_CHUNK*sizeof(uint16_t));
+	uint8_t* unpacked = rgb == NULL ? malloc(3*CONVERT_CHUNK) : NULL;
+	int error = 0;
+	if (packed == NULL || (rgb == NULL && unpacked == NULL)) {
+		error = ENOMEM;
+	}
+	size_t done, n;
+	for (done = first; done < first + n_pixels && !error; done += n) {
+		n = first + n_pixels - done < CONVERT_CHUNK ? first + n_pixels - done : CONVERT_CHUNK;
+		const uint8_t* chunk = unpacked;
+		if (rgb == NULL) {
+			error = read_fully(source, unpacked, 3*n, 3*done);
+		} else {
+			chunk = rgb + 3*done;
+		}
+		if (!error) {
+			kernels->pack_rgb888(packed, chunk, n);
+			error = write_fully(destination, packed, n*sizeof(uint16_t));
+		}
+	}
+	free(packed);
+	free(unpacked);
+	return error;
+}
+
+int write_raw(char* new_filename, fileheader_v2* header, int source, const uint8_t* rgb){
+	/*Writes a raw container of header's frames, packed from the
+	source file or the rgb buffer as pack_rgb888_file(). Runs without
+	the GIL, so errors are raised with raise_without_gil. A file that
+	couldn't be finished is removed*/
+	size_t prologue_size;
+	char* prologue = container_prologue(header, &prologue_size);
+	if (prologue == NULL) {
+		raise_without_gil(PyExc_MemoryError, NULL);
+		return 1;
+	}
+	int destination = open(new_filename, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+	if (destination == -1) {
+		raise_without_gil(PyExc_OSError, "Could not create %s (%s)", new_filename, strerror(errno));
+		free(prologue);
+		return 1;
+	}
+	int error = write_fully(destination, prologue, prologue_size);
+	free(prologue);
+	size_t frame_pixels = header->frame_size/sizeof(uint16_t);
+	size_t padding = container_frame_padding(header);
+	uint64_t frame;
+	for (frame = 0; frame < header->stored_frames && !error; frame++) {
+		error = pack_rgb888_file(destination, source, rgb, frame*frame_pixels, frame_pixels);
+		if (!error) {
+			error = write_fully(destination, container_padding, padding);
+		}
+	}
+	if (close(destination) == -1 && !error) {
+		error = errno;
+	}
+	if (error) {
+		raise_without_gil(PyExc_OSError, "Could not convert to %s (%s)", new_filename,
+				error == -1 ? "the source ended early" : strerror(error));
+		unlink(new_filename);
+		return 1;
+	}
+	return 0;
+}
+
+int raw_header(fileheader_v2* header, size_t n_pixels, int n_frames, int width, int height, int refresh_per_frame, const char* source){
+	/*Sets up the header of a raw container, raising ValueError
+	unless there are enough pixels for every frame it promises*/
+	if (n_frames <= 0 || width <= 0 || height <= 0 || refresh_per_frame <= 0) {
+		raise_without_gil(PyExc_ValueError, "n_frames, width, height and refreshes_per_frame must all be positive");
+		return 1;
+	}
+	if (n_pixels/width/height < (size_t)n_frames) {
+		raise_without_gil(PyExc_ValueError, "%s holds %zu pixels, fewer than %d frames of %dx%d",
+				source, n_pixels, n_frames, width, height);
+		return 1;
+	}
+	fb_config frame;
+	frame.width = width;
+	frame.height = height;
+	frame.size = (size_t)(width)*height*sizeof(uint16_t);
+	container_init(header, CONTAINER_RAW, frame, n_frames, n_frames);
+	header->refresh_per_frame = refresh_per_frame;
+	return 0;
+}
+
+int convert_raw(char* filename, char* new_filename, int n_frames, int width, int height, int refresh_per_frame) {
+	/*Converts n_frames frames of an RGB888 file to a raw container.
+	Runs without the GIL*/
+	int source = open(filename, O_RDONLY|O_CLOEXEC);
+	if (source == -1) {
+		raise_without_gil(PyExc_OSError, "Could not open %s (%s)", filename, strerror(errno));
+		return 1;
+	}
+	struct stat source_stat;
+	if (fstat(source, &source_stat) == -1) {
+		raise_without_gil(PyExc_OSError, "Could not read the size of %s (%s)", filename, strerror(errno));
+		close(source);
+		return 1;
+	}
+	fileheader_v2 header;
+	if (raw_header(&header, source_stat.st_size/3, n_frames, width, height, refresh_per_frame, filename)) {
+		close(source);
+		return 1;
+	}
+	posix_fadvise(source, 0, 0, POSIX_FADV_SEQUENTIAL);
+	int status = write_raw(new_filename, &header, source, NULL);
+	close(source);
+	return status;
+}
+
+int convert_raw_buffer(const uint8_t* rgb, size_t size, char* new_filename, int n_frames, int width, int height, int refresh_per_frame) {
+	//convert_raw() from size bytes of RGB888 in memory
+	fileheader_v2 header;
+	if (raw_header(&header, size/3, n_frames, width, height, refresh_per_frame, "The buffer")) {
+		return 1;
+	}
+	return write_raw(new_filename, &header, -1, rgb);
+}
+
+/*Copying frames into the framebuffer. Framebuffer memory is
+uncached or write-combined on most hardware, so the fastest way to
+fill it depends on the machine: init() times each of these copying
+a frame into the back buffer and keeps the fastest in fb_config.*/
+
+typedef struct blitter {
+	const char* name;
+	void (*copy)(uint16_t* dst, const uint16_t* src, size_t bytes);
+} blitter;
+
+void blit_memcpy(uint16_t* dst, const uint16_t* src, size_t bytes){
+	memcpy(dst, src, bytes);
+}
+
+#ifdef RPG_NEON
+void blit_neon(uint16_t* dst, const uint16_t* src, size_t bytes){
+	//64 bytes per iteration, four loads then four stores
+	size_t n = bytes/2;
+	size_t i;
+	for(i = 0; i + 32 <= n; i += 32){
+		uint16x8_t a = vld1q_u16(src + i);
+		uint16x8_t b = vld1q_u16(src + i + 8);
+		uint16x8_t c = vld1q_u16(src + i + 16);
+		uint16x8_t d = vld1q_u16(src + i + 24);
+		vst1q_u16(dst + i, a);
+		vst1q_u16(dst + i + 8, b);
+		vst1q_u16(dst + i + 16, c);
+		vst1q_u16(dst + i + 24, d);
+	}
+	memcpy(dst + i, src + i, (n - i)*2);
+}
+#endif
+
+#ifdef RPG_X86
+__attribute__((target("sse2")))
+void blit_stream(uint16_t* dst, const uint16_t* src, size_t bytes){
+	//Non-temporal stores skip the cache, so the frame doesn't evict the stimulus
+	size_t n = bytes/2;
+	size_t i = 0;
+	while(i < n && ((uintptr_t)(dst + i) & 15)){
+		dst[i] = src[i];
+		i++;
+	}
+	for(; i + 32 <= n; i += 32){
+		__m128i a = _mm_loadu_si128((__m128i*)(src + i));
+		__m128i b = _mm_loadu_si128((__m128i*)(src + i + 8));
+		__m128i c = _mm_loadu_si128((__m128i*)(src + i + 16));
+		__m128i d = _mm_loadu_si128((__m128i*)(src + i + 24));
+		_mm_stream_si128((__m128i*)(dst + i), a);
+		_mm_stream_si128((__m128i*)(dst + i + 8), b);
+		_mm_stream_si128((__m128i*)(dst + i + 16), c);
+		_mm_stream_si128((__m128i*)(dst + i + 24), d);
+	}
+	_mm_sfence();
+	memcpy(dst + i, src + i, (n - i)*2);
+}
+#elif defined(__aarch64__)
+void blit_stream(uint16_t* dst, const uint16_t* src, size_t bytes){
+	//Non-temporal stores skip the cache, so the frame doesn't evict the stimulus
+	size_t n = bytes/2;
+	size_t i;
+	for(i = 0; i + 32 <= n; i += 32){
+		uint16x8_t a = vld1q_u16(src + i);
+		uint16x8_t b = vld1q_u16(src + i + 8);
+		uint16x8_t c = vld1q_u16(src + i + 16);
+		uint16x8_t d = vld1q_u16(src + i + 24);
+		__asm__ volatile("stnp %q1, %q2, [%0]\n\t"
+				"stnp %q3, %q4, [%0, #32]"
+				: : "r"(dst + i), "w"(a), "w"(b), "w"(c), "w"(d) : "memory");
+	}
+	memcpy(dst + i, src + i, (n - i)*2);
+}
+#endif
+
+blitter memcpy_blitter = {"memcpy", blit_memcpy};
+#ifdef RPG_NEON
+blitter neon_blitter = {"neon", blit_neon};
+#endif
+#if defined(RPG_X86) || defined(__aarch64__)
+blitter stream_blitter = {"stream", blit_stream};
+#endif
+
+blitter* choose_blitter(uint16_t* dst, size_t bytes, long* blit_usecs){
+	/*Times each blitter copying bytes into dst, and returns the
+	fastest. Each gets a few tries, so page faults and the like on
+	the first copy don't count against it*/
+	blitter* candidates[4];
+	int n_candidates = 0;
+	candidates[n_candidates++] = &memcpy_blitter;
+#ifdef RPG_NEON
+	if(pixel_kernels_supported(&neon_kernels)){
+		candidates[n_candidates++] = &neon_blitter;
+	}
+#endif
+#if defined(RPG_X86)
+	if(__builtin_cpu_supports("sse2")){
+		candidates[n_candidates++] = &stream_blitter;
+	}
+#elif defined(__aarch64__)
+	candidates[n_candidates++] = &stream_blitter;
+#endif
+	*blit_usecs = 0;
+	uint16_t* src = malloc(bytes);
+	if(src == NULL){
+		return &memcpy_blitter;
+	}
+	memset(src, 0, bytes);
+	blitter* fastest = &memcpy_blitter;
+	long fastest_usecs = -1;
+	int i, rep, clock_status;
+	for(i = 0; i < n_candidates; i++){
+		for(rep = 0; rep < 4; rep++){
+			struct timespec start = get_current_time(&clock_status);
+			candidates[i]->copy(dst, src, bytes);
+			struct timespec end = get_current_time(&clock_status);
+			long usecs = cmp_times(start, end);
+			if(fastest_usecs == -1 || usecs < fastest_usecs){
+				fastest = candidates[i];
+				fastest_usecs = usecs;
+			}
+		}
+	}
+	free(src);
+	*blit_usecs = fastest_usecs;
+	return fastest;
+}
+
+void fill_pixels(uint16_t* dst, uint16_t pixel, size_t n){
+	size_t i;
+	for(i = 0; i < n; i++){
+		dst[i] = pixel;
+	}
+}
+
+void blit_frame(fb_config fb0, uint16_t* write_loc, screen_roi* roi, const uint16_t* frame, int fill){
+	/*Copies frame into its roi of the buffer at write_loc, a row at a
+	time unless it's as wide as the screen. With fill, the rest of the
+	buffer is set to the background first, which only needs doing the
+	first time a stimulus is drawn into each buffer*/
+	uint16_t* top_left = write_loc + (size_t)(roi->y)*fb0.width + roi->x;
+	size_t row_bytes = roi->width*sizeof(uint16_t);
+	int row;
+	if(fill){
+		uint16_t* end = top_left + (size_t)(roi->height - 1)*fb0.width + roi->width;
+		fill_pixels(write_loc, roi->background, top_left - write_loc);
+		for(row = 1; row < roi->height; row++){
+			fill_pixels(top_left + (size_t)(row - 1)*fb0.width + roi->width, roi->background, fb0.width - roi->width);
+		}
+		fill_pixels(end, roi->background, write_loc + fb0.size/2 - end);
+	}
+	if(roi->width == fb0.width){
+		fb0.blit->copy(top_left, frame, row_bytes*roi->height);
+		return;
+	}
+	for(row = 0; row < roi->height; row++){
+		fb0.blit->copy(top_left + (size_t)(row)*fb0.width, frame + (size_t)(row)*roi->width, row_bytes);
+	}
+}
+
+int64_t monotonic_ns(void){
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_nsec + 1000000000*(int64_t)(t.tv_sec);
+}
+
+int display_cancelled(fb_config fb0){
+	/*Whether cancel_trigger() has been called since this last
+	returned 1. One read of a nonblocking eventfd, cheap enough to
+	check once a frame*/
+	uint64_t cancels;
+	return read(fb0.cancel_fd, &cancels, sizeof(cancels)) > 0;
+}
+
+int poll_for_trigger(fb_config fb0, int trig_pin, int64_t* edge_ns){
+	/*wait_for_trigger() for backends without edge descriptors:
+	reads the pin every TRIGGER_POLL_MS, sleeping in poll() on
+	fb0.cancel_fd and the terminal in between*/
+	struct pollfd fds[2] = {{fb0.cancel_fd, POLLIN, 0}, {STDIN_FILENO, POLLIN, 0}};
+	int n_fds = fb0.keyboard && isatty(STDIN_FILENO) ? 2 : 1;
+	int level;
+	while ((level = fb0.backend->read_pin(&fb0, trig_pin)) == 0) {
+		if ((fb0.keyboard && kbhit()) || display_cancelled(fb0)) {
+			return 1;
+		}
+		if (poll(fds, n_fds, TRIGGER_POLL_MS) == -1 && errno == EINTR) {
+			return 1;
+		}
+		if (n_fds == 2 && fds[1].revents && !kbhit()) {
+			n_fds = 1; //end of file or hang up, not a key
+		}
+	}
+	if (level == -1) {
+		raise_without_gil(PyExc_OSError, "The %s backend can't read trigger pins", fb0.backend->name);
+		return -1;
+	}
+	*edge_ns = monotonic_ns();
+	return 0;
+}
+
+int wait_for_trigger(fb_config fb0, int trig_pin, int64_t* edge_ns){
+	/*Waits for trig_pin to go high, sleeping in poll() on the
+	pin's edge descriptor, fb0.cancel_fd and, if fb0.keyboard is set,
+	the terminal. Returns 0 once it has, with edge_ns set to when, 1
+	if a key was pressed,
+	the wait was cancelled or a signal arrived first, or -1 with a
+	Python error set. Like the display functions, it's called
+	without holding the GIL*/
+	*edge_ns = 0;
+	fb0.backend->pin_mode(&fb0, 1, OUTPUT);
+	fb0.backend->write_pin(&fb0, 1, LOW);
+	if (trig_pin <= 0) {
+		return 0;
+	}
+	fb0.backend->pin_mode(&fb0, trig_pin, INPUT);
+	int edges = fb0.backend->edge_fd(&fb0, trig_pin);
+	if (edges == -1) {
+		return poll_for_trigger(fb0, trig_pin, edge_ns);
+	}
+	//Edges from before the wait don't count, but a pin that's already high does
+	while (fb0.backend->edge_time(&fb0, edges) != -1) {
+	}
+	if (fb0.keyboard && kbhit()) {
+		return 1;
+	}
+	if (fb0.backend->read_pin(&fb0, trig_pin) == 1) {
+		*edge_ns = monotonic_ns();
+		return 0;
+	}
+	struct pollfd fds[3] = {{edges, POLLIN, 0}, {fb0.cancel_fd, POLLIN, 0}, {STDIN_FILENO, POLLIN, 0}};
+	int n_fds = fb0.keyboard && isatty(STDIN_FILENO) ? 3 : 2;
+	while (1) {
+		if (poll(fds, n_fds, -1) == -1) {
+			if (errno == EINTR) {
+				return 1;
+			}
+			raise_without_gil(PyExc_OSError, "Waiting for the trigger failed (%s)", strerror(errno));
+			return -1;
+		}
+		if (fds[0].revents & POLLIN) {
+			int64_t t = fb0.backend->edge_time(&fb0, edges);
+			if (t != -1) {
+				*edge_ns = t;
+				return 0;
+			}
+		}
+		if ((fds[1].revents & POLLIN) && display_cancelled(fb0)) {
+			return 1;
+		}
+		if (n_fds == 3 && fds[2].revents) {
+			if (kbhit()) {
+				return 1;
+			}
+			n_fds = 2; //end of file or hang up, not a key
+		}
+	}
+}
+
+void summarise_trace(frame_record* trace, int n_frames, int refreshes_per_frame, int refresh_rate,
+		int64_t edge_ns, display_summary* summary){
+	/*Fills in vsync_count from the vsync times, then summarises
+	the trace. A frame whose vsync came more than refreshes_per_frame
+	refresh periods after the previous frame's missed the difference.
+	edge_ns is when the trigger arrived, or 0 if there wasn't one*/
+	long interframe[n_frames > 1 ? n_frames-1 : 1];
+	long copy[n_frames > 0 ? n_frames : 1];
+	long flip[n_frames > 0 ? n_frames : 1];
+	double period = 1e9 / refresh_rate;
+	int t;
+	summary->missed_vsyncs = 0;
+	for (t = 0; t < n_frames; t++) {
+		trace[t].vsync_count = llround((trace[t].vsync_ns - trace[0].vsync_ns) / period);
+		copy[t] = trace[t].copy_us;
+		flip[t] = trace[t].flip_us;
+		if (t != 0) {
+			interframe[t-1] = (trace[t].start_ns - trace[t-1].start_ns)/1000;
+			int64_t gap = trace[t].vsync_count - trace[t-1].vsync_count;
+			if (gap > refreshes_per_frame) {
+				summary->missed_vsyncs += gap - refreshes_per_frame;
+			}
+		}
+	}
+	summary->mean_interframe = mean_long(interframe, n_frames-1);
+	summary->std_interframe = std_long(interframe, n_frames-1);
+	summary->mean_copy = mean_long(copy, n_frames);
+	summary->max_copy = max_long(copy, n_frames);
+	summary->mean_flip = mean_long(flip, n_frames);
+	summary->max_flip = max_long(flip, n_frames);
+	summary->trigger_ns = edge_ns;
+	summary->trigger_latency = 0;
+	if (edge_ns != 0 && n_frames > 0) {
+		summary->trigger_latency = (trace[0].flip_ns - edge_ns)/1000.0;
+	}
+}
+
+int display_raw(uint16_t *data, fb_config fb0, int trig_pin, frame_record* trace, display_summary* summary) {
+	/*Plays the raw stimulus passed as data, recording each of its
+	n_frames frames in trace. Returns 0 once played, 1 if a key
+	was pressed while waiting for the trigger or cancel_trigger() was
+	called before the last frame, or -1 with a Python error set*/
+	int64_t edge_ns;
+	int status = wait_for_trigger(fb0, trig_pin, &edge_ns);
+	if (status) {
+		return status;
+	}
+	stimulus* raw = (stimulus*)data;
+
+	uint16_t *write_loc;
+	int t, buffer, waits;
+	write_loc = fb0.map + fb0.size/2;
+
+	int n_frames = raw->n_frames;
+	int refresh_per_frame = raw->refresh_per_frame;
+	for (t = 0; t < n_frames; t++) {
+		trace[t].start_ns = monotonic_ns();
+
+		buffer = (t+1)%2;
+		blit_frame(fb0, write_loc, &raw->roi, raw->frames[t % raw->stored_frames], t < 2);
+		trace[t].flip_ns = monotonic_ns();
+		flip_buffer(buffer, fb0);
+		trace[t].vsync_ns = monotonic_ns();
+		trace[t].copy_us = (trace[t].flip_ns - trace[t].start_ns)/1000;
+		trace[t].flip_us = (trace[t].vsync_ns - trace[t].flip_ns)/1000;
+		for (waits = 0; waits < refresh_per_frame; waits++) {
+			wait_vsync(fb0);
+		}
+		trace[t].vsync_ns = monotonic_ns();
+		if(!buffer) {
+			write_loc = fb0.map + fb0.size/2;
+			fb0.backend->write_pin(&fb0, 1, HIGH);
+		} else {
+			write_loc = fb0.map;
+			fb0.backend->write_pin(&fb0, 1, LOW);
+		}
+		if (display_cancelled(fb0)) {
+			return 1;
+		}
+	}
+	summarise_trace(trace, n_frames, refresh_per_frame, fb0.refresh_rate, edge_ns, summary);
+	return 0;
+}
+
+/*Streaming raw files. A raw movie takes fb0.size bytes a frame, so a
+long one doesn't fit in RAM. display_raw_stream() plays one from disc
+instead, through a ring of frames that a reader thread keeps filled
+ahead of the display loop.*/
+
+typedef struct {
+	int file;
+	long n_frames;
+	int refresh_per_frame;
+	uint64_t* offsets; //where each frame is in the file
+	size_t frame_size;
+	int ring_frames;
+	uint16_t* ring;
+	long head; //frames read into the ring so far
+	long tail; //frames the display has finished with
+	int stop;
+	int error; //errno of a failed read, -1 if the file ended early, or 0
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	pthread_t reader;
+	int underruns; //frames that weren't read by the time they were due
+	int min_buffered; //fewest frames the ring held ahead of the display
+} raw_stream;
+
+void* raw_stream_reader(void* arg){
+	raw_stream* stream = arg;
+	off_t frame_size = stream->frame_size;
+	long frame;
+	pthread_mutex_lock(&stream->lock);
+	for (frame = 0; frame < stream->n_frames; frame++) {
+		while (frame - stream->tail == stream->ring_frames && !stream->stop) {
+			pthread_cond_wait(&stream->changed, &stream->lock);
+		}
+		if (stream->stop) {
+			break;
+		}
+		pthread_mutex_unlock(&stream->lock);
+		off_t offset = stream->offsets[frame];
+		//Have the kernel read the frame a ring further on meanwhile, and
+		//drop this one from the page cache once it's in the ring, so a
+		//movie longer than RAM doesn't push everything else out
+		if (frame + stream->ring_frames < stream->n_frames) {
+			posix_fadvise(stream->file, stream->offsets[frame + stream->ring_frames], frame_size,
+					POSIX_FADV_WILLNEED);
+		}
+		int error = read_fully(stream->file, stream->ring + (frame % stream->ring_frames)*frame_size/2,
+				frame_size, offset);
+		posix_fadvise(stream->file, offset, frame_size, POSIX_FADV_DONTNEED);
+		pthread_mutex_lock(&stream->lock);
+		if (error) {
+			stream->error = error;
+			pthread_cond_broadcast(&stream->changed);
+			break;
+		}
+		stream->head = frame + 1;
+		pthread_cond_broadcast(&stream->changed);
+	}
+	pthread_mutex_unlock(&stream->lock);
+	return NULL;
+}
+
+int raw_stream_index(raw_stream* stream, char* filename, fb_config fb0){
+	/*Reads how many frames a raw container or legacy raw file has,
+	and where each one is, as index_stimulus() does for loaded files.
+	Raises ValueError, returning 1, if it can't be played on fb0*/
+	int file = stream->file;
+	struct stat file_stat;
+	union {
+		fileheader_raw legacy;
+		fileheader_v2 v2;
+	} header;
+	memset(&header, 0, sizeof(header));
+	if (fstat(file, &file_stat) == -1 ||
+			pread(file, &header, sizeof(header), 0) < (ssize_t)sizeof(fileheader_raw)) {
+		PyErr_Format(PyExc_ValueError, "%s is too short to be a raw file", filename);
+		return 1;
+	}
+	uint64_t file_size = file_stat.st_size;
+	long i;
+	if (header.v2.magic == CONTAINER_MAGIC) {
+		screen_roi roi;
+		container_roi(&header.v2, &roi);
+		if (check_container(&header.v2, file_size, CONTAINER_RAW, fb0, filename)) {
+			return 1;
+		}
+		if (roi.width != fb0.width || roi.height != fb0.height) {
+			PyErr_Format(PyExc_ValueError, "%s only covers part of the screen, so load it with load_raw() instead", filename);
+			return 1;
+		}
+		stream->n_frames = header.v2.n_frames;
+		stream->refresh_per_frame = header.v2.refresh_per_frame;
+		stream->offsets = malloc(header.v2.stored_frames*sizeof(uint64_t));
+		if (stream->offsets == NULL) {
+			PyErr_NoMemory();
+			return 1;
+		}
+		int error = read_fully(file, stream->offsets, header.v2.stored_frames*sizeof(uint64_t), header.v2.index_offset);
+		if (error == -1) {
+			//it was cut short since check_container() saw its size
+			PyErr_Format(PyExc_ValueError, "%s is truncated: its frame index ends early", filename);
+			return 1;
+		}
+		if (error) {
+			errno = error;
+			PyErr_SetFromErrnoWithFilename(PyExc_OSError, filename);
+			return 1;
+		}
+		if (check_container_index(stream->offsets, &header.v2, file_size, filename)) {
+			return 1;
+		}
+		if (header.v2.stored_frames < header.v2.n_frames) {
+			PyErr_Format(PyExc_ValueError, "%s loops its frames, so load it with load_raw() instead", filename);
+			return 1;
+		}
+		return 0;
+	}
+	fileheader_raw* legacy = &header.legacy;
+	if (legacy->width != (int32_t)fb0.width || legacy->height != (int32_t)fb0.height) {
+		PyErr_Format(PyExc_ValueError, "%s is %dx%d, but the screen is %dx%d",
+				filename, legacy->width, legacy->height, fb0.width, fb0.height);
+	} else if (legacy->n_frames <= 0 || legacy->refresh_per_frame <= 0) {
+		PyErr_Format(PyExc_ValueError, "%s has no frames to play", filename);
+	} else if ((file_size - sizeof(fileheader_raw))/stream->frame_size < (uint64_t)legacy->n_frames) {
+		PyErr_Format(PyExc_ValueError, "%s is shorter than its header says", filename);
+	}
+	if (PyErr_Occurred()) {
+		return 1;
+	}
+	stream->n_frames = legacy->n_frames;
+	stream->refresh_per_frame = legacy->refresh_per_frame;
+	stream->offsets = malloc(stream->n_frames*sizeof(uint64_t));
+	if (stream->offsets == NULL) {
+		PyErr_NoMemory();
+		return 1;
+	}
+	for (i = 0; i < stream->n_frames; i++) {
+		stream->offsets[i] = sizeof(fileheader_raw) + i*stream->frame_size;
+	}
+	return 0;
+}
+
+raw_stream* raw_stream_open(char* filename, fb_config fb0, int ring_frames){
+	/*Opens a raw file for display_raw_stream() and starts reading
+	it into a ring of ring_frames frames. Called with the GIL*/
+	int file = open(filename, O_RDONLY);
+	if (file == -1) {
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError, filename);
+		return NULL;
+	}
+	raw_stream* stream = calloc(1, sizeof(raw_stream));
+	if (stream == NULL) {
+		close(file);
+		PyErr_NoMemory();
+		return NULL;
+	}
+	stream->file = file;
+	stream->frame_size = fb0.size;
+	if (raw_stream_index(stream, filename, fb0)) {
+		free(stream->offsets);
+		close(file);
+		free(stream);
+		return NULL;
+	}
+	if (ring_frames > stream->n_frames) {
+		ring_frames = stream->n_frames;
+	}
+	stream->ring_frames = ring_frames;
+	stream->ring = mmap(NULL, ring_frames*stream->frame_size, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (stream->ring == MAP_FAILED) {
+		free(stream->offsets);
+		close(file);
+		free(stream);
+		PyErr_NoMemory();
+		return NULL;
+	}
+	if (fb0.realtime.priority != 0 && fb0.realtime.lock) {
+		//as lock_stimulus() does for loaded stimuli, if the limit allows
+		mlock(stream->ring, ring_frames*stream->frame_size);
+	}
+	posix_fadvise(file, 0, 0, POSIX_FADV_SEQUENTIAL);
+	pthread_mutex_init(&stream->lock, NULL);
+	pthread_cond_init(&stream->changed, NULL);
+	if (pthread_create(&stream->reader, NULL, raw_stream_reader, stream)) {
+		PyErr_SetString(PyExc_OSError, "Could not start the thread to read the movie");
+		pthread_mutex_destroy(&stream->lock);
+		pthread_cond_destroy(&stream->changed);
+		munmap(stream->ring, ring_frames*stream->frame_size);
+		free(stream->offsets);
+		close(file);
+		free(stream);
+		return NULL;
+	}
+	return stream;
+}
+
+void raw_stream_close(raw_stream* stream){
+	pthread_mutex_lock(&stream->lock);
+	stream->stop = 1;
+	pthread_cond_broadcast(&stream->changed);
+	pthread_mutex_unlock(&stream->lock);
+	pthread_join(stream->reader, NULL);
+	pthread_mutex_destroy(&stream->lock);
+	pthread_cond_destroy(&stream->changed);
+	munmap(stream->ring, stream->ring_frames*stream->frame_size);
+	free(stream->offsets);
+	close(stream->file);
+	free(stream);
+}
+
+int display_raw_stream(uint16_t* data, fb_config fb0, int trig_pin, frame_record* trace, display_summary* summary){
+	/*display_raw() for the raw_stream passed as data. The ring is
+	filled before waiting for the trigger, then each frame is taken
+	from it as the reader keeps up; one that hasn't been read by the
+	time it's due is waited for and counted in underruns. min_buffered
+	is the fewest frames the ring held while there were still enough
+	left in the file to fill it. Returns as display_raw()*/
+	raw_stream* stream = (raw_stream*)data;
+	long n_frames = stream->n_frames;
+	int refresh_per_frame = stream->refresh_per_frame;
+	pthread_mutex_lock(&stream->lock);
+	while (stream->head < stream->ring_frames && !stream->error) {
+		pthread_cond_wait(&stream->changed, &stream->lock);
+	}
+	pthread_mutex_unlock(&stream->lock);
+
+	int64_t edge_ns;
+	int status = wait_for_trigger(fb0, trig_pin, &edge_ns);
+	if (status) {
+		return status;
+	}
+	stream->underruns = 0;
+	stream->min_buffered = stream->ring_frames;
+
+	uint16_t *write_loc;
+	int t, buffer, waits;
+	write_loc = fb0.map + fb0.size/2;
+	for (t = 0; t < n_frames; t++) {
+		trace[t].start_ns = monotonic_ns();
+
+		buffer = (t+1)%2;
+		pthread_mutex_lock(&stream->lock);
+		long buffered = stream->head - t;
+		if (n_frames - t >= stream->ring_frames && buffered < stream->min_buffered) {
+			stream->min_buffered = buffered;
+		}
+		if (buffered == 0) {
+			stream->underruns++;
+		}
+		while (stream->head == t && !stream->error) {
+			pthread_cond_wait(&stream->changed, &stream->lock);
+		}
+		int missing = stream->head == t;
+		pthread_mutex_unlock(&stream->lock);
+		if (missing) {
+			raise_without_gil(PyExc_OSError, "Could not read frame %d of the movie (%s)", t,
+					stream->error == -1 ? "the file ended early" : strerror(stream->error));
+			return -1;
+		}
+		fb0.blit->copy(write_loc, stream->ring + (t % stream->ring_frames)*stream->frame_size/2, fb0.size);
+		pthread_mutex_lock(&stream->lock);
+		stream->tail = t + 1;
+		pthread_cond_broadcast(&stream->changed);
+		pthread_mutex_unlock(&stream->lock);
+		trace[t].flip_ns = monotonic_ns();
+		flip_buffer(buffer, fb0);
+		trace[t].vsync_ns = monotonic_ns();
+		trace[t].copy_us = (trace[t].flip_ns - trace[t].start_ns)/1000;
+		trace[t].flip_us = (trace[t].vsync_ns - trace[t].flip_ns)/1000;
+		for (waits = 0; waits < refresh_per_frame; waits++) {
+			wait_vsync(fb0);
+		}
+		trace[t].vsync_ns = monotonic_ns();
+		if(!buffer) {
+			write_loc = fb0.map + fb0.size/2;
+			fb0.backend->write_pin(&fb0, 1, HIGH);
+		} else {
+			write_loc = fb0.map;
+			fb0.backend->write_pin(&fb0, 1, LOW);
+		}
+		if (display_cancelled(fb0)) {
+			return 1;
+		}
+	}
+	summarise_trace(trace, n_frames, refresh_per_frame, fb0.refresh_rate, edge_ns, summary);
+	return 0;
+}
+
+int display_grating(uint16_t* data, fb_config fb0, int trig_pin, frame_record* trace, display_summary* summary){
+	/*Plays the grating stimulus passed as data, recording each of
+	its n_frames frames in trace. Returns as display_raw()*/
+	int64_t edge_ns;
+	int status = wait_for_trigger(fb0, trig_pin, &edge_ns);
+	if (status) {
+		return status;
+	}
+
+	stimulus* grating = (stimulus*)data;
+	int n_frames = grating->n_frames;
+	int frames_per_cycle = grating->stored_frames;
+	rowshift_grating rowshift;
+	render_pool* pool = NULL;
+	if(grating->frames == NULL){
+		rowshift_parse(grating->data, &rowshift);
+		pool = render_pool_create(0);
+		if(pool == NULL){
+			raise_without_gil(PyExc_MemoryError, NULL);
+			return -1;
+		}
+	}
+
+	uint16_t *write_loc;
+	int t, buffer, frame;
+	write_loc = fb0.map + fb0.size/2;
+
+	for (t=0; t < n_frames; t++){
+		trace[t].start_ns = monotonic_ns();
+
+		frame = t%frames_per_cycle;
+		buffer = (t+1)%2;
+		if(pool != NULL){
+			rowshift_frame(&rowshift, frame, write_loc, pool);
+		}else{
+			blit_frame(fb0, write_loc, &grating->roi, grating->frames[frame], t < 2);
+		}
+		trace[t].flip_ns = monotonic_ns();
+
+		flip_buffer(buffer, fb0);
+		trace[t].vsync_ns = monotonic_ns();
+		trace[t].copy_us = (trace[t].flip_ns - trace[t].start_ns)/1000;
+		trace[t].flip_us = (trace[t].vsync_ns - trace[t].flip_ns)/1000;
+		wait_vsync(fb0);
+		trace[t].vsync_ns = monotonic_ns();
+
+		if(!buffer){
+			fb0.backend->write_pin(&fb0, 1, LOW);
+			write_loc = fb0.map + fb0.size/2;
+		} else {
+			write_loc = fb0.map;
+			fb0.backend->write_pin(&fb0, 1, HIGH);
+		}
+		if(display_cancelled(fb0)){
+			status = 1;
+			break;
+		}
+	}
+	if(pool != NULL){
+		render_pool_destroy(pool);
+	}
+	if(status){
+		return status;
+	}
+	summarise_trace(trace, n_frames, 1, fb0.refresh_rate, edge_ns, summary);
+	return 0;
+}
+
+/*Sequences. display_sequence() plays a whole list of stimuli, grey
+periods and pin changes back to back on the display thread, so the
+time between trials is counted in vsyncs rather than left to Python.*/
+
+typedef struct {
+	//One step of a sequence
+	int kind; //STEP_*
+	stimulus* stim; //for STEP_STIMULUS
+	int refreshes; //for STEP_GREY
+	int pin; //for STEP_PIN, a wiringPi pin
+	int value; //for STEP_PIN, HIGH or LOW
+	//What display_sequence() found, for STEP_STIMULUS
+	int64_t onset_ns; //its first flip returned
+	int64_t onset_vsync; //refreshes from the sequence's first flip to that one
+	int64_t late_vsyncs; //how many later than the steps before it scheduled
+	display_summary summary; //of its frames of the trace
+} sequence_step;
+
+typedef struct {
+	sequence_step* steps;
+	int n_steps;
+	uint16_t* grey; //a frame of the background colour
+} sequence;
+
+void sequence_pins(sequence* seq, fb_config fb0, int from, int to){
+	//Applies the STEP_PIN steps from step from up to step to
+	int i;
+	for(i = from; i >= 0 && i < to; i++){
+		if(seq->steps[i].kind == STEP_PIN){
+			fb0.backend->write_pin(&fb0, seq->steps[i].pin, seq->steps[i].value);
+		}
+	}
+}
+
+int display_sequence(uint16_t* data, fb_config fb0, int trig_pin, frame_record* trace, display_summary* summary){
+	/*Plays the sequence passed as data after one trigger, putting the
+	frames of each of its stimuli into trace one after another. Each
+	step starts on the vsync its predecessor's last refresh ends on, a
+	grey step's flip being followed by its refreshes of the background,
+	and pin steps take effect as the flip starting the next step
+	returns, or at the end. Fills in each stimulus step's timing, and
+	its summary with vsync_count restarting at its first frame; summary
+	only gets the total missed_vsyncs. Returns as display_raw()*/
+	sequence* seq = (sequence*)data;
+	render_pool* pool = NULL;
+	int i;
+	for(i = 0; i < seq->n_steps; i++){
+		if(seq->steps[i].kind == STEP_STIMULUS && seq->steps[i].stim->frames == NULL && pool == NULL){
+			pool = render_pool_create(0);
+			if(pool == NULL){
+				raise_without_gil(PyExc_MemoryError, NULL);
+				return -1;
+			}
+		}
+		if(seq->steps[i].kind == STEP_PIN){
+			fb0.backend->pin_mode(&fb0, seq->steps[i].pin, OUTPUT);
+		}
+	}
+	int64_t edge_ns;
+	int status = wait_for_trigger(fb0, trig_pin, &edge_ns);
+
+	uint16_t *write_loc = fb0.map + fb0.size/2;
+	double period = 1e9 / fb0.refresh_rate;
+	int buffer = 0, pending = -1, t, waits;
+	long f = 0;
+	int64_t first_flip_ns = -1, scheduled = 0;
+	memset(summary, 0, sizeof(display_summary));
+	for(i = 0; i < seq->n_steps && !status; i++){
+		sequence_step* step = &seq->steps[i];
+		if(step->kind == STEP_PIN){
+			if(pending == -1){
+				pending = i;
+			}
+			continue;
+		}
+		stimulus* stim = step->kind == STEP_STIMULUS ? step->stim : NULL;
+		int n_frames = stim != NULL ? stim->n_frames : 1;
+		int refreshes = stim != NULL ? stim->refresh_per_frame : step->refreshes;
+		if(refreshes <= 0){
+			continue;
+		}
+		rowshift_grating rowshift;
+		if(stim != NULL && stim->frames == NULL){
+			rowshift_parse(stim->data, &rowshift);
+		}
+		frame_record grey_record;
+		for(t = 0; t < n_frames; t++){
+			frame_record* record = stim != NULL ? &trace[f + t] : &grey_record;
+			record->start_ns = monotonic_ns();
+
+			buffer = !buffer;
+			if(stim == NULL){
+				fb0.blit->copy(write_loc, seq->grey, fb0.size);
+			}else if(stim->frames == NULL){
+				rowshift_frame(&rowshift, t % stim->stored_frames, write_loc, pool);
+			}else{
+				blit_frame(fb0, write_loc, &stim->roi, stim->frames[t % stim->stored_frames], t < 2);
+			}
+			record->flip_ns = monotonic_ns();
+			flip_buffer(buffer, fb0);
+			record->vsync_ns = monotonic_ns();
+			if(t == 0){
+				sequence_pins(seq, fb0, pending, i);
+				pending = -1;
+				if(first_flip_ns == -1){
+					first_flip_ns = record->vsync_ns;
+				}
+				if(stim != NULL){
+					step->onset_ns = record->vsync_ns;
+					step->onset_vsync = llround((record->vsync_ns - first_flip_ns) / period);
+					step->late_vsyncs = step->onset_vsync - scheduled;
+				}
+			}
+			record->copy_us = (record->flip_ns - record->start_ns)/1000;
+			record->flip_us = (record->vsync_ns - record->flip_ns)/1000;
+			for(waits = 0; waits < refreshes; waits++){
+				wait_vsync(fb0);
+			}
+			record->vsync_ns = monotonic_ns();
+			if(!buffer){
+				write_loc = fb0.map + fb0.size/2;
+				fb0.backend->write_pin(&fb0, 1, HIGH);
+			}else{
+				write_loc = fb0.map;
+				fb0.backend->write_pin(&fb0, 1, LOW);
+			}
+			if(display_cancelled(fb0)){
+				status = 1;
+				break;
+			}
+		}
+		scheduled += (int64_t)(n_frames)*refreshes;
+		if(stim != NULL && !status){
+			summarise_trace(trace + f, n_frames, refreshes, fb0.refresh_rate,
+					f == 0 ? edge_ns : 0, &step->summary);
+			summary->missed_vsyncs += step->summary.missed_vsyncs;
+			f += n_frames;
+		}
+	}
+	if(!status){
+		sequence_pins(seq, fb0, pending, seq->n_steps);
+	}
+	if(pool != NULL){
+		render_pool_destroy(pool);
+	}
+	return status;
+}
+
+/*Drifting by panning. A full screen grating at a cardinal angle is
+the same strip of pixels every frame, just moved along by its speed,
+so display_drift() renders one strip a wavelength longer than the
+screen into an enlarged virtual framebuffer and then only pans the
+display across it, copying nothing per frame.*/
+
+typedef struct {
+	int n_frames;
+	int wavelength; //pixels per cycle, the most the pan offset ever reaches
+	int step; //pixels the pan offset moves each frame, less than wavelength
+	int horizontal; //1 for ANGLE_0 and ANGLE_180, which pan along x
+	uint16_t background;
+	int x; //where the last frame shown was panned to
+	int y;
+} drift_plan;
+
+int drift_restore(fb_config* fb0){
+	/*Puts the virtual framebuffer back to its usual two buffers. If
+	even that fails there's no framebuffer left mapped, so fb0->error
+	is set and the screen refuses to display, see screen_pointer()*/
+	if(fb0->backend->set_virtual(fb0, fb0->width, 2*fb0->height)){
+		fb0->map = NULL;
+		fb0->error = 1;
+		return 1;
+	}
+	return 0;
+}
+
+int drift_prepare(fb_config* fb0, grating_params* p, int n_frames, drift_plan* plan){
+	/*Enlarges the virtual framebuffer, shows the background from its
+	top while the strip is rendered below it and fills in plan. The
+	grating must be full screen at a cardinal angle. Called without
+	the GIL; raises and returns nonzero on failure, with the
+	framebuffer put back as it was*/
+	int width = fb0->width;
+	int height = fb0->height;
+	int sign = (p->angle == ANGLE_90 || p->angle == ANGLE_180) ? 1 : -1;
+	plan->n_frames = n_frames;
+	plan->wavelength = p->wavelength;
+	plan->step = ((sign*p->speed) % p->wavelength + p->wavelength) % p->wavelength;
+	plan->horizontal = p->angle == ANGLE_0 || p->angle == ANGLE_180;
+	plan->background = rgb_to_uint(p->background, p->background, p->background);
+	plan->x = 0;
+	plan->y = 0;
+	int virtual_width = plan->horizontal ? width + p->wavelength : width;
+	int virtual_height = plan->horizontal ? 2*height : 2*height + p->wavelength;
+	render_pool* pool = render_pool_create(0);
+	if(pool == NULL){
+		raise_without_gil(PyExc_MemoryError, NULL);
+		return 1;
+	}
+	if(fb0->backend->set_virtual(fb0, virtual_width, virtual_height)){
+		goto fail;
+	}
+	fill_pixels(fb0->map, plan->background, (size_t)(virtual_width)*height);
+	fb0->backend->pan(fb0, 0, 0);
+	fb_config strip = *fb0;
+	strip.width = virtual_width;
+	strip.height = virtual_height - height;
+	build_frame(fb0->map + (size_t)(virtual_width)*height, 0, p, strip, 0, strip.height, pool);
+	render_pool_destroy(pool);
+	return 0;
+
+fail:
+	render_pool_destroy(pool);
+	drift_restore(fb0);
+	return 1;
+}
+
+int display_drift(uint16_t* data, fb_config fb0, int trig_pin, frame_record* trace, display_summary* summary){
+	/*Plays the drift_plan passed as data, left ready by
+	drift_prepare(), panning once a frame. Returns as display_raw()*/
+	drift_plan* plan = (drift_plan*)data;
+	int64_t edge_ns;
+	int status = wait_for_trigger(fb0, trig_pin, &edge_ns);
+	if (status) {
+		return status;
+	}
+	int t, offset = 0;
+	for (t = 0; t < plan->n_frames; t++){
+		trace[t].start_ns = monotonic_ns();
+		plan->x = plan->horizontal ? offset : 0;
+		plan->y = plan->horizontal ? fb0.height : fb0.height + offset;
+		trace[t].flip_ns = monotonic_ns();
+
+		fb0.backend->pan(&fb0, plan->x, plan->y);
+		trace[t].vsync_ns = monotonic_ns();
+		trace[t].copy_us = (trace[t].flip_ns - trace[t].start_ns)/1000;
+		trace[t].flip_us = (trace[t].vsync_ns - trace[t].flip_ns)/1000;
+		wait_vsync(fb0);
+		trace[t].vsync_ns = monotonic_ns();
+
+		//the same frame pin pattern as display_grating()
+		fb0.backend->write_pin(&fb0, 1, t%2 ? LOW : HIGH);
+		offset = (offset + plan->step) % plan->wavelength;
+		if(display_cancelled(fb0)){
+			return 1;
+		}
+	}
+	summarise_trace(trace, plan->n_frames, 1, fb0.refresh_rate, edge_ns, summary);
+	return 0;
+}
+
+int drift_finish(fb_config* fb0, drift_plan* plan){
+	/*Puts the virtual framebuffer back to its usual two buffers,
+	leaving the last frame display_drift() showed on screen in
+	buffer 0. Called without the GIL; raises and returns nonzero on
+	failure*/
+	size_t row_bytes = fb0->width*sizeof(uint16_t);
+	uint16_t* last = malloc(fb0->size);
+	int row;
+	if(last != NULL){
+		for(row = 0; row < (int)fb0->height; row++){
+			memcpy(last + row*fb0->width,
+					fb0->map + (size_t)(plan->y + row)*fb0->virtual_width + plan->x, row_bytes);
+		}
+	}
+	if(drift_restore(fb0)){
+		free(last);
+		return 1;
+	}
+	if(last != NULL){
+		memcpy(fb0->map, last, fb0->size);
+	}else{
+		fill_pixels(fb0->map, plan->background, fb0->size/2);
+	}
+	free(last);
+	flip_buffer(0, *fb0);
+	return 0;
+}
+
+/*Procedural display. display_procedural() renders each frame of a
+grating straight into the back buffer between vsyncs, across a render
+pool, so nothing is built or stored beforehand. Each frame has until
+the vsync after the one it started on; those that finish later are
+counted in late_frames.*/
+
+typedef struct {
+	grating_params* params;
+	int n_frames;
+	render_pool* pool;
+	int late_frames; //frames still rendering at the vsync they were due on
+} procedural_plan;
+
+int display_procedural(uint16_t* data, fb_config fb0, int trig_pin, frame_record* trace, display_summary* summary){
+	/*Renders and plays the procedural_plan passed as data, recording
+	each frame in trace. Returns as display_raw()*/
+	procedural_plan* plan = (procedural_plan*)data;
+	screen_roi* roi = &plan->params->roi;
+	int64_t period_ns = 1000000000LL/fb0.refresh_rate;
+	int64_t edge_ns;
+	int status = wait_for_trigger(fb0, trig_pin, &edge_ns);
+	if (status) {
+		return status;
+	}
+	plan->late_frames = 0;
+
+	uint16_t *write_loc;
+	int t, buffer;
+	write_loc = fb0.map + fb0.size/2;
+	for (t = 0; t < plan->n_frames; t++){
+		trace[t].start_ns = monotonic_ns();
+		buffer = (t+1)%2;
+		if(t < 2){
+			//rows outside the roi are the background, as blit_frame() fills them
+			uint16_t* end = write_loc + (size_t)(roi->y + roi->height)*fb0.width;
+			fill_pixels(write_loc, roi->background, (size_t)(roi->y)*fb0.width);
+			fill_pixels(end, roi->background, write_loc + fb0.size/2 - end);
+		}
+		build_frame(write_loc, t, plan->params, fb0, roi->y, roi->y + roi->height, plan->pool);
+		trace[t].flip_ns = monotonic_ns();
+		if(trace[t].flip_ns > (t ? trace[t-1].vsync_ns : trace[t].start_ns) + period_ns){
+			plan->late_frames++;
+		}
+
+		flip_buffer(buffer, fb0);
+		trace[t].vsync_ns = monotonic_ns();
+		trace[t].copy_us = (trace[t].flip_ns - trace[t].start_ns)/1000;
+		trace[t].flip_us = (trace[t].vsync_ns - trace[t].flip_ns)/1000;
+		wait_vsync(fb0);
+		trace[t].vsync_ns = monotonic_ns();
 
 		if(!buffer){
-			digitalWrite(1, LOW);
+			fb0.backend->write_pin(&fb0, 1, LOW);
 			write_loc = fb0.map + fb0.size/2;
 		} else {
 			write_loc = fb0.map;
-			digitalWrite(1, HIGH);
+			fb0.backend->write_pin(&fb0, 1, HIGH);
+		}
+		if(display_cancelled(fb0)){
+			return 1;
 		}
 	}
-	*frame_duration_mean = mean_long(timings, n_frames-1);
-	*frame_duration_std = std_long(timings, n_frames-1);
-	return frame_duration_mean;
+	summarise_trace(trace, plan->n_frames, 1, fb0.refresh_rate, edge_ns, summary);
+	return 0;
 }
 
-int unload_grating(uint16_t* frame_data){
-	free(frame_data);
+int display_probe(uint16_t* unused, fb_config fb0, int n_frames, frame_record* trace, display_summary* summary){
+	/*Runs the display loop for n_frames without a stimulus, copying
+	the front buffer to the back each frame, to measure timing jitter*/
+	uint16_t *write_loc = fb0.map + fb0.size/2;
+	int t, buffer;
+	for (t = 0; t < n_frames; t++) {
+		trace[t].start_ns = monotonic_ns();
+		buffer = (t+1)%2;
+		fb0.blit->copy(write_loc, buffer ? fb0.map : fb0.map + fb0.size/2, fb0.size);
+		trace[t].flip_ns = monotonic_ns();
+		flip_buffer(buffer, fb0);
+		trace[t].vsync_ns = monotonic_ns();
+		trace[t].copy_us = (trace[t].flip_ns - trace[t].start_ns)/1000;
+		trace[t].flip_us = (trace[t].vsync_ns - trace[t].flip_ns)/1000;
+		wait_vsync(fb0);
+		trace[t].vsync_ns = monotonic_ns();
+		write_loc = buffer ? fb0.map : fb0.map + fb0.size/2;
+	}
+	summarise_trace(trace, n_frames, 1, fb0.refresh_rate, 0, summary);
 	return 0;
 }
 
-int unload_raw(uint16_t* raw_data) {
-	free(raw_data);
+typedef struct {
+	//A display call, for run_display() to make on the display thread
+	int (*display)(uint16_t* data, fb_config fb0, int arg, frame_record* trace, display_summary* summary);
+	uint16_t* data;
+	fb_config fb0;
+	int arg; //the trigger pin, or display_probe()'s frame count
+	frame_record* trace;
+	display_summary* summary;
+	int status;
+} display_job;
+
+void* display_thread(void* arg){
+	display_job* job = arg;
+	job->status = job->display(job->data, job->fb0, job->arg, job->trace, job->summary);
+	return NULL;
+}
+
+int lock_stimulus(fb_config* fb0, stimulus* loaded){
+	/*Locks loaded in RAM for a real-time display call, if locking is
+	on and it isn't locked already. It then stays locked, as if loaded
+	with LOAD_LOCK, until it is unloaded, so a stimulus shown many times
+	is locked once. Returns -1 if the kernel refused, otherwise 0.
+	Called without the GIL*/
+	realtime_options* rt = &fb0->realtime;
+	if (rt->priority == 0 || !rt->lock || (loaded->mode & LOAD_LOCK)) {
+		return 0;
+	}
+	if (mlock(stimulus_memory(loaded), loaded->size)) {
+		return -1;
+	}
+	loaded->mode |= LOAD_LOCK;
 	return 0;
 }
 
+void unlock_framebuffer(fb_config* fb0){
+	//Undoes run_display()'s lock of the framebuffer, if it is still mapped
+	realtime_options* rt = &fb0->realtime;
+	if (rt->locked_map != NULL && rt->locked_map == fb0->map) {
+		munlock(rt->locked_map, rt->locked_map_size);
+	}
+	rt->locked_map = NULL;
+}
+
+int run_display(fb_config* fb0, display_job* job, int stimuli_locked, void* locked, size_t lock_size, size_t trace_size){
+	/*Makes a display call. Unless real-time mode is on, that's
+	just a call on this thread. Otherwise it runs on a thread of its
+	own with SCHED_FIFO priority, pinned to a CPU, on a stack that is
+	locked and pre-faulted, with the trace and the lock_size bytes at
+	locked, which last only for the call, locked in RAM.
+	stimuli_locked is lock_stimulus()'s result for the stimuli shown,
+	which stay locked. The framebuffer is locked the first time it is
+	displayed on, and again only if it is mapped afresh. Anything the
+	kernel refuses (without CAP_SYS_NICE or a big enough
+	RLIMIT_MEMLOCK) is done without, and fb0->realtime.granted
+	records what was got. Called without the GIL*/
+	realtime_options* rt = &fb0->realtime;
+	if (rt->priority == 0) {
+		display_thread(job);
+		return job->status;
+	}
+	int granted = 0;
+	if (rt->lock) {
+		if (stimuli_locked == 0 && mlock(locked, lock_size) == 0 && mlock(job->trace, trace_size) == 0) {
+			granted |= REALTIME_LOCKED;
+		}
+		size_t map_size = (size_t)(fb0->virtual_width)*fb0->virtual_height*sizeof(uint16_t);
+		//a mapping that has been replaced took its lock with it
+		if ((rt->locked_map != fb0->map || rt->locked_map_size != map_size) &&
+				mlock(fb0->map, map_size) == 0) {
+			rt->locked_map = fb0->map;
+			rt->locked_map_size = map_size;
+		}
+	}
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	void* stack = mmap(NULL, DISPLAY_STACK, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK, -1, 0);
+	if (stack != MAP_FAILED) {
+		if (mlock(stack, DISPLAY_STACK) == -1) {
+			memset(stack, 0, DISPLAY_STACK); //fault it in at least
+		}
+		pthread_attr_setstack(&attr, stack, DISPLAY_STACK);
+	}
+	if (rt->cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(rt->cpu, &cpus);
+		if (pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus) == 0) {
+			granted |= REALTIME_PINNED;
+		}
+	}
+	struct sched_param param;
+	param.sched_priority = rt->priority;
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+	pthread_attr_setschedparam(&attr, &param);
+	pthread_t thread;
+	int error = pthread_create(&thread, &attr, display_thread, job);
+	if (error == EPERM) {
+		//Not allowed real-time priority; keep the rest
+		pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+		error = pthread_create(&thread, &attr, display_thread, job);
+	} else if (error == 0) {
+		granted |= REALTIME_FIFO;
+	}
+	if (error == 0) {
+		pthread_join(thread, NULL);
+	} else {
+		//No thread, so none of its scheduling, but the memory is still locked
+		granted &= REALTIME_LOCKED;
+		display_thread(job);
+	}
+	pthread_attr_destroy(&attr);
+	if (stack != MAP_FAILED) {
+		munmap(stack, DISPLAY_STACK);
+	}
+	if (rt->lock) {
+		munlock(locked, lock_size);
+		munlock(job->trace, trace_size);
+	}
+	rt->granted = granted;
+	return job->status;
+}
+
 int display_color(fb_config fb0,int buffer, uint16_t color){
 	uint16_t *write_loc;
 	int pixel;
@@ -731,23 +3933,26 @@ int is_current_resolution(int xres, int yres){
 	property[0] = 8*sizeof(property[0]);
 	if(ioctl(fd, _IOWR(100,0,char*), property) == -1){
 		PyErr_SetString(PyExc_OSError,"IOCTL call failed when attempting to check resolution");
+		close(fd);
 		return -1;
 	}
+	close(fd);
 	return ((property[5] == xres)&&(property[6]==yres));
 }
 
 
-fb_config init(int width, int height){
+int hardware_open(fb_config* fb0, backend_options* options){
+#ifdef HAVE_WIRINGPI
 	wiringPiSetup();
+#endif
 
-	fb_config fb0;
 	//To determine original width and height
 	//a mailbox property interface request is
 	//performed.
 	int fd = open("/dev/vcio",0);
 	if(fd == -1){
-		perror("From open() call on /dev/vcio device");
-		exit(1);
+		PyErr_SetString(PyExc_OSError,"Could not open /dev/vcio device");
+		return 1;
 	}
 	volatile uint32_t property[32] __attribute__((aligned(16))) = 
 	{
@@ -768,34 +3973,29 @@ fb_config init(int width, int height){
 	property[0] = 12*sizeof(property[0]);
 	if(ioctl(fd, _IOWR(100, 0, char *), property) == -1){
 		PyErr_SetString(PyExc_OSError,"Error from call to ioctl\n");
-		fb0.error = 1;
-		return fb0;
+		close(fd);
+		return 1;
 	}
 	close(fd);
-	fb0.orig_width = (int)(property[5]);
-	fb0.orig_height = (int)(property[6]);
-	fb0.orig_depth = (int)(property[10]);
-	fb0.width = width;
-	fb0.height = height;
-	fb0.depth = 16;
-	fb0.size = (fb0.height)*(fb0.depth)*(fb0.width)/8;
+	fb0->orig_width = (int)(property[5]);
+	fb0->orig_height = (int)(property[6]);
+	fb0->orig_depth = (int)(property[10]);
 	char fbset_str[80];
 	sprintf(fbset_str,
 		"fbset -xres %d -yres %d -vxres %d -vyres %d -depth 16",
-		fb0.width, fb0.height, fb0.width, 2*fb0.height);
+		fb0->width, fb0->height, fb0->width, 2*fb0->height);
 	if(system(fbset_str)){
 		PyErr_SetString(PyExc_OSError,"Call to fbset subroutine failed.");
-		fb0.error = 1;
-		return fb0;
+		return 1;
 	}
-	int resolution_status = is_current_resolution(width,height);
+	int resolution_status = is_current_resolution(fb0->width,fb0->height);
 	if(resolution_status == 0){
 		printf("The linux framebuffer does not support the requested resolution\n"
 			"Attepting to reset resolution settings...\n");
 		sprintf(fbset_str,
 			"fbset -xres %d -yres %d -vxres %d -vyres %d -depth %d",
-			fb0.orig_width, fb0.orig_height, fb0.orig_width, 
-			fb0.orig_height, fb0.orig_depth);
+			fb0->orig_width, fb0->orig_height, fb0->orig_width, 
+			fb0->orig_height, fb0->orig_depth);
 		if(system(fbset_str)){
 			perror("Attempt failed, message from fbset");
 		}
@@ -803,40 +4003,567 @@ fb_config init(int width, int height){
 			printf("Attempt successful.\n");
 		}
 		PyErr_SetString(PyExc_OSError,"Requested resolution not supported");
-		fb0.error = 1;
-		return fb0;
+		return 1;
 	}else if(resolution_status == -1){
-		fb0.error = 1;
-		return fb0;
+		return 1;
 	}
-	fb0.framebuffer = open("/dev/fb0",O_RDWR);
-	if (fb0.framebuffer == -1){
+	fb0->framebuffer = open("/dev/fb0",O_RDWR);
+	if (fb0->framebuffer == -1){
 		PyErr_SetString(PyExc_OSError,"Attempt to open /dev/fb0 (framebuffer 0) device failed");
-		fb0.error = 1;
-		return fb0;
+		return 1;
 	}
-	fb0.map = (uint16_t *)(mmap(0,2*fb0.size,PROT_READ|PROT_WRITE, MAP_SHARED, fb0.framebuffer, 0));
-	if (fb0.map == MAP_FAILED){
+	fb0->map = (uint16_t *)(mmap(0,2*fb0->size,PROT_READ|PROT_WRITE, MAP_SHARED, fb0->framebuffer, 0));
+	if (fb0->map == MAP_FAILED){
 		PyErr_SetString(PyExc_OSError,"Attempt to mmap /dev/fb0 device failed");
-		fb0.error = 1;
-		return fb0;
+		goto close_framebuffer;
 	}
-	fb0.error = 0;
-	return fb0;
+	//Kept open so flipping a buffer is a single ioctl
+	fb0->mailbox = open("/dev/vcio",O_RDWR|O_SYNC);
+	if (fb0->mailbox == -1){
+		PyErr_SetString(PyExc_OSError,"Could not open /dev/vcio device");
+		goto unmap;
+	}
+	if (ioctl(fb0->framebuffer, FBIOGET_VSCREENINFO, &fb0->var) == -1){
+		PyErr_SetString(PyExc_OSError,"Could not read the framebuffer's screen settings");
+		goto close_mailbox;
+	}
+	hardware_state* hardware = malloc(sizeof(hardware_state));
+	if (hardware == NULL){
+		PyErr_NoMemory();
+		goto close_mailbox;
+	}
+	int pin;
+	for (pin = 0; pin < HARDWARE_PINS; pin++){
+		hardware->edge_fds[pin] = -1;
+	}
+	fb0->backend_data = hardware;
+	return 0;
+
+	//Each failure undoes what was opened before it
+close_mailbox:
+	close(fb0->mailbox);
+unmap:
+	munmap(fb0->map, 2*fb0->size);
+close_framebuffer:
+	close(fb0->framebuffer);
+	fb0->framebuffer = -1;
+	return 1;
 }
 
-int close_display(fb_config fb0){
-	munmap(fb0.map,2*fb0.size);
+int hardware_close(fb_config* fb0){
+	hardware_state* hardware = fb0->backend_data;
+	int pin;
+	for (pin = 0; pin < HARDWARE_PINS; pin++){
+		if (hardware->edge_fds[pin] != -1){
+			close(hardware->edge_fds[pin]);
+		}
+	}
+	free(hardware);
+	munmap(fb0->map,(size_t)(fb0->virtual_width)*fb0->virtual_height*sizeof(uint16_t));
+	close(fb0->mailbox);
+	close(fb0->framebuffer);
 	char fbset_str[80];
 	sprintf(fbset_str,
 		"fbset -xres %d -yres %d -vxres %d -vyres %d -depth %d",
-		fb0.orig_width, fb0.orig_height, fb0.orig_width, fb0.orig_height,
-		fb0.orig_depth);
+		fb0->orig_width, fb0->orig_height, fb0->orig_width, fb0->orig_height,
+		fb0->orig_depth);
 	if(system(fbset_str)){
 		PyErr_SetString(PyExc_OSError,"System call to reset resolution (via fbset subroutine) failed");
 		return 1;
 	}
-	return 0;
+	return 0;
+}
+
+int hardware_set_virtual(fb_config* fb0, int width, int height){
+	/*Resizes the virtual framebuffer to width x height pixels and
+	maps it again, rows width pixels apart*/
+	struct fb_var_screeninfo var = fb0->var;
+	struct fb_fix_screeninfo fix;
+	munmap(fb0->map, (size_t)(fb0->virtual_width)*fb0->virtual_height*sizeof(uint16_t));
+	fb0->realtime.locked_map = NULL; //unmapping unlocked it
+	fb0->virtual_width = 0;
+	fb0->virtual_height = 0;
+	var.xres_virtual = width;
+	var.yres_virtual = height;
+	var.xoffset = 0;
+	var.yoffset = 0;
+	if(ioctl(fb0->framebuffer, FBIOPUT_VSCREENINFO, &var) == -1 ||
+			ioctl(fb0->framebuffer, FBIOGET_VSCREENINFO, &fb0->var) == -1 ||
+			ioctl(fb0->framebuffer, FBIOGET_FSCREENINFO, &fix) == -1){
+		raise_without_gil(PyExc_OSError, "Could not make the virtual framebuffer %dx%d (%s)",
+				width, height, strerror(errno));
+		return 1;
+	}
+	if(fix.line_length != width*sizeof(uint16_t) || fb0->var.yres_virtual < (unsigned int)height){
+		raise_without_gil(PyExc_OSError, "The framebuffer can't be made %dx%d", width, height);
+		return 1;
+	}
+	fb0->map = mmap(0, (size_t)(width)*height*sizeof(uint16_t), PROT_READ|PROT_WRITE, MAP_SHARED, fb0->framebuffer, 0);
+	if(fb0->map == MAP_FAILED){
+		raise_without_gil(PyExc_OSError, "Attempt to mmap /dev/fb0 device failed (%s)", strerror(errno));
+		return 1;
+	}
+	fb0->virtual_width = width;
+	fb0->virtual_height = height;
+	return 0;
+}
+
+int hardware_wait_vsync(fb_config* fb0){
+	__u32 dummy = 0;
+	return ioctl(fb0->framebuffer, FBIO_WAITFORVSYNC, &dummy);
+}
+
+int hardware_refresh_rate(fb_config* fb0){
+	return get_refresh_rate();
+}
+
+//BCM GPIO line of each wiringPi pin on the 40 pin header, -1 for none
+static const int wiringpi_to_bcm[HARDWARE_PINS] = {
+	17, 18, 27, 22, 23, 24, 25, 4, 2, 3, 8, 7, 10, 9, 11, 14,
+	15, -1, -1, -1, -1, 5, 6, 13, 19, 26, 12, 16, 20, 21, 0, 1};
+
+int hardware_edge_fd(fb_config* fb0, int pin){
+	/*Asks the GPIO character device for rising edge events on the
+	pin's line, so the kernel timestamps the edge and wakes poll().
+	The request is kept until the screen closes. Returns -1, leaving
+	wait_for_trigger() to spin on read_pin(), if that isn't possible*/
+	hardware_state* hardware = fb0->backend_data;
+	if (pin < 0 || pin >= HARDWARE_PINS || wiringpi_to_bcm[pin] == -1){
+		return -1;
+	}
+	if (hardware->edge_fds[pin] != -1){
+		return hardware->edge_fds[pin];
+	}
+	int chip = open("/dev/gpiochip0", O_RDONLY|O_CLOEXEC);
+	if (chip == -1){
+		return -1;
+	}
+	struct gpioevent_request request;
+	memset(&request, 0, sizeof(request));
+	request.lineoffset = wiringpi_to_bcm[pin];
+	request.handleflags = GPIOHANDLE_REQUEST_INPUT;
+	request.eventflags = GPIOEVENT_REQUEST_RISING_EDGE;
+	strncpy(request.consumer_label, "rpg trigger", sizeof(request.consumer_label)-1);
+	int status = ioctl(chip, GPIO_GET_LINEEVENT_IOCTL, &request);
+	close(chip);
+	if (status == -1){
+		return -1;
+	}
+	fcntl(request.fd, F_SETFL, fcntl(request.fd, F_GETFL) | O_NONBLOCK);
+	hardware->edge_fds[pin] = request.fd;
+	return request.fd;
+}
+
+int64_t hardware_edge_time(fb_config* fb0, int fd){
+	struct gpioevent_data event;
+	if (read(fd, &event, sizeof(event)) != sizeof(event)){
+		return -1;
+	}
+	//Kernels before 5.7 stamp events with CLOCK_REALTIME
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	int64_t realtime = now.tv_nsec + 1000000000*(int64_t)(now.tv_sec);
+	int64_t monotonic = monotonic_ns();
+	int64_t t = event.timestamp;
+	if (llabs(t - realtime) < llabs(t - monotonic)){
+		t += monotonic - realtime;
+	}
+	return t;
+}
+
+#ifdef HAVE_WIRINGPI
+void hardware_pin_mode(fb_config* fb0, int pin, int mode){
+	pinMode(pin, mode);
+}
+
+int hardware_read_pin(fb_config* fb0, int pin){
+	return digitalRead(pin);
+}
+
+void hardware_write_pin(fb_config* fb0, int pin, int value){
+	digitalWrite(pin, value);
+}
+#else
+//Built without wiringPi: the feedback pin does nothing and triggers can't be read
+void hardware_pin_mode(fb_config* fb0, int pin, int mode){
+}
+
+int hardware_read_pin(fb_config* fb0, int pin){
+	return -1;
+}
+
+void hardware_write_pin(fb_config* fb0, int pin, int value){
+}
+#endif
+
+
+/*The simulated backend: the framebuffer is ordinary memory, or a
+file mapped with MAP_SHARED so another process can watch it, and
+vsyncs come from the clock at a fixed refresh rate. Input pins read
+0 unless a pulse scheduled with sim_schedule_pulse() is under way.*/
+
+int64_t timespec_nsecs(struct timespec t){
+	return t.tv_nsec + 1000000000*(int64_t)(t.tv_sec);
+}
+
+struct timespec nsecs_timespec(int64_t nsecs){
+	struct timespec t;
+	t.tv_sec = nsecs / 1000000000;
+	t.tv_nsec = nsecs % 1000000000;
+	return t;
+}
+
+int sim_open(fb_config* fb0, backend_options* options){
+	if(options->refresh_rate <= 0){
+		PyErr_SetString(PyExc_ValueError, "The simulated refresh rate must be > 0");
+		return 1;
+	}
+	sim_state* sim = calloc(1, sizeof(sim_state));
+	if(sim == NULL){
+		PyErr_NoMemory();
+		return 1;
+	}
+	sim->refresh_rate = options->refresh_rate;
+	sim->file = -1;
+	int pin;
+	for(pin = 0; pin < SIM_PINS; pin++){
+		sim->edge_timers[pin] = -1;
+	}
+	pthread_mutex_init(&sim->lock, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &sim->epoch);
+	if(options->framebuffer_file != NULL){
+		sim->file = open(options->framebuffer_file, O_RDWR|O_CREAT, 0644);
+		if(sim->file == -1 || ftruncate(sim->file, 2*fb0->size) == -1){
+			PyErr_SetFromErrnoWithFilename(PyExc_OSError, options->framebuffer_file);
+			if(sim->file != -1){
+				close(sim->file);
+			}
+			pthread_mutex_destroy(&sim->lock);
+			free(sim);
+			return 1;
+		}
+		fb0->map = mmap(0, 2*fb0->size, PROT_READ|PROT_WRITE, MAP_SHARED, sim->file, 0);
+	}else{
+		fb0->map = mmap(0, 2*fb0->size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	}
+	if(fb0->map == MAP_FAILED){
+		PyErr_SetString(PyExc_OSError, "Could not map the simulated framebuffer");
+		if(sim->file != -1){
+			close(sim->file);
+		}
+		pthread_mutex_destroy(&sim->lock);
+		free(sim);
+		return 1;
+	}
+	fb0->framebuffer = -1;
+	fb0->mailbox = -1;
+	fb0->orig_width = fb0->width;
+	fb0->orig_height = fb0->height;
+	fb0->orig_depth = fb0->depth;
+	fb0->backend_data = sim;
+	return 0;
+}
+
+int sim_close(fb_config* fb0){
+	sim_state* sim = fb0->backend_data;
+	munmap(fb0->map, (size_t)(fb0->virtual_width)*fb0->virtual_height*sizeof(uint16_t));
+	if(sim->file != -1){
+		close(sim->file);
+	}
+	int pin;
+	for(pin = 0; pin < SIM_PINS; pin++){
+		if(sim->edge_timers[pin] != -1){
+			close(sim->edge_timers[pin]);
+		}
+	}
+	pthread_mutex_destroy(&sim->lock);
+	free(sim->pulses);
+	free(sim);
+	return 0;
+}
+
+int sim_pan(fb_config* fb0, int x, int y){
+	sim_state* sim = fb0->backend_data;
+	sim->x_offset = x;
+	sim->y_offset = y;
+	return 0;
+}
+
+int sim_flip(fb_config* fb0, int buffer_num){
+	return sim_pan(fb0, 0, buffer_num != 0 ? fb0->height : 0);
+}
+
+int sim_set_virtual(fb_config* fb0, int width, int height){
+	//As hardware_set_virtual(), resizing the framebuffer file if there is one
+	sim_state* sim = fb0->backend_data;
+	size_t size = (size_t)(width)*height*sizeof(uint16_t);
+	munmap(fb0->map, (size_t)(fb0->virtual_width)*fb0->virtual_height*sizeof(uint16_t));
+	fb0->realtime.locked_map = NULL; //unmapping unlocked it
+	fb0->virtual_width = 0;
+	fb0->virtual_height = 0;
+	if(sim->file != -1){
+		if(ftruncate(sim->file, size) == -1){
+			raise_without_gil(PyExc_OSError, "Could not resize the simulated framebuffer (%s)", strerror(errno));
+			return 1;
+		}
+		fb0->map = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, sim->file, 0);
+	}else{
+		fb0->map = mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	}
+	if(fb0->map == MAP_FAILED){
+		raise_without_gil(PyExc_OSError, "Could not map the simulated framebuffer");
+		return 1;
+	}
+	fb0->virtual_width = width;
+	fb0->virtual_height = height;
+	return 0;
+}
+
+int sim_wait_vsync(fb_config* fb0){
+	//Sleep until the next multiple of the refresh period since epoch
+	sim_state* sim = fb0->backend_data;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t period = 1000000000 / sim->refresh_rate;
+	int64_t since_epoch = timespec_nsecs(now) - timespec_nsecs(sim->epoch);
+	int64_t next = timespec_nsecs(sim->epoch) + (since_epoch/period + 1)*period;
+	struct timespec wake = nsecs_timespec(next);
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR){
+	}
+	sim->vsyncs++;
+	return 0;
+}
+
+int sim_refresh_rate(fb_config* fb0){
+	sim_state* sim = fb0->backend_data;
+	return sim->refresh_rate;
+}
+
+void sim_pin_mode(fb_config* fb0, int pin, int mode){
+}
+
+int sim_read_pin(fb_config* fb0, int pin){
+	sim_state* sim = fb0->backend_data;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t t = timespec_nsecs(now);
+	int value = 0;
+	int i;
+	pthread_mutex_lock(&sim->lock);
+	for(i = 0; i < sim->n_pulses; i++){
+		sim_pulse* pulse = &sim->pulses[i];
+		if(pulse->pin == pin && t >= timespec_nsecs(pulse->start) && t < timespec_nsecs(pulse->end)){
+			value = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sim->lock);
+	return value;
+}
+
+void sim_write_pin(fb_config* fb0, int pin, int value){
+	sim_state* sim = fb0->backend_data;
+	if(pin >= 0 && pin < SIM_PINS){
+		sim->pins[pin] = value;
+	}
+}
+
+void sim_arm_edge(sim_state* sim, int pin){
+	/*Sets the pin's timerfd, if it has one, to go off as the
+	earliest pulse not yet taken starts, which may already have
+	passed. Called with sim->lock held*/
+	if(pin < 0 || pin >= SIM_PINS || sim->edge_timers[pin] == -1){
+		return;
+	}
+	struct itimerspec when;
+	memset(&when, 0, sizeof(when));
+	int64_t earliest = 0;
+	int i;
+	for(i = 0; i < sim->n_pulses; i++){
+		int64_t start = timespec_nsecs(sim->pulses[i].start);
+		if(sim->pulses[i].pin == pin && !sim->pulses[i].delivered && (earliest == 0 || start < earliest)){
+			earliest = start;
+		}
+	}
+	if(earliest != 0){
+		when.it_value = nsecs_timespec(earliest);
+	}
+	timerfd_settime(sim->edge_timers[pin], TFD_TIMER_ABSTIME, &when, NULL);
+}
+
+int sim_schedule_pulse(fb_config* fb0, int pin, double delay, double duration){
+	/*Holds a simulated input pin high for duration seconds,
+	starting delay seconds from now. Pulses that have ended are
+	dropped as new ones are added*/
+	sim_state* sim = fb0->backend_data;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t t = timespec_nsecs(now);
+	pthread_mutex_lock(&sim->lock);
+	int i, kept = 0;
+	for(i = 0; i < sim->n_pulses; i++){
+		if(timespec_nsecs(sim->pulses[i].end) > t){
+			sim->pulses[kept++] = sim->pulses[i];
+		}
+	}
+	sim_pulse* pulses = realloc(sim->pulses, (kept+1)*sizeof(sim_pulse));
+	if(pulses == NULL){
+		sim->n_pulses = kept;
+		pthread_mutex_unlock(&sim->lock);
+		return 1;
+	}
+	pulses[kept].pin = pin;
+	pulses[kept].start = nsecs_timespec(t + (int64_t)(delay*1e9));
+	pulses[kept].end = nsecs_timespec(t + (int64_t)((delay+duration)*1e9));
+	pulses[kept].delivered = 0;
+	sim->pulses = pulses;
+	sim->n_pulses = kept + 1;
+	sim_arm_edge(sim, pin);
+	pthread_mutex_unlock(&sim->lock);
+	return 0;
+}
+
+int sim_edge_fd(fb_config* fb0, int pin){
+	/*A timerfd stands in for the pin's GPIO line event descriptor;
+	it's kept armed for the next pulse, so poll() wakes as it starts*/
+	sim_state* sim = fb0->backend_data;
+	if(pin < 0 || pin >= SIM_PINS){
+		return -1;
+	}
+	pthread_mutex_lock(&sim->lock);
+	if(sim->edge_timers[pin] == -1){
+		sim->edge_timers[pin] = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+		sim_arm_edge(sim, pin);
+	}
+	pthread_mutex_unlock(&sim->lock);
+	return sim->edge_timers[pin];
+}
+
+int64_t sim_edge_time(fb_config* fb0, int fd){
+	//Takes the earliest pulse that has started and not been taken yet
+	sim_state* sim = fb0->backend_data;
+	int64_t now = monotonic_ns();
+	int64_t edge = -1;
+	uint64_t expirations;
+	int i, pin;
+	if(read(fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN){
+		return -1;
+	}
+	pthread_mutex_lock(&sim->lock);
+	for(pin = 0; pin < SIM_PINS && sim->edge_timers[pin] != fd; pin++){
+	}
+	sim_pulse* first = NULL;
+	for(i = 0; i < sim->n_pulses && pin < SIM_PINS; i++){
+		sim_pulse* pulse = &sim->pulses[i];
+		if(pulse->pin == pin && !pulse->delivered && timespec_nsecs(pulse->start) <= now
+				&& (first == NULL || timespec_nsecs(pulse->start) < timespec_nsecs(first->start))){
+			first = pulse;
+		}
+	}
+	if(first != NULL){
+		first->delivered = 1;
+		edge = timespec_nsecs(first->start);
+		sim_arm_edge(sim, pin);
+	}
+	pthread_mutex_unlock(&sim->lock);
+	return edge;
+}
+
+backend hardware_backend = {"hardware", hardware_open, hardware_close, hardware_flip,
+	hardware_wait_vsync, hardware_refresh_rate, hardware_pin_mode, hardware_read_pin,
+	hardware_write_pin, hardware_edge_fd, hardware_edge_time, hardware_pan,
+	hardware_set_virtual};
+backend sim_backend = {"sim", sim_open, sim_close, sim_flip, sim_wait_vsync,
+	sim_refresh_rate, sim_pin_mode, sim_read_pin, sim_write_pin, sim_edge_fd,
+	sim_edge_time, sim_pan, sim_set_virtual};
+
+
+backend* backends[] = {&hardware_backend, &sim_backend};
+
+fb_config init(int width, int height, int flip_method, char* backend_name, backend_options* options){
+	fb_config fb0;
+	fb0.width = width;
+	fb0.height = height;
+	fb0.depth = 16;
+	fb0.size = (fb0.height)*(fb0.depth)*(fb0.width)/8;
+	fb0.flip_method = flip_method;
+	fb0.backend_data = NULL;
+	fb0.backend = NULL;
+	memset(&fb0.realtime, 0, sizeof(fb0.realtime));
+	fb0.realtime.cpu = -1;
+	fb0.error = 1;
+	int i;
+	for(i = 0; i < sizeof(backends)/sizeof(backends[0]); i++){
+		if(strcmp(backend_name, backends[i]->name) == 0){
+			fb0.backend = backends[i];
+		}
+	}
+	if(fb0.backend == NULL){
+		PyErr_Format(PyExc_ValueError, "Unknown backend %s", backend_name);
+		return fb0;
+	}
+	fb0.virtual_width = width;
+	fb0.virtual_height = 2*height;
+	if(fb0.backend->open(&fb0, options)){
+		return fb0;
+	}
+	fb0.cancel_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if(fb0.cancel_fd == -1){
+		PyErr_SetFromErrno(PyExc_OSError);
+		fb0.backend->close(&fb0);
+		return fb0;
+	}
+	fb0.keyboard = 1;
+	fb0.displaying = 0;
+	fb0.display_token = 0;
+	fb0.cancelled_token = 0;
+	fb0.refresh_rate = fb0.backend->refresh_rate(&fb0);
+	if(fb0.refresh_rate <= 0){
+		close(fb0.cancel_fd);
+		fb0.backend->close(&fb0);
+		return fb0;
+	}
+	fb0.blit = choose_blitter(fb0.map + fb0.size/2, fb0.size, &fb0.blit_usecs);
+	fb0.error = 0;
+	return fb0;
+}
+
+int close_display(fb_config fb0){
+	close(fb0.cancel_fd);
+	return fb0.backend->close(&fb0);
+}
+
+int cancel_trigger(fb_config* fb0, long token){
+	/*Ends the current display call's wait for a trigger, or its
+	playback after the current frame. Does nothing if no call is
+	under way. With a nonzero token, only the call begun with that
+	token is ended, and if it hasn't begun yet it will be as soon
+	as it does. Called with the GIL, as begin_display() is*/
+	uint64_t one = 1;
+	if(!fb0->displaying || (token != 0 && token != fb0->display_token)){
+		if(token != 0){
+			fb0->cancelled_token = token;
+		}
+		return 0;
+	}
+	return write(fb0->cancel_fd, &one, sizeof(one)) == sizeof(one) ? 0 : -1;
+}
+
+void begin_display(fb_config* fb0, long token){
+	/*Marks a display call as under way, for cancel_trigger(),
+	dropping any cancel left over from the call before, which can
+	land after that call's last look at cancel_fd*/
+	display_cancelled(*fb0);
+	fb0->displaying = 1;
+	fb0->display_token = token;
+	if(token != 0 && token == fb0->cancelled_token){
+		fb0->cancelled_token = 0;
+		cancel_trigger(fb0, token);
+	}
+}
+
+void end_display(fb_config* fb0){
+	fb0->displaying = 0;
 }
 
 
@@ -847,6 +4574,17 @@ int close_display(fb_config fb0){
 /*----------------------------------------------------*/
 
 
+static fb_config* screen_pointer(PyObject* fb0_capsule){
+    /*The fb_config of a capsule from init(), or NULL with an error
+    set if it has no framebuffer to display on any more*/
+    fb_config* fb0_pointer = PyCapsule_GetPointer(fb0_capsule, "framebuffer");
+    if (fb0_pointer != NULL && fb0_pointer->error) {
+        PyErr_SetString(PyExc_OSError, "The framebuffer could not be restored after display_drift(), so this screen can no longer display. Close it and open a new one");
+        return NULL;
+    }
+    return fb0_pointer;
+}
+
 static PyObject* py_rgb_to_uint(PyObject *self, PyObject *args) {
   int red, green, blue;
   if(!PyArg_ParseTuple(args, "iii", &red, &green, &blue)) {
@@ -861,30 +4599,109 @@ static PyObject* py_buildgrating(PyObject *self, PyObject *args) {
     double duration, angle, sf, tf, contrast, percent_sigma, percent_diameter,
            percent_center_left, percent_center_top, percent_padding;
     int width, height, waveform, background;
-    if (!PyArg_ParseTuple(args, "sdddddiiiiddddd", &filename, &duration, &angle,
+    int threads = 1;
+    int kernel = KERNEL_EXACT;
+    int format = FORMAT_FRAMES;
+    int fps = 0;
+    if (!PyArg_ParseTuple(args, "sdddddiiiiddddd|iiii", &filename, &duration, &angle,
                           &sf, &tf, &contrast, &background, &width, &height, &waveform,
                           &percent_sigma, &percent_diameter, &percent_center_left,
-			  &percent_center_top, &percent_padding)){
+			  &percent_center_top, &percent_padding, &threads, &kernel, &format, &fps)){
         return NULL;
     }
-    if(build_grating(filename,duration,angle,sf,tf,contrast,background,width,height,waveform,
+    int status;
+    //building can take minutes, let other Python threads run meanwhile
+    Py_BEGIN_ALLOW_THREADS
+    status = build_grating(filename,duration,angle,sf,tf,contrast,background,width,height,waveform,
 			percent_sigma, percent_diameter,percent_center_left,
-			percent_center_top, percent_padding)){
+			percent_center_top, percent_padding, threads, kernel, format, fps);
+    Py_END_ALLOW_THREADS
+    if(status){
         return NULL;
     }
     Py_RETURN_NONE;
 }
 
+static PyObject* py_measurerefreshrate(PyObject* self, PyObject* args){
+    int rate;
+    Py_BEGIN_ALLOW_THREADS
+    rate = get_refresh_rate();
+    Py_END_ALLOW_THREADS
+    if (rate <= 0) {
+        return NULL;
+    }
+    return Py_BuildValue("i", rate);
+}
+
+static PyObject* py_setsimd(PyObject *self, PyObject *args) {
+    char* name = "auto";
+    if (!PyArg_ParseTuple(args, "|s", &name)) {
+        return NULL;
+    }
+    if (select_pixel_kernels(name)) {
+        PyErr_Format(PyExc_ValueError, "Kernels %s are unknown or not supported by this CPU", name);
+        return NULL;
+    }
+    return Py_BuildValue("s", kernels->name);
+}
+
+static PyObject* py_renderframe(PyObject *self, PyObject *args) {
+    int t, fps, width, height, waveform, background;
+    double angle, sf, tf, contrast, percent_sigma, percent_diameter,
+           percent_center_left, percent_center_top, percent_padding;
+    int threads = 1;
+    int kernel = KERNEL_EXACT;
+    if (!PyArg_ParseTuple(args, "iiddddiiiiddddd|ii", &t, &fps, &angle,
+                          &sf, &tf, &contrast, &background, &width, &height, &waveform,
+                          &percent_sigma, &percent_diameter, &percent_center_left,
+			  &percent_center_top, &percent_padding, &threads, &kernel)){
+        return NULL;
+    }
+    fb_config fb0;
+    fb0.width = width;
+    fb0.height = height;
+    fb0.depth = 16;
+    fb0.size = (fb0.height)*(fb0.depth)*(fb0.width)/8;
+    grating_params params;
+    if(grating_params_init(&params, fb0, fps, angle, sf, tf, contrast, background, waveform,
+			percent_sigma, percent_diameter, percent_center_left,
+			percent_center_top, percent_padding, kernel)){
+        return NULL;
+    }
+    PyObject* frame = PyBytes_FromStringAndSize(NULL, fb0.size);
+    render_pool* pool = render_pool_create(threads);
+    if(frame == NULL || pool == NULL){
+        Py_XDECREF(frame);
+        if(pool != NULL){
+            render_pool_destroy(pool);
+        }
+        grating_params_release(&params);
+        return pool == NULL ? PyErr_NoMemory() : NULL;
+    }
+    build_frame((uint16_t*)PyBytes_AS_STRING(frame), t, &params, fb0, 0, fb0.height, pool);
+    render_pool_destroy(pool);
+    grating_params_release(&params);
+    return frame;
+}
+
 
 
 static PyObject* py_init(PyObject *self, PyObject *args) {
     int xres,yres;
-    if (!PyArg_ParseTuple(args, "ii", &xres, &yres)) {
+    int flip_method = FLIP_MAILBOX;
+    char* backend_name = "hardware";
+    backend_options options = {60, NULL};
+    if (!PyArg_ParseTuple(args, "ii|isiz", &xres, &yres, &flip_method, &backend_name,
+                          &options.refresh_rate, &options.framebuffer_file)) {
         return NULL;
     }
-    fb_config* fb0_pointer = malloc(sizeof(fb_config)); 
-    *fb0_pointer = init(xres,yres);
+    fb_config* fb0_pointer = malloc(sizeof(fb_config));
+    if(fb0_pointer == NULL){
+        return PyErr_NoMemory();
+    }
+    *fb0_pointer = init(xres,yres,flip_method,backend_name,&options);
     if(fb0_pointer->error){
+        free(fb0_pointer);
         return NULL;
     }
     PyObject* fb0_capsule = PyCapsule_New(fb0_pointer, "framebuffer",NULL);
@@ -892,13 +4709,77 @@ static PyObject* py_init(PyObject *self, PyObject *args) {
     return fb0_capsule;
 }
 
+static PyObject* py_simtrigger(PyObject* self, PyObject* args){
+    PyObject* fb0_capsule;
+    int pin;
+    double delay, duration;
+    if (!PyArg_ParseTuple(args, "Oidd", &fb0_capsule, &pin, &delay, &duration)) {
+        return NULL;
+    }
+    fb_config* fb0_pointer = PyCapsule_GetPointer(fb0_capsule,"framebuffer");
+    if (fb0_pointer == NULL) {
+        return NULL;
+    }
+    if (fb0_pointer->backend != &sim_backend) {
+        PyErr_SetString(PyExc_ValueError, "Triggers can only be simulated with the sim backend");
+        return NULL;
+    }
+    if (sim_schedule_pulse(fb0_pointer, pin, delay, duration)) {
+        return PyErr_NoMemory();
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject* py_canceltrigger(PyObject* self, PyObject* args){
+    PyObject* fb0_capsule;
+    long token = 0;
+    if (!PyArg_ParseTuple(args, "O|l", &fb0_capsule, &token)) {
+        return NULL;
+    }
+    fb_config* fb0_pointer = PyCapsule_GetPointer(fb0_capsule,"framebuffer");
+    if (fb0_pointer == NULL) {
+        return NULL;
+    }
+    if (cancel_trigger(fb0_pointer, token)) {
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject* py_blitinfo(PyObject* self, PyObject* args){
+    PyObject* fb0_capsule;
+    if (!PyArg_ParseTuple(args, "O", &fb0_capsule)) {
+        return NULL;
+    }
+    fb_config* fb0_pointer = PyCapsule_GetPointer(fb0_capsule,"framebuffer");
+    if (fb0_pointer == NULL) {
+        return NULL;
+    }
+    return Py_BuildValue("(sl)", fb0_pointer->blit->name, fb0_pointer->blit_usecs);
+}
+
+static PyObject* py_refreshrate(PyObject* self, PyObject* args){
+    PyObject* fb0_capsule;
+    if (!PyArg_ParseTuple(args, "O", &fb0_capsule)) {
+        return NULL;
+    }
+    fb_config* fb0_pointer = PyCapsule_GetPointer(fb0_capsule,"framebuffer");
+    if (fb0_pointer == NULL) {
+        return NULL;
+    }
+    return PyLong_FromLong(fb0_pointer->refresh_rate);
+}
+
 static PyObject* py_displaycolor(PyObject* self, PyObject* args){
     PyObject* fb0_capsule;
     int r,g,b;
         if (!PyArg_ParseTuple(args, "Oiii", &fb0_capsule,&r,&g,&b)) {
         return NULL;
     }
-    fb_config* fb0_pointer = PyCapsule_GetPointer(fb0_capsule,"framebuffer");
+    fb_config* fb0_pointer = screen_pointer(fb0_capsule);
+    if (fb0_pointer == NULL) {
+        return NULL;
+    }
     display_color(*fb0_pointer,1,rgb_to_uint(r,g,b));
     display_color(*fb0_pointer,0,rgb_to_uint(r,g,b));
     Py_RETURN_NONE;
@@ -908,11 +4789,15 @@ static PyObject* py_displaycolor(PyObject* self, PyObject* args){
 static PyObject* py_loadgrating(PyObject* self, PyObject* args){
     PyObject* fb0_capsule;
     char* filename;
-        if (!PyArg_ParseTuple(args, "Os", &fb0_capsule,&filename)) {
+    int mode = 0;
+        if (!PyArg_ParseTuple(args, "Os|i", &fb0_capsule,&filename,&mode)) {
         return NULL;
     }
     fb_config* fb0_pointer = PyCapsule_GetPointer(fb0_capsule,"framebuffer");
-    uint16_t* grating_data = load_grating(filename,*fb0_pointer);
+    stimulus* grating_data = load_grating(filename,*fb0_pointer,mode);
+    if (grating_data == NULL && PyErr_Occurred()) {
+        return NULL;
+    }
     if (grating_data == NULL) {
         PyErr_Format(PyExc_FileNotFoundError, "You probably mistyped the file name. Parsed as %s", filename);
  	return NULL;
@@ -923,11 +4808,20 @@ static PyObject* py_loadgrating(PyObject* self, PyObject* args){
 }
 
 static PyObject* py_loadraw(PyObject* self, PyObject* args){
+    PyObject* fb0_capsule;
     char* filename;
-    if (!PyArg_ParseTuple(args, "s", &filename)) {
+    int mode = 0;
+    if (!PyArg_ParseTuple(args, "Os|i", &fb0_capsule, &filename, &mode)) {
+        return NULL;
+    }
+    fb_config* fb0_pointer = PyCapsule_GetPointer(fb0_capsule, "framebuffer");
+    if (fb0_pointer == NULL) {
+        return NULL;
+    }
+    stimulus* raw_data = load_raw(filename, *fb0_pointer, mode);
+    if (raw_data == NULL && PyErr_Occurred()) {
         return NULL;
     }
-    uint16_t* raw_data = load_raw(filename);
     if (raw_data == NULL) {
         PyErr_Format(PyExc_FileNotFoundError, "You probably mistyped the file name. Parsed as %s", filename);
         return NULL;
@@ -937,6 +4831,26 @@ static PyObject* py_loadraw(PyObject* self, PyObject* args){
     return raw_capsule;
 }
 
+static PyObject* py_rawfrombuffer(PyObject* self, PyObject* args){
+    PyObject* fb0_capsule;
+    PyObject* source;
+    int refresh_per_frame;
+    if (!PyArg_ParseTuple(args, "OOi", &fb0_capsule, &source, &refresh_per_frame)) {
+        return NULL;
+    }
+    fb_config* fb0_pointer = PyCapsule_GetPointer(fb0_capsule, "framebuffer");
+    if (fb0_pointer == NULL) {
+        return NULL;
+    }
+    stimulus* raw_data = raw_from_buffer(source, *fb0_pointer, refresh_per_frame);
+    if (raw_data == NULL) {
+        return NULL;
+    }
+    PyObject* raw_capsule = PyCapsule_New(raw_data, "raw_data", NULL);
+    Py_INCREF(raw_capsule);
+    return raw_capsule;
+}
+
 static PyObject* py_unloadgrating(PyObject* self, PyObject* args){
     PyObject* grating_capsule;
     void* grating_pointer;
@@ -944,7 +4858,10 @@ static PyObject* py_unloadgrating(PyObject* self, PyObject* args){
         return NULL;
     }
     grating_pointer = PyCapsule_GetPointer(grating_capsule,"grating_data");
-    unload_grating(grating_pointer);
+    if (grating_pointer == NULL) {
+        return NULL;
+    }
+    unload_stimulus(grating_pointer);
     Py_DECREF(grating_capsule);
     Py_RETURN_NONE;
 }
@@ -956,57 +4873,456 @@ static PyObject* py_unloadraw(PyObject* self, PyObject* args) {
         return NULL;
     }
     raw_pointer = PyCapsule_GetPointer(raw_capsule, "raw_data");
-    unload_raw(raw_pointer);
+    if (raw_pointer == NULL) {
+        return NULL;
+    }
+    unload_stimulus(raw_pointer);
     Py_DECREF(raw_capsule);
     Py_RETURN_NONE;
 }
 
+static PyObject* display_result(int status, display_summary* summary, int start_time, PyObject* trace, int want_trace){
+    /*Builds what display_grating and display_raw return: None if
+    a key was pressed before the trigger, or the summary, followed
+    by the trace if it was asked for. Steals trace*/
+    if (status == -1) {
+        Py_DECREF(trace);
+        return NULL;
+    }
+    if (status == 1) {
+        Py_DECREF(trace);
+        Py_RETURN_NONE;
+    }
+    if (!want_trace) {
+        Py_DECREF(trace);
+        trace = Py_None;
+        Py_INCREF(trace);
+    }
+    return Py_BuildValue("(ddiddddiLdN)", summary->mean_interframe, summary->std_interframe,
+                         start_time, summary->mean_copy, summary->max_copy,
+                         summary->mean_flip, summary->max_flip, summary->missed_vsyncs,
+                         (long long)summary->trigger_ns, summary->trigger_latency, trace);
+}
+
 static PyObject* py_displaygrating(PyObject* self, PyObject* args){
     PyObject* fb0_capsule;
     PyObject* grating_capsule;
     int trig_pin;
-    if (!PyArg_ParseTuple(args, "OOi", &fb0_capsule,&grating_capsule,&trig_pin)) {
+    int want_trace = 0;
+    int keyboard = 1;
+    long token = 0;
+    if (!PyArg_ParseTuple(args, "OOi|ppl", &fb0_capsule,&grating_capsule,&trig_pin,&want_trace,&keyboard, &token)) {
         return NULL;
     }
-    fb_config* fb0_pointer = PyCapsule_GetPointer(fb0_capsule,"framebuffer");
-    uint16_t* grating_data = PyCapsule_GetPointer(grating_capsule,"grating_data");
-    if(grating_data == NULL){
+    fb_config* fb0_pointer = screen_pointer(fb0_capsule);
+    stimulus* grating_data = PyCapsule_GetPointer(grating_capsule,"grating_data");
+    if(fb0_pointer == NULL || grating_data == NULL){
+        return NULL;
+    }
+    //The trace is written straight into the bytes object Python gets
+    PyObject* trace = PyBytes_FromStringAndSize(NULL,
+            grating_data->n_frames*sizeof(frame_record));
+    if (trace == NULL) {
         return NULL;
     }
+    display_summary summary;
     int start_time = time(NULL);
-    float* grat_info = display_grating(grating_data,*fb0_pointer,trig_pin);
-    if (grat_info == 0) {
-        free(grat_info);
-        Py_RETURN_NONE;
-    } else {
-        PyObject* return_tuple = Py_BuildValue("(ddi)",*grat_info,*(grat_info+1),start_time);
-        free(grat_info);
-        return return_tuple;
+    display_job job = {display_grating, (uint16_t*)grating_data, *fb0_pointer, trig_pin,
+                       (frame_record*)PyBytes_AS_STRING(trace), &summary, 0};
+    job.fb0.keyboard = keyboard;
+    int status;
+    //Let a prefetching thread load the next stimulus while this one plays
+    begin_display(fb0_pointer, token);
+    Py_BEGIN_ALLOW_THREADS
+    status = run_display(fb0_pointer, &job, lock_stimulus(fb0_pointer, grating_data), NULL, 0,
+                         PyBytes_GET_SIZE(trace));
+    Py_END_ALLOW_THREADS
+    end_display(fb0_pointer);
+    return display_result(status, &summary, start_time, trace, want_trace);
+}
+
+static PyObject* py_displaydrift(PyObject* self, PyObject* args){
+    PyObject* fb0_capsule;
+    int fps, background, waveform, kernel, trig_pin;
+    double duration, angle, sf, tf, contrast;
+    int want_trace = 0;
+    int keyboard = 1;
+    if (!PyArg_ParseTuple(args, "Odiddddiiii|pp", &fb0_capsule, &duration, &fps, &angle,
+                          &sf, &tf, &contrast, &background, &waveform, &kernel,
+                          &trig_pin, &want_trace, &keyboard)) {
+        return NULL;
+    }
+    fb_config* fb0_pointer = screen_pointer(fb0_capsule);
+    if (fb0_pointer == NULL) {
+        return NULL;
+    }
+    int n_frames = fps*duration;
+    if (n_frames < 1) {
+        PyErr_SetString(PyExc_ValueError, "A drift must last at least one frame");
+        return NULL;
+    }
+    grating_params params;
+    if (grating_params_init(&params, *fb0_pointer, fps, angle, sf, tf, contrast, background,
+                            waveform, 0, 0, 0, 0, 0, kernel)) {
+        return NULL;
+    }
+    if (params.angle != ANGLE_0 && params.angle != ANGLE_90 &&
+        params.angle != ANGLE_180 && params.angle != ANGLE_270) {
+        grating_params_release(&params);
+        PyErr_Format(PyExc_ValueError, "Only gratings at 0, 90, 180 or 270 degrees can drift by panning, not %d", (int)angle);
+        return NULL;
+    }
+    PyObject* trace = PyBytes_FromStringAndSize(NULL, n_frames*sizeof(frame_record));
+    if (trace == NULL) {
+        grating_params_release(&params);
+        return NULL;
+    }
+    drift_plan plan;
+    display_summary summary;
+    int start_time = time(NULL);
+    int status;
+    begin_display(fb0_pointer, 0);
+    Py_BEGIN_ALLOW_THREADS
+    status = drift_prepare(fb0_pointer, &params, n_frames, &plan) ? -1 : 0;
+    if (status == 0) {
+        //made after drift_prepare() so its copy of fb0 has the enlarged map
+        display_job job = {display_drift, (uint16_t*)&plan, *fb0_pointer, trig_pin,
+                           (frame_record*)PyBytes_AS_STRING(trace), &summary, 0};
+        job.fb0.keyboard = keyboard;
+        status = run_display(fb0_pointer, &job, 0, &plan, sizeof(plan), PyBytes_GET_SIZE(trace));
+        if (drift_finish(fb0_pointer, &plan)) {
+            status = -1;
+        }
+    }
+    Py_END_ALLOW_THREADS
+    end_display(fb0_pointer);
+    grating_params_release(&params);
+    return display_result(status, &summary, start_time, trace, want_trace);
+}
+
+static PyObject* py_displayprocedural(PyObject* self, PyObject* args){
+    PyObject* fb0_capsule;
+    int fps, background, waveform, kernel, threads, trig_pin;
+    double duration, angle, sf, tf, contrast, percent_sigma, percent_diameter,
+           percent_center_left, percent_center_top, percent_padding;
+    int want_trace = 0;
+    int keyboard = 1;
+    if (!PyArg_ParseTuple(args, "Odiddddiidddddiii|pp", &fb0_capsule, &duration, &fps, &angle,
+                          &sf, &tf, &contrast, &background, &waveform, &percent_sigma,
+                          &percent_diameter, &percent_center_left, &percent_center_top,
+                          &percent_padding, &kernel, &threads, &trig_pin, &want_trace, &keyboard)) {
+        return NULL;
+    }
+    fb_config* fb0_pointer = screen_pointer(fb0_capsule);
+    if (fb0_pointer == NULL) {
+        return NULL;
+    }
+    procedural_plan plan;
+    plan.n_frames = fps*duration;
+    if (plan.n_frames < 1) {
+        PyErr_SetString(PyExc_ValueError, "A procedural grating must last at least one frame");
+        return NULL;
+    }
+    grating_params params;
+    if (grating_params_init(&params, *fb0_pointer, fps, angle, sf, tf, contrast, background,
+                            waveform, percent_sigma, percent_diameter, percent_center_left,
+                            percent_center_top, percent_padding, kernel)) {
+        return NULL;
+    }
+    plan.params = &params;
+    plan.late_frames = 0;
+    PyObject* trace = PyBytes_FromStringAndSize(NULL, plan.n_frames*sizeof(frame_record));
+    plan.pool = render_pool_create(threads);
+    if (trace == NULL || plan.pool == NULL) {
+        Py_XDECREF(trace);
+        if (plan.pool != NULL) {
+            render_pool_destroy(plan.pool);
+        }
+        grating_params_release(&params);
+        return trace == NULL ? NULL : PyErr_NoMemory();
     }
+    display_summary summary;
+    int start_time = time(NULL);
+    display_job job = {display_procedural, (uint16_t*)&plan, *fb0_pointer, trig_pin,
+                       (frame_record*)PyBytes_AS_STRING(trace), &summary, 0};
+    job.fb0.keyboard = keyboard;
+    int status;
+    begin_display(fb0_pointer, 0);
+    Py_BEGIN_ALLOW_THREADS
+    status = run_display(fb0_pointer, &job, 0, &plan, sizeof(plan), PyBytes_GET_SIZE(trace));
+    render_pool_destroy(plan.pool);
+    Py_END_ALLOW_THREADS
+    end_display(fb0_pointer);
+    grating_params_release(&params);
+    PyObject* result = display_result(status, &summary, start_time, trace, want_trace);
+    if (result == NULL || result == Py_None) {
+        return result;
+    }
+    PyObject* deadline_stats = Py_BuildValue("(i)", plan.late_frames);
+    PyObject* full = deadline_stats == NULL ? NULL : PySequence_Concat(result, deadline_stats);
+    Py_DECREF(result);
+    Py_XDECREF(deadline_stats);
+    return full;
 }
 
 static PyObject* py_displayraw(PyObject* self, PyObject* args){
     PyObject* fb0_capsule;
     PyObject* raw_capsule;
     int trig_pin;
-    if (!PyArg_ParseTuple(args, "OOi", &fb0_capsule, &raw_capsule, &trig_pin)) {
+    int want_trace = 0;
+    int keyboard = 1;
+    long token = 0;
+    if (!PyArg_ParseTuple(args, "OOi|ppl", &fb0_capsule, &raw_capsule, &trig_pin, &want_trace, &keyboard, &token)) {
         return NULL;
     }
-    fb_config* fb0_pointer = PyCapsule_GetPointer(fb0_capsule, "framebuffer");
-    uint16_t* raw_data = PyCapsule_GetPointer(raw_capsule, "raw_data");
-    if(raw_data == NULL){
+    fb_config* fb0_pointer = screen_pointer(fb0_capsule);
+    stimulus* raw_data = PyCapsule_GetPointer(raw_capsule, "raw_data");
+    if(fb0_pointer == NULL || raw_data == NULL){
+        return NULL;
+    }
+    PyObject* trace = PyBytes_FromStringAndSize(NULL,
+            raw_data->n_frames*sizeof(frame_record));
+    if (trace == NULL) {
         return NULL;
     }
+    display_summary summary;
     int start_time = time(NULL);
-    float* raw_info = display_raw(raw_data, *fb0_pointer, trig_pin);
-    if (raw_info == 0) {
-        free(raw_info);
-        Py_RETURN_NONE;
-    } else {
-        PyObject* return_tuple = Py_BuildValue("(ddi)", *raw_info, *(raw_info+1), start_time);
-        free(raw_info);
-        return return_tuple;
+    display_job job = {display_raw, (uint16_t*)raw_data, *fb0_pointer, trig_pin,
+                       (frame_record*)PyBytes_AS_STRING(trace), &summary, 0};
+    job.fb0.keyboard = keyboard;
+    int status;
+    begin_display(fb0_pointer, token);
+    Py_BEGIN_ALLOW_THREADS
+    status = run_display(fb0_pointer, &job, lock_stimulus(fb0_pointer, raw_data), NULL, 0,
+                         PyBytes_GET_SIZE(trace));
+    Py_END_ALLOW_THREADS
+    end_display(fb0_pointer);
+    return display_result(status, &summary, start_time, trace, want_trace);
+}
+
+static PyObject* py_streamraw(PyObject* self, PyObject* args){
+    PyObject* fb0_capsule;
+    char* filename;
+    int trig_pin, ring_frames;
+    int want_trace = 0;
+    int keyboard = 1;
+    if (!PyArg_ParseTuple(args, "Osii|pp", &fb0_capsule, &filename, &trig_pin, &ring_frames,
+                          &want_trace, &keyboard)) {
+        return NULL;
+    }
+    fb_config* fb0_pointer = screen_pointer(fb0_capsule);
+    if (fb0_pointer == NULL) {
+        return NULL;
+    }
+    if (ring_frames < 2) {
+        PyErr_SetString(PyExc_ValueError, "The ring needs at least 2 frames");
+        return NULL;
+    }
+    raw_stream* stream = raw_stream_open(filename, *fb0_pointer, ring_frames);
+    if (stream == NULL) {
+        return NULL;
+    }
+    PyObject* trace = PyBytes_FromStringAndSize(NULL, stream->n_frames*sizeof(frame_record));
+    if (trace == NULL) {
+        Py_BEGIN_ALLOW_THREADS
+        raw_stream_close(stream);
+        Py_END_ALLOW_THREADS
+        return NULL;
+    }
+    display_summary summary;
+    int start_time = time(NULL);
+    display_job job = {display_raw_stream, (uint16_t*)stream, *fb0_pointer, trig_pin,
+                       (frame_record*)PyBytes_AS_STRING(trace), &summary, 0};
+    job.fb0.keyboard = keyboard;
+    int status, underruns, min_buffered;
+    begin_display(fb0_pointer, 0);
+    Py_BEGIN_ALLOW_THREADS
+    //the ring is locked by raw_stream_open() if need be
+    status = run_display(fb0_pointer, &job, 0, NULL, 0, PyBytes_GET_SIZE(trace));
+    underruns = stream->underruns;
+    min_buffered = stream->min_buffered;
+    raw_stream_close(stream);
+    Py_END_ALLOW_THREADS
+    end_display(fb0_pointer);
+    PyObject* result = display_result(status, &summary, start_time, trace, want_trace);
+    if (result == NULL || result == Py_None) {
+        return result;
+    }
+    PyObject* stream_stats = Py_BuildValue("(ii)", underruns, min_buffered);
+    PyObject* full = stream_stats == NULL ? NULL : PySequence_Concat(result, stream_stats);
+    Py_DECREF(result);
+    Py_XDECREF(stream_stats);
+    return full;
+}
+
+static PyObject* py_displaysequence(PyObject* self, PyObject* args){
+    PyObject* fb0_capsule;
+    PyObject* step_list;
+    int trig_pin, background;
+    int want_trace = 0;
+    int keyboard = 1;
+    if (!PyArg_ParseTuple(args, "OO!ii|pp", &fb0_capsule, &PyList_Type, &step_list, &trig_pin,
+                          &background, &want_trace, &keyboard)) {
+        return NULL;
+    }
+    fb_config* fb0_pointer = screen_pointer(fb0_capsule);
+    if (fb0_pointer == NULL) {
+        return NULL;
+    }
+    sequence seq;
+    seq.n_steps = PyList_GET_SIZE(step_list);
+    seq.steps = calloc(seq.n_steps > 0 ? seq.n_steps : 1, sizeof(sequence_step));
+    seq.grey = malloc(fb0_pointer->size);
+    if (seq.steps == NULL || seq.grey == NULL) {
+        free(seq.steps);
+        free(seq.grey);
+        return PyErr_NoMemory();
+    }
+    size_t n_frames = 0;
+    int i;
+    for (i = 0; i < seq.n_steps && !PyErr_Occurred(); i++) {
+        //(STEP_STIMULUS, capsule), (STEP_GREY, refreshes) or (STEP_PIN, pin, value)
+        PyObject* item = PyList_GET_ITEM(step_list, i);
+        sequence_step* step = &seq.steps[i];
+        PyObject* capsule;
+        if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) < 2) {
+            PyErr_Format(PyExc_TypeError, "Step %d of the sequence is not a tuple", i);
+            break;
+        }
+        step->kind = PyLong_AsLong(PyTuple_GET_ITEM(item, 0));
+        if (step->kind == STEP_STIMULUS && PyArg_ParseTuple(item, "iO", &step->kind, &capsule)) {
+            const char* name = PyCapsule_CheckExact(capsule) ? PyCapsule_GetName(capsule) : NULL;
+            if (name == NULL || (strcmp(name, "grating_data") && strcmp(name, "raw_data"))) {
+                PyErr_Format(PyExc_TypeError, "Step %d of the sequence is not a loaded stimulus", i);
+                break;
+            }
+            step->stim = PyCapsule_GetPointer(capsule, name);
+            n_frames += step->stim->n_frames;
+        } else if (step->kind == STEP_GREY && PyArg_ParseTuple(item, "ii", &step->kind, &step->refreshes)) {
+            if (step->refreshes < 0) {
+                PyErr_Format(PyExc_ValueError, "Step %d of the sequence has a negative number of refreshes", i);
+            }
+        } else if (step->kind == STEP_PIN && PyArg_ParseTuple(item, "iii", &step->kind, &step->pin, &step->value)) {
+            step->value = step->value ? HIGH : LOW;
+        } else if (!PyErr_Occurred()) {
+            PyErr_Format(PyExc_ValueError, "Step %d of the sequence is of unknown kind %d", i, step->kind);
+        }
+    }
+    PyObject* trace = PyErr_Occurred() ? NULL : PyBytes_FromStringAndSize(NULL, n_frames*sizeof(frame_record));
+    if (trace == NULL) {
+        free(seq.steps);
+        free(seq.grey);
+        return NULL;
+    }
+    uint16_t grey = rgb_to_uint(background, background, background);
+    size_t pixel;
+    for (pixel = 0; pixel < fb0_pointer->size/sizeof(uint16_t); pixel++) {
+        seq.grey[pixel] = grey;
+    }
+    display_summary summary;
+    int start_time = time(NULL);
+    display_job job = {display_sequence, (uint16_t*)&seq, *fb0_pointer, trig_pin,
+                       (frame_record*)PyBytes_AS_STRING(trace), &summary, 0};
+    job.fb0.keyboard = keyboard;
+    int status;
+    int stimuli_locked = 0;
+    begin_display(fb0_pointer, 0);
+    Py_BEGIN_ALLOW_THREADS
+    //run_display() locks the grey frame for this call only
+    for (i = 0; i < seq.n_steps; i++) {
+        if (seq.steps[i].stim != NULL && lock_stimulus(fb0_pointer, seq.steps[i].stim)) {
+            stimuli_locked = -1;
+        }
+    }
+    status = run_display(fb0_pointer, &job, stimuli_locked, seq.grey, fb0_pointer->size, PyBytes_GET_SIZE(trace));
+    Py_END_ALLOW_THREADS
+    end_display(fb0_pointer);
+    PyObject* result = NULL;
+    if (status == 0) {
+        result = PyList_New(0);
+    } else if (status == 1) {
+        result = Py_None;
+        Py_INCREF(result);
+    }
+    size_t f = 0;
+    for (i = 0; i < seq.n_steps && result != NULL && status == 0; i++) {
+        //one display_result() per stimulus, with its part of the trace and its onset
+        sequence_step* step = &seq.steps[i];
+        if (step->kind != STEP_STIMULUS) {
+            continue;
+        }
+        PyObject* part = PyBytes_FromStringAndSize(PyBytes_AS_STRING(trace) + f*sizeof(frame_record),
+                                                   want_trace ? step->stim->n_frames*sizeof(frame_record) : 0);
+        f += step->stim->n_frames;
+        PyObject* record = part == NULL ? NULL : display_result(0, &step->summary, start_time, part, want_trace);
+        PyObject* onset = record == NULL ? NULL : Py_BuildValue("(LLL)", (long long)step->onset_ns,
+                                                                 (long long)step->onset_vsync,
+                                                                 (long long)step->late_vsyncs);
+        PyObject* full = onset == NULL ? NULL : PySequence_Concat(record, onset);
+        Py_XDECREF(record);
+        Py_XDECREF(onset);
+        if (full == NULL || PyList_Append(result, full) == -1) {
+            Py_CLEAR(result);
+        }
+        Py_XDECREF(full);
+    }
+    Py_DECREF(trace);
+    free(seq.steps);
+    free(seq.grey);
+    return result;
+}
+
+static PyObject* py_setrealtime(PyObject* self, PyObject* args){
+    PyObject* fb0_capsule;
+    int priority, cpu, lock;
+    if (!PyArg_ParseTuple(args, "Oiip", &fb0_capsule, &priority, &cpu, &lock)) {
+        return NULL;
+    }
+    fb_config* fb0_pointer = PyCapsule_GetPointer(fb0_capsule,"framebuffer");
+    if (fb0_pointer == NULL) {
+        return NULL;
+    }
+    if (priority != 0 && (priority < sched_get_priority_min(SCHED_FIFO) ||
+                          priority > sched_get_priority_max(SCHED_FIFO))) {
+        PyErr_Format(PyExc_ValueError, "priority must be between %d and %d, or 0 to turn real-time mode off",
+                     sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+        return NULL;
+    }
+    if (priority == 0 || !lock) {
+        unlock_framebuffer(fb0_pointer);
+    }
+    fb0_pointer->realtime.priority = priority;
+    fb0_pointer->realtime.cpu = cpu;
+    fb0_pointer->realtime.lock = lock;
+    Py_RETURN_NONE;
+}
+
+static PyObject* py_probejitter(PyObject* self, PyObject* args){
+    PyObject* fb0_capsule;
+    int n_frames;
+    if (!PyArg_ParseTuple(args, "Oi", &fb0_capsule, &n_frames)) {
+        return NULL;
+    }
+    fb_config* fb0_pointer = screen_pointer(fb0_capsule);
+    if (fb0_pointer == NULL) {
+        return NULL;
+    }
+    if (n_frames < 2) {
+        PyErr_SetString(PyExc_ValueError, "The probe needs at least 2 frames");
+        return NULL;
+    }
+    frame_record* trace = malloc(n_frames*sizeof(frame_record));
+    if (trace == NULL) {
+        return PyErr_NoMemory();
     }
+    display_summary summary;
+    display_job job = {display_probe, NULL, *fb0_pointer, n_frames, trace, &summary, 0};
+    Py_BEGIN_ALLOW_THREADS
+    run_display(fb0_pointer, &job, 0, NULL, 0, n_frames*sizeof(frame_record));
+    Py_END_ALLOW_THREADS
+    free(trace);
+    return Py_BuildValue("(ddii)", summary.mean_interframe, summary.std_interframe,
+                         summary.missed_vsyncs, fb0_pointer->realtime.granted);
 }
 
 static PyObject* py_closedisplay(PyObject* self, PyObject* args){
@@ -1024,13 +5340,39 @@ static PyObject* py_closedisplay(PyObject* self, PyObject* args){
 
 
 static PyObject* py_convertraw(PyObject* self, PyObject* args){
-	char *filename, *new_filename;
+	PyObject* source;
+	char* new_filename;
 	int n_frames, width, height, refresh_per_frame;
-	if (!PyArg_ParseTuple(args, "ssiiii", &filename, &new_filename,
+	if (!PyArg_ParseTuple(args, "Osiiii", &source, &new_filename,
 				&n_frames, &width, &height, &refresh_per_frame)) {
 		return NULL;
 	}
-	if(convert_raw(filename, new_filename, n_frames, width, height, refresh_per_frame)) {
+	int status;
+	if (PyUnicode_Check(source)) {
+		const char* filename = PyUnicode_AsUTF8(source);
+		if (filename == NULL) {
+			return NULL;
+		}
+		Py_BEGIN_ALLOW_THREADS
+		status = convert_raw((char*)filename, new_filename, n_frames, width, height, refresh_per_frame);
+		Py_END_ALLOW_THREADS
+	} else {
+		//Anything holding RGB888 bytes, e.g. a numpy uint8 array, without a copy
+		Py_buffer view;
+		if (PyObject_GetBuffer(source, &view, PyBUF_C_CONTIGUOUS) == -1) {
+			return NULL;
+		}
+		if (view.itemsize != 1) {
+			PyBuffer_Release(&view);
+			PyErr_SetString(PyExc_ValueError, "The buffer must hold bytes, e.g. a numpy uint8 array");
+			return NULL;
+		}
+		Py_BEGIN_ALLOW_THREADS
+		status = convert_raw_buffer(view.buf, view.len, new_filename, n_frames, width, height, refresh_per_frame);
+		Py_END_ALLOW_THREADS
+		PyBuffer_Release(&view);
+	}
+	if(status) {
 		return NULL;
 	}
 	Py_RETURN_NONE;
@@ -1043,6 +5385,11 @@ static PyMethodDef _rpigratings_methods[] = {
         "Initialise the display and return a framebuffer object.\n"
 	":Param xres: the virtual width of the display\n"
 	":Param yres: the virtual height of the display\n"
+	":Param flip_method: (optional) FLIP_MAILBOX or FLIP_PAN\n"
+	":Param backend: (optional) \"hardware\" or \"sim\"\n"
+	":Param refresh_rate: (optional) vsyncs per second of the sim backend\n"
+	":Param framebuffer_file: (optional) file to map the sim framebuffer\n"
+	"      from, or None for memory\n"
 	":rtype framebuffer capsule: a framebuffer object for use\n"
 	"with other functions in this module.\n"
 	"WARNING: only one instance of this object should\n"
@@ -1062,6 +5409,54 @@ static PyMethodDef _rpigratings_methods[] = {
         " >>>         raise\n",
         " >>> close_grating(root)\n",
     },  
+    {
+        "sim_trigger", py_simtrigger, METH_VARARGS,
+        "Holds a simulated input pin high for a while.\n"
+	":Param fb0: a framebuffer object returned from init() with the sim backend\n"
+	":Param pin: the wiringPi pin number\n"
+	":Param delay: seconds from now until the pin goes high\n"
+	":Param duration: seconds the pin stays high\n"
+	":rtype None:"
+    },
+    {
+        "set_realtime", py_setrealtime, METH_VARARGS,
+        "Sets how later display calls run.\n"
+	":Param fb0: a framebuffer object returned from init()\n"
+	":Param priority: SCHED_FIFO priority of the display thread, 0 to display\n"
+	"      on the calling thread as normal\n"
+	":Param cpu: CPU to pin the display thread to, or -1\n"
+	":Param lock: lock the stimulus and framebuffer in RAM while displaying\n"
+	":rtype None:"
+    },
+    {
+        "probe_jitter", py_probejitter, METH_VARARGS,
+        "Runs the display loop without a stimulus to measure its timing.\n"
+	":Param fb0: a framebuffer object returned from init()\n"
+	":Param n_frames: frames to run for\n"
+	":rtype tuple: mean and standard deviation of the interframe time in\n"
+	"      microseconds, missed vsyncs, and the REALTIME_* flags granted"
+    },
+    {
+        "cancel_trigger", py_canceltrigger, METH_VARARGS,
+        "Ends a display call's wait for its trigger, which then returns None.\n"
+	"If no call is under way, it does nothing.\n"
+	":Param fb0: a framebuffer object returned from init()\n"
+	":Param token: (optional) if not 0, only end the call made with this token\n"
+	":rtype None:"
+    },
+    {
+        "blit_info", py_blitinfo, METH_VARARGS,
+        "Reports how frames are copied to the framebuffer.\n"
+	":Param fb0: a framebuffer object returned from init()\n"
+	":rtype (str, int): the copy method init() chose, and the\n"
+	"      microseconds it took to copy one frame"
+    },
+    {
+        "refresh_rate", py_refreshrate, METH_VARARGS,
+        "Reports the refresh rate init() measured.\n"
+	":Param fb0: a framebuffer object returned from init()\n"
+	":rtype int: vsyncs per second"
+    },
     {   
         "display_color", py_displaycolor, METH_VARARGS,
         "Display a rbg color to the framebuffer.\n"
@@ -1076,12 +5471,64 @@ static PyMethodDef _rpigratings_methods[] = {
         "Displays data that has been loaded into memory to the screen.\n"
 	":Param fb0: a framebuffer object created from an init() call\n"
 	":Param data: a raw data object created from a load_grating() call\n"
-	":rtype None:"
+	":Param trigger_pin: pin to wait for, 0 to start at once\n"
+	":Param trace: (optional) if True, also return the per frame trace\n"
+	":Param keyboard: (optional) if False, key presses don't end the wait for the trigger\n"
+	":Param token: (optional) lets cancel_trigger() end this call alone\n"
+	":rtype tuple: performance summary, then the trace as bytes or None"
+    },
+{
+        "display_drift", py_displaydrift, METH_VARARGS,
+        "Drifts a full screen grating at 0, 90, 180 or 270 degrees by panning the display\n"
+	"across one strip rendered into an enlarged virtual framebuffer.\n"
+	":Param fb0: a framebuffer object created from an init() call\n"
+	":Param duration, fps, angle, sf, tf, contrast, background, waveform, kernel: as render_frame()\n"
+	":Param trigger_pin: pin to wait for, 0 to start at once\n"
+	":Param trace: (optional) if True, also return the per frame trace\n"
+	":Param keyboard: (optional) if False, key presses don't end the wait for the trigger\n"
+	":rtype tuple: performance summary, then the trace as bytes or None"
+    },
+{
+        "display_procedural", py_displayprocedural, METH_VARARGS,
+        "Renders a grating into the back buffer frame by frame as it plays, with no file.\n"
+	":Param fb0: a framebuffer object created from an init() call\n"
+	":Param duration, fps, angle, sf, tf, contrast, background, waveform: as render_frame()\n"
+	":Param percent_sigma, percent_diameter, percent_center_left, percent_center_top, percent_padding: as render_frame()\n"
+	":Param kernel, threads: as render_frame(), threads 0 for one per core\n"
+	":Param trigger_pin: pin to wait for, 0 to start at once\n"
+	":Param trace: (optional) if True, also return the per frame trace\n"
+	":Param keyboard: (optional) if False, key presses don't end the wait for the trigger\n"
+	":rtype tuple: as display_grating, followed by the frames that missed their vsync"
     },
 {
 	"display_raw", py_displayraw, METH_VARARGS,
 	":rtype None:"
 },  
+{
+	"stream_raw", py_streamraw, METH_VARARGS,
+	"Plays a raw file from disc through a ring of frames read ahead of the display.\n"
+	":Param fb0: a framebuffer object created from an init() call\n"
+	":Param filename: the raw file\n"
+	":Param trigger_pin: pin to wait for, 0 to start at once\n"
+	":Param ring_frames: frames the ring holds, at least 2\n"
+	":Param trace: (optional) if True, also return the per frame trace\n"
+	":Param keyboard: (optional) if False, key presses don't end the wait for the trigger\n"
+	":rtype tuple: as display_raw, followed by the underruns and the fewest frames buffered"
+},
+{
+	"display_sequence", py_displaysequence, METH_VARARGS,
+	"Plays a list of steps back to back, counting grey periods in refreshes.\n"
+	":Param fb0: a framebuffer object created from an init() call\n"
+	":Param steps: a list of (STEP_STIMULUS, grating or raw data), (STEP_GREY, refreshes)\n"
+	"      and (STEP_PIN, pin, value) tuples\n"
+	":Param trigger_pin: pin to wait for before the first step, 0 to start at once\n"
+	":Param background: grey level of the grey steps, 0 to 255\n"
+	":Param trace: (optional) if True, also return each stimulus's per frame trace\n"
+	":Param keyboard: (optional) if False, key presses don't end the wait for the trigger\n"
+	":rtype list: a tuple for each stimulus step, as display_raw's, followed by when its\n"
+	"      first flip returned, the refreshes since the first step's, and how many\n"
+	"      later than scheduled that was; or None if cancelled"
+},
     {   
         "build_grating", py_buildgrating, METH_VARARGS,
         "Creates a raw animation file of a drifting grating.\n"
@@ -1094,10 +5541,38 @@ static PyMethodDef _rpigratings_methods[] = {
 	":Param height: Y component of the desired resolution\n"
 	":Param waveform: SINE or SQUARE\n"
 	":Param percent_diameter: 0 for full screen or width of circlular mask\n"
+	":Param threads: (optional) number of threads to render each frame\n"
+	"      with, 0 for one per core. Defaults to 1.\n"
+	":Param kernel: (optional) KERNEL_EXACT or KERNEL_LUT\n"
+	":Param format: (optional) FORMAT_FRAMES or FORMAT_ROWSHIFT\n"
+	":Param fps: (optional) refresh rate to build for, 0 to measure the screen's\n"
 	":rtype None:\n\n"
 	"NOTE: the resolution of this file must match the resolution used\n"
 	"in init() calls that are used to display this file."
     },  
+    {
+        "measure_refresh_rate", py_measurerefreshrate, METH_NOARGS,
+        "Times vsyncs of /dev/fb0 to find the screen's refresh rate, or works\n"
+	"it out from the display timings if the driver can't wait for a vsync.\n"
+	":rtype int: refreshes per second"
+    },
+    {
+        "set_simd", py_setsimd, METH_VARARGS,
+        "Chooses which vector instructions the lookup table kernels use.\n"
+	":Param name: (optional) \"auto\" for the fastest supported, or one of\n"
+	"      \"avx2\", \"sse2\", \"neon\" or \"scalar\". Defaults to \"auto\".\n"
+	":rtype str: the name of the kernels now in use"
+    },
+    {
+        "render_frame", py_renderframe, METH_VARARGS,
+        "Renders a single frame of a grating into memory, as build_grating\n"
+	"would write it to file.\n"
+	":Param t: the frame number\n"
+	":Param fps: the refresh rate to take the temporal frequency relative to\n"
+	"The remaining parameters are as for build_grating, without the\n"
+	"filename and duration.\n"
+	":rtype bytes: width*height RGB565 pixels"
+    },
     {   
         "load_grating", py_loadgrating, METH_VARARGS,
         "Loads a raw animation file into memory for use with\n"
@@ -1105,10 +5580,13 @@ static PyMethodDef _rpigratings_methods[] = {
 	":Param fb0: a framebuffer object returned from init()\n"
 	":Param filename: (string) the raw data file to be loaded\,\n"
 	"      typically created with a draw_grating call.\n"
+	":Param mode: (optional) LOAD_* flags; 0 copies the file to the heap\n"
 	":rtype grating_data capsule: The raw data object."
     },
     {
 	"load_raw", py_loadraw, METH_VARARGS,
+	":Param fb0: framebuffer object, which the raw must be the size of\n"
+	":Param mode: (optional) LOAD_* flags, as for load_grating\n"
 	":rtype raw_data capsule"
     },  
     {   
@@ -1120,6 +5598,14 @@ static PyMethodDef _rpigratings_methods[] = {
    {
 	"unload_raw", py_unloadraw, METH_VARARGS,
 	":rtype None:"
+   },
+   {
+	"raw_from_buffer", py_rawfrombuffer, METH_VARARGS,
+	"Makes a raw data object of frames already in memory, without copying them.\n"
+	":Param fb0: a framebuffer object created from an init() call\n"
+	":Param buffer: a C-contiguous buffer of whole frames of 16 bit RGB565 pixels\n"
+	":Param refresh_per_frame: refreshes to show each frame for\n"
+	":rtype: raw data object, holding the buffer until unload_raw()"
    }, 
    {   
         "close_display", py_closedisplay, METH_VARARGS,
@@ -1129,7 +5615,10 @@ static PyMethodDef _rpigratings_methods[] = {
     },  
     {   
 	"convertraw", py_convertraw, METH_VARARGS,
-	"fillertext\n"
+	"Converts RGB888 pixels to a raw file.\n"
+	":Param source: the RGB888 file's name, or a buffer of its bytes\n"
+	":Param new_filename: the raw file to write\n"
+	":Param n_frames, width, height, refresh_per_frame: the raw file's header\n"
 	":rtype None:"
     },
     {
@@ -1172,5 +5661,11 @@ static struct PyModuleDef _rpigratings_definition = {
 
 PyMODINIT_FUNC PyInit__rpigratings(void) {
     Py_Initialize();
-    return PyModule_Create(&_rpigratings_definition);
+    select_pixel_kernels("auto");
+    have_process_cpus = sched_getaffinity(0, sizeof(process_cpus), &process_cpus) == 0;
+    PyObject* module = PyModule_Create(&_rpigratings_definition);
+    if (module != NULL) {
+        PyModule_AddIntConstant(module, "DEGREES_SUBTENDED", DEGREES_SUBTENDED);
+    }
+    return module;
 }
@@ -4,11 +4,28 @@
 from distutils.core import setup, Extension
 from setuptools.command.install import install
 import os
+import platform
+
+#Keep the compiler from fusing multiplies and adds, so the vector
+#kernels give exactly the same pixels as the plain C ones
+compile_args = ['-O3', '-ffp-contract=off']
+if platform.machine() in ('armv7l', 'armv8l'):
+  compile_args.append('-mfpu=neon-vfpv4')
+
+#wiringPi is only needed to drive the GPIO pins of a real Pi; without
+#it the module still builds, for use with the simulated backend
+link_args = ['-lpthread']
+macros = []
+if any(os.path.exists(os.path.join(d, 'wiringPi.h'))
+       for d in ('/usr/include', '/usr/local/include')):
+  macros.append(('HAVE_WIRINGPI', None))
+  link_args.insert(0, '-lwiringPi')
 
 rpygrating_module = Extension('_rpigratings', 
 		sources = ['rpg/_rpigratings.c'],
-                extra_compile_args = ['-O3'],
-		extra_link_args=['-lwiringPi'])
+                define_macros = macros,
+                extra_compile_args = compile_args,
+		extra_link_args=link_args)
 
 
 #Edit .bashrc to stop cursor showing up on main monitor
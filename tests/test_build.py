@@ -0,0 +1,66 @@
+# Checks that splitting a build between threads doesn't change what is
+# built: gratings, masks and gabors built on one thread and on several
+# must be the same files. Run it with the module built, e.g.
+#
+#   python3 -m unittest discover tests
+#
+# The height is not a multiple of the thread count, so the threads
+# are dealt different numbers of rows.
+
+import os
+import tempfile
+import unittest
+
+import rpg
+from rpg import rpigratings
+
+RESOLUTION = (97, 33)
+THREADS = (1, 4)
+
+
+class ThreadTest(unittest.TestCase):
+
+  def setUp(self):
+    self.directory = tempfile.TemporaryDirectory()
+
+  def tearDown(self):
+    self.directory.cleanup()
+
+  def test_render_frame(self):
+    stimuli = [
+      #angle, waveform, percent_sigma, percent_diameter
+      (30, rpg.SINE, 0, 0),
+      (137, rpg.SQUARE, 0, 0),
+      (30, rpg.SINE, 0, 60),
+      (30, rpg.SINE, 20, 0),
+    ]
+    for kernel in (rpg.KERNEL_EXACT, rpg.KERNEL_LUT):
+      for angle, waveform, sigma, diameter in stimuli:
+        frames = [rpigratings.render_frame(3, 60, angle, 0.02, 7, 0.9, 100,
+                                           RESOLUTION[0], RESOLUTION[1], waveform,
+                                           sigma, diameter, 40, 50, 20, threads, kernel)
+                  for threads in THREADS]
+        with self.subTest(kernel=kernel, angle=angle, sigma=sigma, diameter=diameter):
+          self.assertEqual(frames[1], frames[0])
+
+  def test_build(self):
+    options = {"duration": 0.1, "angle": 30, "spac_freq": 0.02, "temp_freq": 7,
+               "fps": 60, "resolution": RESOLUTION}
+    builds = [
+      ("grating", rpg.build_grating, {}),
+      ("mask", rpg.build_masked_grating, {"percent_diameter": 60, "percent_padding": 20}),
+      ("gabor", rpg.build_gabor, {"percent_sigma": 20}),
+    ]
+    for name, build, extra in builds:
+      files = []
+      for threads in THREADS:
+        filename = os.path.join(self.directory.name, "%s_%d" % (name, threads))
+        build(filename, dict(options, **extra), threads=threads)
+        with open(filename, "rb") as file:
+          files.append(file.read())
+      with self.subTest(stimulus=name):
+        self.assertEqual(files[1], files[0])
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,155 @@
+# Plays stimuli on a simulated screen (rpg.Screen(backend="sim")) and
+# checks what the display loop reports and draws: the summary against
+# its own per frame trace, and the frame buffers, kept in a file,
+# against the frames the stimulus should have left on screen, and
+# simulated triggers and cancelled displays. Run it with the module
+# built, e.g.
+#
+#   python3 -m unittest discover tests
+
+import os
+import statistics
+import tempfile
+import threading
+import time
+import unittest
+
+import rpg
+from rpg import rpigratings
+
+RESOLUTION = (96, 8)
+FRAME_BYTES = RESOLUTION[0]*RESOLUTION[1]*2
+TRIGGER_PIN = 6
+
+
+class DisplayTest(unittest.TestCase):
+
+  def setUp(self):
+    self.directory = tempfile.TemporaryDirectory()
+    self.framebuffer = os.path.join(self.directory.name, "framebuffer")
+    self.screen = rpg.Screen(RESOLUTION, backend="sim", framebuffer_file=self.framebuffer)
+
+  def tearDown(self):
+    self.screen.close()
+    self.directory.cleanup()
+
+  def buffers(self):
+    """the two frame buffers, as bytes"""
+    with open(self.framebuffer, "rb") as file:
+      data = file.read()
+    self.assertEqual(len(data), 2*FRAME_BYTES)
+    return data[:FRAME_BYTES], data[FRAME_BYTES:]
+
+  def check_summary(self, perf, n_frames, refreshes_per_frame):
+    """perf must summarise its own trace, of n_frames frames"""
+    self.assertEqual(len(perf.trace), n_frames*rpg._TRACE_RECORD.size)
+    trace = list(rpg._TRACE_RECORD.iter_unpack(perf.trace))
+    start, flip, vsync, count, copy_us, flip_us = zip(*trace)
+    self.assertEqual(count[0], 0)
+    missed = sum(max(0, b - a - refreshes_per_frame) for a, b in zip(count, count[1:]))
+    self.assertEqual(perf.missed_vsyncs, missed)
+    self.assertEqual(count[-1], (n_frames - 1)*refreshes_per_frame + perf.missed_vsyncs)
+    interframe = [(b - a)//1000 for a, b in zip(start, start[1:])]
+    self.assertAlmostEqual(perf.mean_interframe, statistics.mean(interframe), delta=1)
+    self.assertAlmostEqual(perf.mean_copy, statistics.mean(copy_us), places=3)
+    self.assertEqual(perf.max_copy, max(copy_us))
+    self.assertAlmostEqual(perf.mean_flip, statistics.mean(flip_us), places=3)
+    self.assertEqual(perf.max_flip, max(flip_us))
+    self.assertGreaterEqual(min(flip_us), 0)
+    for t in range(n_frames):
+      self.assertLessEqual(start[t], flip[t])
+      self.assertLessEqual(flip[t], vsync[t])
+    self.assertEqual(perf.trigger_time, 0)
+    self.assertEqual(perf.trigger_latency, 0)
+
+  def test_display_raw(self):
+    n_frames, refreshes_per_frame = 3, 2
+    #red, 0xf800 in RGB565, stored little endian
+    rgb = bytes((255, 0, 0))*(RESOLUTION[0]*RESOLUTION[1]*n_frames)
+    filename = os.path.join(self.directory.name, "raw")
+    rpg.convert_raw(rgb, filename, n_frames, RESOLUTION[0], RESOLUTION[1], refreshes_per_frame)
+    raw = self.screen.load_raw(filename)
+    perf = self.screen.display_raw(raw, trace=True)
+    self.check_summary(perf, n_frames, refreshes_per_frame)
+    #a frame shown for two refreshes is a vsync apart
+    self.assertGreater(perf.mean_interframe, 1e6/self.screen.refresh_rate)
+    for buffer in self.buffers():
+      self.assertEqual(buffer, b"\x00\xf8"*(RESOLUTION[0]*RESOLUTION[1]))
+    self.assertIsNone(self.screen.display_raw(raw).trace)
+
+  def test_display_grating(self):
+    self.check_grating()
+
+  def test_flip_methods(self):
+    for flip_method in (rpg.FLIP_MAILBOX, rpg.FLIP_PAN):
+      self.screen.close()
+      self.screen = rpg.Screen(RESOLUTION, flip_method=flip_method, backend="sim",
+                               framebuffer_file=self.framebuffer)
+      with self.subTest(flip_method=flip_method):
+        self.check_grating()
+
+  def check_grating(self):
+    """plays a grating, which must leave its last two frames in the
+    frame buffers"""
+    #6 cycles per second at 60 frames per second repeats every 10 frames,
+    #so all 6 frames of the grating are drawn
+    n_frames = 6
+    options = {"duration": 0.1, "angle": 30, "spac_freq": 0.02, "temp_freq": 6,
+               "fps": 60, "resolution": RESOLUTION}
+    filename = os.path.join(self.directory.name, "grating")
+    rpg.build_grating(filename, options)
+    grating = self.screen.load_grating(filename)
+    perf = self.screen.display_grating(grating, trace=True)
+    self.check_summary(perf, n_frames, 1)
+    frames = [rpigratings.render_frame(t, 60, 30, 0.02, 6, 1, 127, RESOLUTION[0],
+                                       RESOLUTION[1], rpg.SINE, 0, 0, 0, 0, 0)
+              for t in range(n_frames)]
+    #the last frame is displayed and the one before it is in the back buffer
+    self.assertEqual(set(self.buffers()), {frames[-1], frames[-2]})
+
+  def load_raw(self, n_frames=3):
+    """a black raw of n_frames frames"""
+    rgb = bytes(RESOLUTION[0]*RESOLUTION[1]*3*n_frames)
+    filename = os.path.join(self.directory.name, "raw")
+    rpg.convert_raw(rgb, filename, n_frames, RESOLUTION[0], RESOLUTION[1], 1)
+    return self.screen.load_raw(filename)
+
+  def test_trigger(self):
+    raw = self.load_raw()
+    delay = 0.05
+    scheduled = time.monotonic_ns()
+    self.screen.sim_trigger(TRIGGER_PIN, delay)
+    perf = self.screen.display_raw(raw, TRIGGER_PIN, trace=True, keyboard=False)
+    self.assertGreaterEqual(perf.trigger_time, scheduled + delay*1e9)
+    first_flip = next(rpg._TRACE_RECORD.iter_unpack(perf.trace))[1]
+    self.assertAlmostEqual(perf.trigger_latency, (first_flip - perf.trigger_time)/1000, delta=1)
+    #the first flip is on the next vsync after the trigger
+    self.assertGreater(perf.trigger_latency, 0)
+    self.assertLess(perf.trigger_latency, 2e6/self.screen.refresh_rate)
+
+  def test_cancel_trigger(self):
+    raw = self.load_raw()
+    cancel = threading.Timer(0.05, self.screen.cancel_trigger)
+    cancel.start()
+    try:
+      self.assertIsNone(self.screen.display_raw(raw, TRIGGER_PIN, keyboard=False))
+    finally:
+      cancel.join()
+
+  def test_cancel_handle(self):
+    raw = self.load_raw()
+    #holds the screen until the trigger, so the next display has to wait its turn
+    first = self.screen.display_raw_async(raw, TRIGGER_PIN)
+    time.sleep(0.05)
+    second = self.screen.display_raw_async(raw)
+    self.assertTrue(second.cancel())
+    self.screen.sim_trigger(TRIGGER_PIN)
+    self.assertIsNotNone(first.result(5))
+    self.assertIsNone(second.result(5))
+    self.assertFalse(second.cancel())
+    #only the cancelled display is skipped
+    self.assertIsNotNone(self.screen.display_raw(raw))
+
+
+if __name__ == "__main__":
+  unittest.main()